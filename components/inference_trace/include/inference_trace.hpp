@@ -0,0 +1,72 @@
+#pragma once
+
+#include "sdkconfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace inference_trace
+{
+    typedef enum : uint16_t
+    {
+        TRACE_INPUT_IMAGE = 1, // args: width, height, pixel type
+        TRACE_INPUT_HEAD,      // bytes: first 16 bytes of the model input
+        TRACE_INPUT_TAIL,      // bytes: last 16 bytes of the model input
+        TRACE_OUTPUT_RAW,      // arg16: exponent, bytes: first 16 bytes of the raw output
+        TRACE_SCORES,          // args: empty, nachi, ngao score, predicted index
+        TRACE_STAGE_TIMINGS,   // args: decode, preprocess, invoke, postprocess us
+        TRACE_DECODE,          // arg16: scale denominator, args: width, height
+        TRACE_BOX,             // arg16: score per mille, args: x1, y1, x2, y2 as int32
+    } event_t;
+
+    // Fixed 24 byte record, little endian as written by the CPU. /trace
+    // serves an array of these, oldest first.
+    typedef struct
+    {
+        uint32_t timestamp_us; // low 32 bits of esp_timer_get_time()
+        uint16_t event;
+        uint16_t arg16;
+        union
+        {
+            uint32_t args[4];
+            uint8_t bytes[16];
+        };
+    } record_t;
+    static_assert(sizeof(record_t) == 24, "trace records are serialized as is");
+
+#if CONFIG_INFERENCE_TRACE
+    void record(event_t event, uint16_t arg16 = 0, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0);
+    void record_bytes(event_t event, uint16_t arg16, const void *data, size_t len);
+
+    // Copies up to max records, oldest first. Returns the number copied.
+    size_t snapshot(record_t *out, size_t max);
+    uint32_t overwritten();
+#endif
+
+    typedef struct
+    {
+        int iterations{0};
+        uint32_t log_us{0};   // per frame, the debug logging that was removed
+        uint32_t trace_us{0}; // per frame, the trace points that replaced it
+    } logging_benchmark_t;
+
+    // Times the per-frame debug logging the trace points replaced against
+    // the trace points themselves. sample must hold at least 40 bytes.
+    // Run by /bench?test=logging.
+    void benchmark_logging(const uint8_t *sample, int iterations, logging_benchmark_t &result);
+} // namespace inference_trace
+
+// Trace points. With CONFIG_INFERENCE_TRACE off these expand to nothing, so
+// arguments are not evaluated either.
+#if CONFIG_INFERENCE_TRACE
+#define TRACE_RECORD(event, ...) inference_trace::record(inference_trace::event, ##__VA_ARGS__)
+#define TRACE_BYTES(event, arg16, data, len) inference_trace::record_bytes(inference_trace::event, arg16, data, len)
+#else
+#define TRACE_RECORD(event, ...) \
+    do                           \
+    {                            \
+    } while (0)
+#define TRACE_BYTES(event, arg16, data, len) \
+    do                                       \
+    {                                        \
+    } while (0)
+#endif
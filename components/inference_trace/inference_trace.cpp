@@ -0,0 +1,135 @@
+#include "inference_trace.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <string.h>
+
+static const char *TAG = "inference_trace";
+
+#if CONFIG_INFERENCE_TRACE
+static constexpr bool TRACE_ENABLED = true;
+#else
+static constexpr bool TRACE_ENABLED = false;
+#endif
+
+#if CONFIG_INFERENCE_TRACE
+static inference_trace::record_t records[CONFIG_INFERENCE_TRACE_RECORDS];
+static uint32_t written = 0;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void push(const inference_trace::record_t &rec)
+{
+    taskENTER_CRITICAL(&lock);
+    records[written % CONFIG_INFERENCE_TRACE_RECORDS] = rec;
+    written++;
+    taskEXIT_CRITICAL(&lock);
+}
+
+void inference_trace::record(event_t event, uint16_t arg16, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+    record_t rec;
+    rec.timestamp_us = (uint32_t)esp_timer_get_time();
+    rec.event = event;
+    rec.arg16 = arg16;
+    rec.args[0] = a0;
+    rec.args[1] = a1;
+    rec.args[2] = a2;
+    rec.args[3] = a3;
+    push(rec);
+}
+
+void inference_trace::record_bytes(event_t event, uint16_t arg16, const void *data, size_t len)
+{
+    record_t rec = {};
+    rec.timestamp_us = (uint32_t)esp_timer_get_time();
+    rec.event = event;
+    rec.arg16 = arg16;
+    memcpy(rec.bytes, data, len < sizeof(rec.bytes) ? len : sizeof(rec.bytes));
+    push(rec);
+}
+
+size_t inference_trace::snapshot(record_t *out, size_t max)
+{
+    // Copy in chunks so the critical section stays short.
+    taskENTER_CRITICAL(&lock);
+    uint32_t end = written;
+    taskEXIT_CRITICAL(&lock);
+    uint32_t available = end < CONFIG_INFERENCE_TRACE_RECORDS ? end : CONFIG_INFERENCE_TRACE_RECORDS;
+    if (max > available)
+    {
+        max = available;
+    }
+
+    uint32_t start = end - max;
+    size_t copied = 0;
+    while (copied < max)
+    {
+        taskENTER_CRITICAL(&lock);
+        // If the writers lap the copy, stop: what is left was overwritten.
+        if (written - (start + copied) > CONFIG_INFERENCE_TRACE_RECORDS)
+        {
+            taskEXIT_CRITICAL(&lock);
+            break;
+        }
+        size_t chunk = max - copied < 16 ? max - copied : 16;
+        for (size_t i = 0; i < chunk; i++)
+        {
+            out[copied + i] = records[(start + copied + i) % CONFIG_INFERENCE_TRACE_RECORDS];
+        }
+        taskEXIT_CRITICAL(&lock);
+        copied += chunk;
+    }
+    return copied;
+}
+
+uint32_t inference_trace::overwritten()
+{
+    taskENTER_CRITICAL(&lock);
+    uint32_t count = written > CONFIG_INFERENCE_TRACE_RECORDS ? written - CONFIG_INFERENCE_TRACE_RECORDS : 0;
+    taskEXIT_CRITICAL(&lock);
+    return count;
+}
+#endif
+
+void inference_trace::benchmark_logging(const uint8_t *sample, int iterations, logging_benchmark_t &result)
+{
+    // The statements the trace points replaced, with the same formats and
+    // arguments, at whatever the current log level lets through. sample may
+    // be unaligned, so the floats are copied out rather than loaded in place.
+    float sample_f[10];
+    memcpy(sample_f, sample, sizeof(sample_f));
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++)
+    {
+        ESP_LOGI(TAG, "Input Image Info:");
+        ESP_LOGI(TAG, "  Width: %d, Height: %d", 96, 96);
+        ESP_LOGI(TAG, "  Pix Type: %d", 0);
+        ESP_LOGI(TAG, "Sample Input Data (First 10 values):");
+        ESP_LOGI(TAG, "  As uint8: %d %d %d %d %d %d %d %d %d %d", sample[0], sample[1], sample[2], sample[3],
+                 sample[4], sample[5], sample[6], sample[7], sample[8], sample[9]);
+        ESP_LOGI(TAG, "  As float: %f %f %f %f %f %f %f %f %f %f", sample_f[0], sample_f[1], sample_f[2],
+                 sample_f[3], sample_f[4], sample_f[5], sample_f[6], sample_f[7], sample_f[8], sample_f[9]);
+        for (int j = 0; j < 20; j++)
+        {
+            ESP_LOGD(TAG, "Input tensor data[%d]=%d", j, sample[j]);
+        }
+        ESP_LOGI(TAG, "empty_score=%d nachi_score=%d ngao_score=%d", sample[0], sample[1], sample[2]);
+    }
+    int64_t log_us = (esp_timer_get_time() - start) / iterations;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++)
+    {
+        TRACE_RECORD(TRACE_INPUT_IMAGE, 0, 96, 96, 0);
+        TRACE_BYTES(TRACE_INPUT_HEAD, 0, sample, 16);
+        TRACE_BYTES(TRACE_INPUT_TAIL, 0, sample + 24, 16);
+        TRACE_RECORD(TRACE_SCORES, 0, sample[0], sample[1], sample[2], 0);
+    }
+    int64_t trace_us = (esp_timer_get_time() - start) / iterations;
+
+    result.iterations = iterations;
+    result.log_us = log_us;
+    result.trace_us = trace_us;
+    ESP_LOGI(TAG, "Per-frame debug output over %d frames: logging %lld us, trace %lld us (%s), recovered %lld us",
+             iterations, log_us, trace_us, TRACE_ENABLED ? "enabled" : "compiled out", log_us - trace_us);
+}
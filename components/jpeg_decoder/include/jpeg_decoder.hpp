@@ -0,0 +1,107 @@
+#pragma once
+
+#include <esp_jpeg_common.h>
+#include <esp_jpeg_dec.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace jpeg_decoder
+{
+    typedef struct
+    {
+        uint8_t *data{nullptr}; // owned by the decoder or the caller, never freed by the image
+        size_t len{0};
+        uint16_t width{0};
+        uint16_t height{0};
+        uint8_t scale_denom{1}; // DCT scale used, 1 when decoding to an exact size
+        uint32_t decode_us{0};
+    } decoded_image_t;
+
+    typedef struct
+    {
+        uint16_t x{0};
+        uint16_t y{0};
+        uint16_t width{0}; // 0 means the whole image
+        uint16_t height{0};
+    } rect_t;
+
+    typedef struct
+    {
+        uint32_t frames{0};
+        uint32_t reconfigurations{0};
+        uint32_t setup_us{0}; // total time spent opening/reopening the decoder
+    } decoder_stats_t;
+
+    // Largest DCT scale denominator (1, 2, 4 or 8) whose output keeps both
+    // sides at or above min_w x min_h. esp_new_jpeg only scales to sizes that
+    // are multiples of 8, so denominators that break that are skipped.
+    uint8_t pick_scale_denom(uint16_t src_w, uint16_t src_h, uint16_t min_w, uint16_t min_h);
+
+    size_t bytes_per_pixel(jpeg_pixel_format_t format);
+
+    // Clips rect to a width x height image. Returns an empty rect, meaning the
+    // whole image, if nothing usable is left or the rect already covers it all.
+    rect_t clip_rect(const rect_t &rect, uint16_t width, uint16_t height);
+
+    // Nearest-neighbour resize of the `crop` rectangle of an interleaved image
+    // into dst. Only pixels inside the rectangle are read.
+    void crop_resize_nearest(const uint8_t *src, uint16_t src_width, size_t bpp, const rect_t &crop,
+                             uint8_t *dst, uint16_t dst_width, uint16_t dst_height);
+
+    // Persistent esp_new_jpeg decoder. The handle, IO and header structs are
+    // kept across frames; the handle is only reopened when the source
+    // resolution changes, since the output scale is part of its configuration.
+    class JpegDecoder
+    {
+    public:
+        JpegDecoder() = default;
+        ~JpegDecoder();
+        JpegDecoder(const JpegDecoder &) = delete;
+        JpegDecoder &operator=(const JpegDecoder &) = delete;
+
+        // exact = true decodes to exactly width x height (e.g. straight into a
+        // model input tensor); exact = false decodes to the smallest DCT scale
+        // that still covers width x height.
+        jpeg_error_t configure(jpeg_pixel_format_t format, uint16_t width, uint16_t height, bool exact);
+
+        // Decodes into outbuf when given, otherwise into an internal buffer that
+        // is reused across calls and stays valid until the next decode().
+        jpeg_error_t decode(const uint8_t *jpeg, size_t len, decoded_image_t &out,
+                            uint8_t *outbuf = nullptr, size_t outbuf_len = 0);
+
+        decoder_stats_t get_stats() const { return this->stats; }
+
+    private:
+        jpeg_dec_handle_t handle{nullptr};
+        jpeg_dec_config_t config{};
+        jpeg_dec_io_t io{};
+        jpeg_dec_header_info_t info{};
+        uint16_t target_width{0};
+        uint16_t target_height{0};
+        bool exact{false};
+        uint16_t src_width{0};
+        uint16_t src_height{0};
+        uint8_t scale_denom{1};
+        uint8_t *buffer{nullptr};
+        size_t buffer_len{0};
+        decoder_stats_t stats{};
+
+        jpeg_error_t reopen(const jpeg_dec_config_t &config);
+        jpeg_error_t reconfigure(const uint8_t *jpeg, size_t len);
+        jpeg_error_t parse(const uint8_t *jpeg, size_t len);
+        void close();
+    };
+
+    typedef struct
+    {
+        int iterations{0};
+        uint32_t reopen_us{0};     // per frame, open/parse/close
+        uint32_t persistent_us{0}; // per frame, parse on a kept handle
+    } setup_benchmark_t;
+
+    // Times `iterations` header parses with a fresh open/close per frame
+    // against the same parses on one persistent handle, to show the
+    // per-frame setup overhead the persistent decoder removes. Run by
+    // host/replay --bench.
+    jpeg_error_t benchmark_setup_overhead(const uint8_t *jpeg, size_t len, int iterations, setup_benchmark_t &result);
+} // namespace jpeg_decoder
@@ -0,0 +1,335 @@
+#include "jpeg_decoder.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "jpeg_decoder";
+
+uint8_t jpeg_decoder::pick_scale_denom(uint16_t src_w, uint16_t src_h, uint16_t min_w, uint16_t min_h)
+{
+    uint8_t best = 1;
+    for (uint8_t denom = 2; denom <= 8; denom <<= 1)
+    {
+        if (src_w % denom || src_h % denom)
+        {
+            break;
+        }
+        uint16_t w = src_w / denom;
+        uint16_t h = src_h / denom;
+        if (w < min_w || h < min_h)
+        {
+            break;
+        }
+        if (w % 8 == 0 && h % 8 == 0)
+        {
+            best = denom;
+        }
+    }
+    return best;
+}
+
+size_t jpeg_decoder::bytes_per_pixel(jpeg_pixel_format_t format)
+{
+    switch (format)
+    {
+    case JPEG_PIXEL_FORMAT_GRAY:
+        return 1;
+    case JPEG_PIXEL_FORMAT_RGB565_LE:
+    case JPEG_PIXEL_FORMAT_RGB565_BE:
+    case JPEG_PIXEL_FORMAT_CbYCrY:
+        return 2;
+    case JPEG_PIXEL_FORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+jpeg_decoder::rect_t jpeg_decoder::clip_rect(const rect_t &rect, uint16_t width, uint16_t height)
+{
+    if (!rect.width || !rect.height || rect.x >= width || rect.y >= height)
+    {
+        return {};
+    }
+    rect_t clipped = rect;
+    if (clipped.width > width - clipped.x)
+    {
+        clipped.width = width - clipped.x;
+    }
+    if (clipped.height > height - clipped.y)
+    {
+        clipped.height = height - clipped.y;
+    }
+    if (clipped.width == width && clipped.height == height)
+    {
+        return {};
+    }
+    return clipped;
+}
+
+void jpeg_decoder::crop_resize_nearest(const uint8_t *src, uint16_t src_width, size_t bpp, const rect_t &crop,
+                                       uint8_t *dst, uint16_t dst_width, uint16_t dst_height)
+{
+    // 16.16 fixed point steps through the source rectangle.
+    uint32_t x_step = ((uint32_t)crop.width << 16) / dst_width;
+    uint32_t y_step = ((uint32_t)crop.height << 16) / dst_height;
+    uint32_t sy = 0;
+    for (uint16_t dy = 0; dy < dst_height; dy++, sy += y_step)
+    {
+        const uint8_t *src_row = src + ((size_t)(crop.y + (sy >> 16)) * src_width + crop.x) * bpp;
+        uint32_t sx = 0;
+        for (uint16_t dx = 0; dx < dst_width; dx++, sx += x_step)
+        {
+            memcpy(dst, src_row + (sx >> 16) * bpp, bpp);
+            dst += bpp;
+        }
+    }
+}
+
+jpeg_decoder::JpegDecoder::~JpegDecoder()
+{
+    this->close();
+    if (this->buffer)
+    {
+        jpeg_free_align(this->buffer);
+        this->buffer = nullptr;
+    }
+}
+
+jpeg_error_t jpeg_decoder::JpegDecoder::configure(jpeg_pixel_format_t format, uint16_t width, uint16_t height, bool exact)
+{
+    if (bytes_per_pixel(format) == 0 || width == 0 || height == 0)
+    {
+        return JPEG_ERR_INVALID_PARAM;
+    }
+    this->close();
+    this->config = DEFAULT_JPEG_DEC_CONFIG();
+    this->config.output_type = format;
+    this->target_width = width;
+    this->target_height = height;
+    this->exact = exact;
+    this->src_width = 0;
+    this->src_height = 0;
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_decoder::JpegDecoder::decode(const uint8_t *jpeg, size_t len, decoded_image_t &out,
+                                               uint8_t *outbuf, size_t outbuf_len)
+{
+    int64_t start = esp_timer_get_time();
+    if (this->target_width == 0)
+    {
+        return JPEG_ERR_INVALID_PARAM;
+    }
+
+    // Steady state is a header parse on the existing handle; only a change of
+    // source resolution pays for reopening it.
+    jpeg_error_t ret = JPEG_ERR_FAIL;
+    if (this->handle)
+    {
+        ret = this->parse(jpeg, len);
+    }
+    if (ret != JPEG_ERR_OK || this->info.width != this->src_width || this->info.height != this->src_height)
+    {
+        ret = this->reconfigure(jpeg, len);
+        if (ret != JPEG_ERR_OK)
+        {
+            return ret;
+        }
+    }
+
+    int needed = 0;
+    ret = jpeg_dec_get_outbuf_len(this->handle, &needed);
+    if (ret != JPEG_ERR_OK)
+    {
+        return ret;
+    }
+
+    if (outbuf)
+    {
+        if (outbuf_len < (size_t)needed)
+        {
+            ESP_LOGE(TAG, "Output buffer too small: %zu < %d", outbuf_len, needed);
+            return JPEG_ERR_INVALID_PARAM;
+        }
+    }
+    else
+    {
+        if (this->buffer_len < (size_t)needed)
+        {
+            jpeg_free_align(this->buffer);
+            this->buffer = (uint8_t *)jpeg_calloc_align(needed, 16);
+            this->buffer_len = this->buffer ? needed : 0;
+            if (!this->buffer)
+            {
+                return JPEG_ERR_NO_MEM;
+            }
+        }
+        outbuf = this->buffer;
+    }
+
+    this->io.outbuf = outbuf;
+    ret = jpeg_dec_process(this->handle, &this->io);
+    if (ret != JPEG_ERR_OK)
+    {
+        return ret;
+    }
+
+    bool scaled = this->config.scale.width != 0;
+    out.data = outbuf;
+    out.len = needed;
+    out.width = scaled ? this->config.scale.width : this->src_width;
+    out.height = scaled ? this->config.scale.height : this->src_height;
+    out.scale_denom = this->scale_denom;
+    out.decode_us = esp_timer_get_time() - start;
+    this->stats.frames++;
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_decoder::JpegDecoder::reconfigure(const uint8_t *jpeg, size_t len)
+{
+    int64_t start = esp_timer_get_time();
+
+    // Probe the source size with an unscaled handle first.
+    jpeg_dec_config_t probe = this->config;
+    probe.scale = {0, 0};
+    jpeg_error_t ret = this->reopen(probe);
+    if (ret == JPEG_ERR_OK)
+    {
+        ret = this->parse(jpeg, len);
+    }
+    if (ret != JPEG_ERR_OK)
+    {
+        this->close();
+        return ret;
+    }
+    this->src_width = this->info.width;
+    this->src_height = this->info.height;
+
+    jpeg_dec_config_t scaled = probe;
+    this->scale_denom = 1;
+    if (this->exact)
+    {
+        if (this->src_width != this->target_width || this->src_height != this->target_height)
+        {
+            scaled.scale = {.width = this->target_width, .height = this->target_height};
+        }
+    }
+    else
+    {
+        this->scale_denom = pick_scale_denom(this->src_width, this->src_height, this->target_width, this->target_height);
+        if (this->scale_denom > 1)
+        {
+            scaled.scale.width = this->src_width / this->scale_denom;
+            scaled.scale.height = this->src_height / this->scale_denom;
+        }
+    }
+
+    this->config = scaled;
+    if (scaled.scale.width != 0)
+    {
+        ret = this->reopen(scaled);
+        if (ret == JPEG_ERR_OK)
+        {
+            ret = this->parse(jpeg, len);
+        }
+        if (ret != JPEG_ERR_OK)
+        {
+            this->close();
+            return ret;
+        }
+    }
+
+    this->stats.reconfigurations++;
+    this->stats.setup_us += esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "Decoder configured for %dx%d source, output %dx%d", this->src_width, this->src_height,
+             scaled.scale.width ? scaled.scale.width : this->src_width,
+             scaled.scale.height ? scaled.scale.height : this->src_height);
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_decoder::JpegDecoder::reopen(const jpeg_dec_config_t &config)
+{
+    this->close();
+    jpeg_dec_config_t cfg = config;
+    return jpeg_dec_open(&cfg, &this->handle);
+}
+
+jpeg_error_t jpeg_decoder::JpegDecoder::parse(const uint8_t *jpeg, size_t len)
+{
+    this->io = {};
+    this->io.inbuf = (uint8_t *)jpeg;
+    this->io.inbuf_len = len;
+    return jpeg_dec_parse_header(this->handle, &this->io, &this->info);
+}
+
+void jpeg_decoder::JpegDecoder::close()
+{
+    if (this->handle)
+    {
+        jpeg_dec_close(this->handle);
+        this->handle = nullptr;
+    }
+}
+
+jpeg_error_t jpeg_decoder::benchmark_setup_overhead(const uint8_t *jpeg, size_t len, int iterations,
+                                                    setup_benchmark_t &result)
+{
+    jpeg_dec_config_t config = DEFAULT_JPEG_DEC_CONFIG();
+    config.output_type = JPEG_PIXEL_FORMAT_RGB888;
+
+    // What every frame used to pay: open, allocate IO/header structs, parse, free, close.
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++)
+    {
+        jpeg_dec_handle_t handle = NULL;
+        jpeg_error_t err = jpeg_dec_open(&config, &handle);
+        if (err != JPEG_ERR_OK)
+        {
+            return err;
+        }
+        jpeg_dec_io_t *io = (jpeg_dec_io_t *)calloc(1, sizeof(jpeg_dec_io_t));
+        jpeg_dec_header_info_t *info = (jpeg_dec_header_info_t *)calloc(1, sizeof(jpeg_dec_header_info_t));
+        if (io && info)
+        {
+            io->inbuf = (uint8_t *)jpeg;
+            io->inbuf_len = len;
+            jpeg_dec_parse_header(handle, io, info);
+        }
+        free(io);
+        free(info);
+        jpeg_dec_close(handle);
+    }
+    int64_t per_frame_reopen = (esp_timer_get_time() - start) / iterations;
+
+    // What a persistent decoder pays: a header parse on the existing handle.
+    jpeg_dec_handle_t handle = NULL;
+    jpeg_error_t err = jpeg_dec_open(&config, &handle);
+    if (err != JPEG_ERR_OK)
+    {
+        return err;
+    }
+    jpeg_dec_io_t io = {};
+    jpeg_dec_header_info_t info = {};
+    start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++)
+    {
+        io = {};
+        io.inbuf = (uint8_t *)jpeg;
+        io.inbuf_len = len;
+        err = jpeg_dec_parse_header(handle, &io, &info);
+    }
+    int64_t per_frame_persistent = (esp_timer_get_time() - start) / iterations;
+    jpeg_dec_close(handle);
+
+    result.iterations = iterations;
+    result.reopen_us = per_frame_reopen;
+    result.persistent_us = per_frame_persistent;
+    ESP_LOGI(TAG,
+             "Per-frame setup over %d frames: open/close %" PRId64 " us, persistent %" PRId64 " us, saved %" PRId64
+             " us",
+             iterations, per_frame_reopen, per_frame_persistent, per_frame_reopen - per_frame_persistent);
+    return err;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace litter_robot_detect
+{
+  // Converts an image decoded as uint8 [0, 255] in place to the int8
+  // [-128, 127] the quantized model expects. xor 0x80 is equivalent to
+  // subtracting 128 for byte-sized values:
+  // 0 (0x00) ^ 0x80 = 128 (0x80) -> interpreted as -128
+  // 255 (0xFF) ^ 0x80 = 127 (0x7F) -> interpreted as 127
+  inline void uint8_to_int8_bytewise(uint8_t *data, size_t len)
+  {
+    for (size_t i = 0; i < len; i++)
+    {
+      data[i] ^= 0x80;
+    }
+  }
+
+  // Same conversion a 32-bit word at a time: bytes up to the first aligned
+  // word, whole words, then the tail. Bit-identical to the bytewise version.
+  inline void uint8_to_int8(uint8_t *data, size_t len)
+  {
+    size_t head = (4 - ((uintptr_t)data & 3)) & 3;
+    if (head > len)
+    {
+      head = len;
+    }
+    uint8_to_int8_bytewise(data, head);
+    data += head;
+    len -= head;
+
+    // memcpy keeps this free of aliasing issues; on aligned addresses the
+    // compiler lowers it to plain 32-bit loads and stores.
+    size_t word_count = len / 4;
+    for (size_t i = 0; i < word_count; i++)
+    {
+      uint32_t word;
+      memcpy(&word, data + i * 4, sizeof(word));
+      word ^= 0x80808080u;
+      memcpy(data + i * 4, &word, sizeof(word));
+    }
+
+    uint8_to_int8_bytewise(data + word_count * 4, len & 3);
+  }
+} // namespace litter_robot_detect
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "jpeg_decoder.hpp"
+#include <algorithm>
+#include <stdint.h>
+
+namespace litter_robot_detect
+{
+  // Clips `roi` to the frame and configures `decoder` so that the ROI alone
+  // still covers the input_width x input_height model input. Without a
+  // usable ROI the whole frame is decoded to the input size, at exactly that
+  // size if exact_when_full. Returns true if `roi` has to be cropped out
+  // after decoding.
+  inline bool configure_roi_decode(jpeg_decoder::JpegDecoder &decoder, jpeg_decoder::rect_t &roi,
+                                   uint16_t frame_width, uint16_t frame_height, uint16_t input_width,
+                                   uint16_t input_height, bool exact_when_full)
+  {
+    roi = jpeg_decoder::clip_rect(roi, frame_width, frame_height);
+    if (!roi.width)
+    {
+      decoder.configure(JPEG_PIXEL_FORMAT_RGB888, input_width, input_height, exact_when_full);
+      return false;
+    }
+    // Scale the frame so that the ROI alone still covers the input. A small
+    // ROI asks for more than the whole frame, which only the full size
+    // decode comes closest to; in 16 bits it would wrap to a tiny size.
+    uint32_t min_w = ((uint32_t)input_width * frame_width + roi.width - 1) / roi.width;
+    uint32_t min_h = ((uint32_t)input_height * frame_height + roi.height - 1) / roi.height;
+    min_w = std::min<uint32_t>(min_w, frame_width);
+    min_h = std::min<uint32_t>(min_h, frame_height);
+    decoder.configure(JPEG_PIXEL_FORMAT_RGB888, min_w, min_h, false);
+    return true;
+  }
+
+  // `roi` in the coordinates of a frame decoded at 1/scale_denom.
+  inline jpeg_decoder::rect_t scale_roi(const jpeg_decoder::rect_t &roi, uint8_t scale_denom)
+  {
+    return {.x = (uint16_t)(roi.x / scale_denom),
+            .y = (uint16_t)(roi.y / scale_denom),
+            .width = (uint16_t)(roi.width / scale_denom),
+            .height = (uint16_t)(roi.height / scale_denom)};
+  }
+
+  // Resizes the `roi` crop of a decoded RGB888 frame into the model input.
+  inline void crop_roi_to_input(const jpeg_decoder::decoded_image_t &decoded, const jpeg_decoder::rect_t &roi,
+                                uint8_t *input, uint16_t input_width, uint16_t input_height)
+  {
+    jpeg_decoder::crop_resize_nearest(decoded.data, decoded.width, 3, scale_roi(roi, decoded.scale_denom), input,
+                                      input_width, input_height);
+  }
+} // namespace litter_robot_detect
@@ -14,6 +14,9 @@
 #include "dl_image_jpeg.hpp"
 #include "dl_image.hpp"
 #endif
+#include "jpeg_decoder.hpp"
+#include "output_dequant.hpp"
+#include "freertos/FreeRTOS.h"
 
 // #ifndef CONFIG_LITTER_ROBOT_MODEL_ESP_PPQ
 // #define CONFIG_LITTER_ROBOT_MODEL_ESP_PPQ = 1
@@ -21,6 +24,14 @@
 
 namespace litter_robot_detect
 {
+  typedef struct
+  {
+    uint32_t decode_us{0};
+    uint32_t preprocess_us{0};
+    uint32_t invoke_us{0};
+    uint32_t postprocess_us{0};
+  } stage_timings_t;
+
   typedef struct
   {
     uint8_t empty_score{0};
@@ -28,9 +39,12 @@ namespace litter_robot_detect
     uint8_t ngao_score{0};
     std::string predicted_class{""};
     esp_err_t err{ESP_OK};
+    stage_timings_t timings{};
   } prediction_result_t;
 
-  static const std::string CLASS_NAMES[] = {"empty", "nachi", "ngao"};
+  // Region of the camera frame the classifier looks at, in frame pixels.
+  // A width or height of 0 selects the whole frame.
+  typedef jpeg_decoder::rect_t roi_t;
 
   class CatDetect
   {
@@ -43,22 +57,63 @@ namespace litter_robot_detect
 #ifdef CONFIG_LITTER_ROBOT_MODEL_ESP_PPQ
     prediction_result_t run_inference(const dl::image::img_t &img);
 #endif
+    // Classifies the `crop` rectangle of an image that is already decoded to
+    // RGB888, e.g. a detector box from a frame the detector decoded. The
+    // ROI set with set_roi() is not applied. An empty crop uses the whole
+    // image.
+    prediction_result_t run_inference(const jpeg_decoder::decoded_image_t &image, const roi_t &crop);
+
+    // run_inference(fb) in two steps, so the next frame can be decoded on
+    // another core while the model runs: prepare_input() decodes and
+    // preprocesses into a caller owned buffer of input_bytes(), filling in
+    // the decode and preprocess timings; run_prepared() copies such a
+    // buffer into the model input and runs the model. The two may run
+    // concurrently on different buffers.
+    size_t input_bytes() const { return (size_t)input_width * input_height * 3; }
+    prediction_result_t prepare_input(const camera_fb_t *fb, uint8_t *input);
+    prediction_result_t run_prepared(const uint8_t *input);
 
     void test_model();
 
+    // Takes effect on the next frame; safe to call while inference runs.
+    void set_roi(const roi_t &roi);
+    roi_t get_roi();
+
   private:
     static constexpr const char *TAG{"litter_robot_detect::CatDetect"};
 
+    uint16_t input_width{0};
+    uint16_t input_height{0};
+    portMUX_TYPE roi_lock = portMUX_INITIALIZER_UNLOCKED;
+    roi_t pending_roi{CONFIG_LITTER_ROBOT_ROI_X, CONFIG_LITTER_ROBOT_ROI_Y,
+                      CONFIG_LITTER_ROBOT_ROI_WIDTH, CONFIG_LITTER_ROBOT_ROI_HEIGHT};
+    bool roi_dirty{true};
+    roi_t active_roi{};
+    uint16_t frame_width{0};
+    uint16_t frame_height{0};
+
+    // Picks up a pending ROI or frame size change and reconfigures the
+    // decoder so the ROI, not the whole frame, just covers the model input.
+    // Returns true if a crop has to be applied after decoding.
+    bool prepare_roi(const camera_fb_t *fb, bool exact_when_full);
+    // active_roi in the coordinates of an image decoded at 1/scale_denom.
+    roi_t scaled_roi(uint8_t scale_denom) const;
+
 #ifdef CONFIG_LITTER_ROBOT_MODEL_TFLITE
+    // Runs the model on the prepared input tensor and fills in the scores.
+    void invoke(prediction_result_t &result);
+
     uint8_t *tensor_arena_{nullptr};
     const tflite::Model *model{nullptr};
     tflite::MicroInterpreter *interpreter{nullptr};
     tflite::MicroMutableOpResolver<7> *resolver_{nullptr};
+    jpeg_decoder::JpegDecoder decoder;
 #elif defined CONFIG_LITTER_ROBOT_MODEL_ESP_PPQ
     dl::Model *model{nullptr};
     dl::TensorBase *model_input{nullptr};
     dl::TensorBase *model_output{nullptr};
     dl::image::ImageTransformer *img_transformer{nullptr};
+    jpeg_decoder::JpegDecoder decoder;
 #endif
 
     void decode_result(prediction_result_t &result);
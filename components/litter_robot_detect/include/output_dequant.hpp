@@ -0,0 +1,88 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace litter_robot_detect
+{
+  static const std::string CLASS_NAMES[] = {"empty", "nachi", "ngao"};
+
+  // Turns the raw class outputs of the quantized model into uint8 scores
+  // without building a float tensor: value = q * 2^exponent, the same
+  // dequantization dl::TensorBase::assign() performs. int8 outputs are then
+  // shifted by 128 to match the TFLite build, anything else is taken as a
+  // [0, 1] probability. Returns the index of the highest score.
+  template <typename T>
+  inline size_t dequantize_scores(const T *q, int exponent, bool offset_int8, uint8_t *scores, size_t count)
+  {
+    float scale = ldexpf(1.0f, exponent);
+    size_t best = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+      float value = q[i] * scale;
+      value = offset_int8 ? value + 128.0f : value * 255.0f;
+      scores[i] = value <= 0.0f ? 0 : value >= 255.0f ? 255 : (uint8_t)value;
+      if (scores[i] > scores[best])
+      {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  enum class output_type_t
+  {
+    INT8,
+    INT16,
+    FLOAT,
+    UNSUPPORTED,
+  };
+
+  // What decode_result() reads from the model output tensor, so the decode
+  // can run against a plain buffer as well.
+  typedef struct
+  {
+    output_type_t type;
+    const void *data;
+    int exponent;
+  } output_view_t;
+
+  // The per-frame decode of the PPQ build: scores the `count` classes of
+  // `output` and returns the best index, or -1 for a type it cannot read.
+  inline int decode_output(const output_view_t &output, uint8_t *scores, size_t count)
+  {
+    switch (output.type)
+    {
+    case output_type_t::INT8:
+      return dequantize_scores((const int8_t *)output.data, output.exponent, true, scores, count);
+    case output_type_t::INT16:
+      return dequantize_scores((const int16_t *)output.data, output.exponent, false, scores, count);
+    case output_type_t::FLOAT:
+      return dequantize_scores((const float *)output.data, 0, false, scores, count);
+    default:
+      return -1;
+    }
+  }
+
+  // decode_result() once it has the output tensor: fills in the three class
+  // scores and the name of the best class, and returns its index, or -1 for
+  // a type it cannot read. Result is prediction_result_t in the firmware; a
+  // template so the host tests can run it without the ESP-IDF headers.
+  template <typename Result>
+  inline int decode_prediction(const output_view_t &output, Result &result)
+  {
+    uint8_t scores[3];
+    int best = decode_output(output, scores, 3);
+    if (best < 0)
+    {
+      return best;
+    }
+    result.empty_score = scores[0];
+    result.nachi_score = scores[1];
+    result.ngao_score = scores[2];
+    result.predicted_class = CLASS_NAMES[best];
+    return best;
+  }
+} // namespace litter_robot_detect
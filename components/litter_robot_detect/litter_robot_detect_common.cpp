@@ -1,4 +1,6 @@
 #include "litter_robot_detect.hpp"
+#include "inference_trace.hpp"
+#include "input_roi.hpp"
 
 #ifdef LITTER_ROBOT_DETECT_TEST_STATIC_IMAGE
 extern "C"
@@ -37,4 +39,47 @@ void litter_robot_detect::CatDetect::test_model()
         ESP_LOGE(TAG, "Inference failed with error %d", result.err);
     }
 #endif
-}
\ No newline at end of file
+}
+
+void litter_robot_detect::CatDetect::set_roi(const roi_t &roi)
+{
+    taskENTER_CRITICAL(&roi_lock);
+    pending_roi = roi;
+    roi_dirty = true;
+    taskEXIT_CRITICAL(&roi_lock);
+}
+
+litter_robot_detect::roi_t litter_robot_detect::CatDetect::get_roi()
+{
+    taskENTER_CRITICAL(&roi_lock);
+    roi_t roi = pending_roi;
+    taskEXIT_CRITICAL(&roi_lock);
+    return roi;
+}
+
+bool litter_robot_detect::CatDetect::prepare_roi(const camera_fb_t *fb, bool exact_when_full)
+{
+    taskENTER_CRITICAL(&roi_lock);
+    bool dirty = roi_dirty || fb->width != frame_width || fb->height != frame_height;
+    roi_t roi = pending_roi;
+    roi_dirty = false;
+    taskEXIT_CRITICAL(&roi_lock);
+
+    if (dirty)
+    {
+        frame_width = fb->width;
+        frame_height = fb->height;
+
+        // Anything degenerate falls back to the full frame.
+        active_roi = roi;
+        configure_roi_decode(decoder, active_roi, frame_width, frame_height, input_width, input_height,
+                             exact_when_full);
+        ESP_LOGI(TAG, "ROI x=%d y=%d w=%d h=%d", active_roi.x, active_roi.y, active_roi.width, active_roi.height);
+    }
+    return active_roi.width != 0;
+}
+
+litter_robot_detect::roi_t litter_robot_detect::CatDetect::scaled_roi(uint8_t scale_denom) const
+{
+    return scale_roi(active_roi, scale_denom);
+}
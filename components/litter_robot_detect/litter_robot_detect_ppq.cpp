@@ -1,8 +1,11 @@
 #include "dl_image_preprocessor.hpp"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "inference_trace.hpp"
 #include "litter_robot_detect.hpp"
 #include "model_data.h"
+#include "output_dequant.hpp"
 #include <stdio.h>
 
 // #ifndef CONFIG_LITTER_ROBOT_MODEL_ESP_PPQ
@@ -14,6 +17,21 @@
 extern const uint8_t
     model_espdl[] asm("_binary_lite_model_esp32s3_espdl_start");
 
+static litter_robot_detect::output_type_t output_type(dl::dtype_t dtype)
+{
+  switch (dtype)
+  {
+  case dl::DATA_TYPE_INT8:
+    return litter_robot_detect::output_type_t::INT8;
+  case dl::DATA_TYPE_INT16:
+    return litter_robot_detect::output_type_t::INT16;
+  case dl::DATA_TYPE_FLOAT:
+    return litter_robot_detect::output_type_t::FLOAT;
+  default:
+    return litter_robot_detect::output_type_t::UNSUPPORTED;
+  }
+}
+
 litter_robot_detect::CatDetect::CatDetect()
 {
   img_transformer = new dl::image::ImageTransformer();
@@ -74,31 +92,79 @@ esp_err_t litter_robot_detect::CatDetect::setup(size_t tensor_arena_size)
   }
 
   model->minimize();
+
+  // Decode at the smallest DCT scale covering the model input; the handle is
+  // reused across frames.
+  input_width = model_input->shape[2];
+  input_height = model_input->shape[1];
+  if (decoder.configure(JPEG_PIXEL_FORMAT_RGB888, input_width, input_height,
+                        false) != JPEG_ERR_OK)
+  {
+    ESP_LOGE(TAG, "Failed to configure JPEG decoder");
+    return ESP_FAIL;
+  }
   return ESP_OK;
 }
 
 litter_robot_detect::prediction_result_t
 litter_robot_detect::CatDetect::run_inference(const camera_fb_t *fb)
+{
+  prediction_result_t prepared =
+      prepare_input(fb, (uint8_t *)model_input->data);
+  if (prepared.err != ESP_OK)
+  {
+    return prepared;
+  }
+
+  prediction_result_t result = run_prepared((uint8_t *)model_input->data);
+  result.timings.decode_us = prepared.timings.decode_us;
+  result.timings.preprocess_us = prepared.timings.preprocess_us;
+  TRACE_RECORD(TRACE_STAGE_TIMINGS, 0, result.timings.decode_us,
+               result.timings.preprocess_us, result.timings.invoke_us,
+               result.timings.postprocess_us);
+  return result;
+}
+
+litter_robot_detect::prediction_result_t
+litter_robot_detect::CatDetect::prepare_input(const camera_fb_t *fb,
+                                              uint8_t *input)
 {
   img_transformer->reset();
-  dl::image::jpeg_img_t jpeg_img = {
-      .data = fb->buf,
-      .data_len = fb->len,
-  };
-  auto img =
-      dl::image::sw_decode_jpeg(jpeg_img, dl::image::DL_IMAGE_PIX_TYPE_RGB888, dl::image::DL_IMAGE_CAP_RGB565_BIG_ENDIAN);
 
+  // Decode at the smallest DCT scale that still covers the model input, so
+  // the transformer only resizes from e.g. 160x120 instead of full VGA. With
+  // an ROI the scale is chosen so the ROI alone still covers the input.
+  bool crop = prepare_roi(fb, false);
+  jpeg_decoder::decoded_image_t decoded;
+  jpeg_error_t decode_err = decoder.decode(fb->buf, fb->len, decoded);
+  if (decode_err != JPEG_ERR_OK)
+  {
+    ESP_LOGE(TAG, "JPEG decode failed with error %d", decode_err);
+    return {.err = ESP_FAIL};
+  }
+
+  int64_t start_preprocess = esp_timer_get_time();
+  dl::image::img_t img = {.data = decoded.data,
+                          .width = decoded.width,
+                          .height = decoded.height,
+                          .pix_type = dl::image::DL_IMAGE_PIX_TYPE_RGB888};
   img_transformer->set_src_img(img);
 
-  dl::image::img_t dst_img = {.data = model_input->data,
-                              .width = (uint8_t)model_input->shape[2],
-                              .height = (uint8_t)model_input->shape[1],
+  dl::image::img_t dst_img = {.data = input,
+                              .width = (uint8_t)input_width,
+                              .height = (uint8_t)input_height,
                               .pix_type = dl::image::DL_IMAGE_PIX_TYPE_RGB888};
 
   // Transform to RGB888
   // dl::image::NormQuantWrapper::quant_type_t quant_type = dl::image::NormQuantWrapper::;
   img_transformer->set_dst_img(dst_img)
       .set_caps(dl::image::DL_IMAGE_CAP_RGB565_BIG_ENDIAN);
+  if (crop)
+  {
+    roi_t roi = scaled_roi(decoded.scale_denom);
+    img_transformer->set_src_img_crop_area(
+        {roi.x, roi.y, roi.x + roi.width, roi.y + roi.height});
+  }
   // .set_norm_quant_param(
   //     {0, 0, 0}, {255, 255, 255}, model_input->exponent, quant_type);
   esp_err_t tx_err = img_transformer->transform();
@@ -106,102 +172,98 @@ litter_robot_detect::CatDetect::run_inference(const camera_fb_t *fb)
   if (tx_err != ESP_OK)
   {
     ESP_LOGE(TAG, "Image transform failed");
-    heap_caps_free(img.data);
     return {.err = tx_err};
   }
 
-  heap_caps_free(img.data);
-  return run_inference(dst_img);
+  prediction_result_t result;
+  result.timings.decode_us = decoded.decode_us;
+  result.timings.preprocess_us = esp_timer_get_time() - start_preprocess;
+  TRACE_RECORD(TRACE_DECODE, decoded.scale_denom, decoded.width, decoded.height);
+  return result;
 }
 
-void litter_robot_detect::CatDetect::decode_result(
-    prediction_result_t &result)
+litter_robot_detect::prediction_result_t
+litter_robot_detect::CatDetect::run_prepared(const uint8_t *input)
 {
-  if (result.err != ESP_OK)
-  {
-    return;
-  }
-
-  // Access data based on dtype. Most esp-dl PPQ models output int16_t or
-  // int8_t.
-  ESP_LOGI(TAG, "Model Output Info:");
-  ESP_LOGI(TAG, "  Exponent: %d", model_output->exponent);
-  ESP_LOGI(TAG, "  DType: %s", model_output->get_dtype_string());
-  ESP_LOGI(TAG, "  Shape: %s",
-           dl::vector_to_string(model_output->shape).c_str());
-  model_output->print(true);
-
-  float scores_raw[3];
-  dl::TensorBase *output_tensor =
-      new dl::TensorBase(model_output->get_shape(), nullptr,
-                         model_output->exponent, dl::DATA_TYPE_FLOAT);
-  output_tensor->assign(model_output);
-
-  ESP_LOGI(TAG, "Output Tensor (converted to float) Info:");
-  output_tensor->print(true);
-
-  scores_raw[0] = output_tensor->get_element<float>(0);
-  scores_raw[1] = output_tensor->get_element<float>(1);
-  scores_raw[2] = output_tensor->get_element<float>(2);
+  // assign() copies the slot into the model input.
+  dl::image::img_t img = {.data = (void *)input,
+                          .width = (uint8_t)input_width,
+                          .height = (uint8_t)input_height,
+                          .pix_type = dl::image::DL_IMAGE_PIX_TYPE_RGB888};
+  return run_inference(img);
+}
 
-  // Log the raw scores
-  ESP_LOGI(TAG, "empty_score=%f nachi_score=%f ngao_score=%f", scores_raw[0],
-           scores_raw[1], scores_raw[2]);
+litter_robot_detect::prediction_result_t
+litter_robot_detect::CatDetect::run_inference(
+    const jpeg_decoder::decoded_image_t &image, const roi_t &crop)
+{
+  img_transformer->reset();
 
-  // Map to uint8_t for the result struct.
-  // We add 128 for signed 8-bit types to map [-128, 127] to [0, 255],
-  // matching the TFLite implementation's behavior.
-  uint8_t scores_uint8[3];
-  if (model_output->get_dtype() == dl::DATA_TYPE_INT8)
+  int64_t start_preprocess = esp_timer_get_time();
+  dl::image::img_t img = {.data = image.data,
+                          .width = image.width,
+                          .height = image.height,
+                          .pix_type = dl::image::DL_IMAGE_PIX_TYPE_RGB888};
+  dl::image::img_t dst_img = {.data = model_input->data,
+                              .width = (uint8_t)model_input->shape[2],
+                              .height = (uint8_t)model_input->shape[1],
+                              .pix_type = dl::image::DL_IMAGE_PIX_TYPE_RGB888};
+  img_transformer->set_src_img(img);
+  img_transformer->set_dst_img(dst_img)
+      .set_caps(dl::image::DL_IMAGE_CAP_RGB565_BIG_ENDIAN);
+  roi_t rect = jpeg_decoder::clip_rect(crop, image.width, image.height);
+  if (rect.width)
+  {
+    img_transformer->set_src_img_crop_area(
+        {rect.x, rect.y, rect.x + rect.width, rect.y + rect.height});
+  }
+  esp_err_t tx_err = img_transformer->transform();
+  if (tx_err != ESP_OK)
   {
-    scores_uint8[0] = (uint8_t)(scores_raw[0] + 128);
-    scores_uint8[1] = (uint8_t)(scores_raw[1] + 128);
-    scores_uint8[2] = (uint8_t)(scores_raw[2] + 128);
+    ESP_LOGE(TAG, "Image transform failed");
+    return {.err = tx_err};
   }
-  else
+  uint32_t preprocess_us = esp_timer_get_time() - start_preprocess;
+
+  prediction_result_t result = run_inference(dst_img);
+  result.timings.preprocess_us = preprocess_us;
+  return result;
+}
+
+void litter_robot_detect::CatDetect::decode_result(
+    prediction_result_t &result)
+{
+  if (result.err != ESP_OK)
   {
-    // Assume float output is probability [0, 1]
-    scores_uint8[0] = (uint8_t)(scores_raw[0] * 255.0f);
-    scores_uint8[1] = (uint8_t)(scores_raw[1] * 255.0f);
-    scores_uint8[2] = (uint8_t)(scores_raw[2] * 255.0f);
+    return;
   }
 
-  int max_index = 0;
-  for (int i = 1; i < 3; ++i)
+  // Runs once per frame, so it reads the quantized outputs in place: no
+  // float tensor, no allocation and no printing.
+  output_view_t output{output_type(model_output->get_dtype()),
+                       model_output->data, model_output->exponent};
+  int max_index = decode_prediction(output, result);
+  if (max_index < 0)
   {
-    if (scores_uint8[i] > scores_uint8[max_index])
-    {
-      max_index = i;
-    }
+    ESP_LOGE(TAG, "Unsupported output dtype: %s",
+             model_output->get_dtype_string());
+    result.err = ESP_ERR_NOT_SUPPORTED;
+    return;
   }
 
-  result.empty_score = scores_uint8[0];
-  result.nachi_score = scores_uint8[1];
-  result.ngao_score = scores_uint8[2];
-  result.predicted_class = CLASS_NAMES[max_index];
+  TRACE_BYTES(TRACE_OUTPUT_RAW, (uint16_t)model_output->exponent,
+              model_output->data, 16);
+  TRACE_RECORD(TRACE_SCORES, 0, result.empty_score, result.nachi_score,
+               result.ngao_score, max_index);
 }
 
 litter_robot_detect::prediction_result_t
 litter_robot_detect::CatDetect::run_inference(const dl::image::img_t &img)
 {
-  uint32_t start_infer = esp_log_timestamp();
-
-  ESP_LOGI(TAG, "Input Image Info:");
-  ESP_LOGI(TAG, "  Width: %d, Height: %d", img.width, img.height);
-  ESP_LOGI(TAG, "  Pix Type: %d", img.pix_type);
-
+  TRACE_RECORD(TRACE_INPUT_IMAGE, 0, img.width, img.height, img.pix_type);
   if (img.data)
   {
-    uint8_t *data_u8 = (uint8_t *)img.data;
-    float *data_f = (float *)img.data;
-
-    ESP_LOGI(TAG, "Sample Input Data (First 10 values):");
-    ESP_LOGI(TAG, "  As uint8: %d %d %d %d %d %d %d %d %d %d", data_u8[0],
-             data_u8[1], data_u8[2], data_u8[3], data_u8[4], data_u8[5],
-             data_u8[6], data_u8[7], data_u8[8], data_u8[9]);
-    ESP_LOGI(TAG, "  As float: %f %f %f %f %f %f %f %f %f %f", data_f[0],
-             data_f[1], data_f[2], data_f[3], data_f[4], data_f[5], data_f[6],
-             data_f[7], data_f[8], data_f[9]);
+    TRACE_BYTES(TRACE_INPUT_HEAD, 0, img.data, 16);
   }
 
   model_input->assign({1, img.height, img.width, 3}, img.data,
@@ -210,14 +272,15 @@ litter_robot_detect::CatDetect::run_inference(const dl::image::img_t &img)
   // ESP_LOGI(TAG, "Model Input Tensor Info (after assign):");
   // model_input->print(true);
 
+  int64_t start_invoke = esp_timer_get_time();
   model->run();
   prediction_result_t result;
   result.err = ESP_OK;
+  result.timings.invoke_us = esp_timer_get_time() - start_invoke;
 
-  uint32_t end_infer = esp_log_timestamp();
-  ESP_LOGI(TAG, "Inference took %lu ms", end_infer - start_infer);
-
+  int64_t start_postprocess = esp_timer_get_time();
   decode_result(result);
+  result.timings.postprocess_us = esp_timer_get_time() - start_postprocess;
   return result;
 }
 #endif
\ No newline at end of file
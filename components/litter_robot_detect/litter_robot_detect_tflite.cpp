@@ -1,10 +1,13 @@
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "inference_trace.hpp"
+#include "input_quant.hpp"
+#include "input_roi.hpp"
 #include "litter_robot_detect.hpp"
 #include "model_data.h"
-#include <esp_jpeg_common.h>
-#include <esp_jpeg_dec.h>
 #include <stdio.h>
+#include <string.h>
 
 #define USE_ESP_NEW_JPEG 1
 
@@ -76,118 +79,46 @@ esp_err_t litter_robot_detect::CatDetect::setup(size_t tensor_arena_size)
         return ESP_FAIL;
     }
 
+    // Without an ROI the decoder writes straight into the input tensor, so it
+    // is configured for the tensor size and its handle reused for every frame.
+    TfLiteTensor *input = interpreter->input(0);
+    input_width = input->dims->data[2];
+    input_height = input->dims->data[1];
+    if (decoder.configure(JPEG_PIXEL_FORMAT_RGB888, input_width, input_height, true) != JPEG_ERR_OK)
+    {
+        ESP_LOGE(TAG, "Failed to configure JPEG decoder");
+        return ESP_FAIL;
+    }
+
     ESP_LOGD(TAG, "setup model successfully");
     return ESP_OK;
 }
 
-jpeg_error_t decode_jpeg(uint8_t *input_buf, int len, uint8_t height,
-                         uint8_t width, uint8_t *output_buf, int *out_len)
+litter_robot_detect::prediction_result_t
+litter_robot_detect::CatDetect::run_inference(const camera_fb_t *fb)
 {
-    jpeg_error_t ret = JPEG_ERR_OK;
-    jpeg_dec_io_t *jpeg_io = NULL;
-    jpeg_dec_header_info_t *out_info = NULL;
-
-    // Generate default configuration
-    jpeg_dec_config_t config = DEFAULT_JPEG_DEC_CONFIG();
-    config.output_type = JPEG_PIXEL_FORMAT_RGB888;
-    config.scale.width = width;
-    config.scale.height = height;
-
-    // Create jpeg_dec handle
-    jpeg_dec_handle_t jpeg_dec = NULL;
-    ret = jpeg_dec_open(&config, &jpeg_dec);
-    if (ret != JPEG_ERR_OK)
-    {
-        return ret;
-    }
-
-    // Create io_callback handle
-    jpeg_io = (jpeg_dec_io_t *)calloc(1, sizeof(jpeg_dec_io_t));
-    if (jpeg_io == NULL)
-    {
-        ret = JPEG_ERR_NO_MEM;
-        goto jpeg_dec_clean;
-    }
-
-    // Create out_info handle
-    out_info =
-        (jpeg_dec_header_info_t *)calloc(1, sizeof(jpeg_dec_header_info_t));
-    if (out_info == NULL)
-    {
-        ret = JPEG_ERR_NO_MEM;
-        goto jpeg_dec_clean;
-    }
-
-    // Set input buffer and buffer len to io_callback
-    jpeg_io->inbuf = input_buf;
-    jpeg_io->inbuf_len = len;
-
-    // Parse jpeg picture header and get picture for user and decoder
-    ret = jpeg_dec_parse_header(jpeg_dec, jpeg_io, out_info);
-    if (ret != JPEG_ERR_OK)
+    // Decodes straight into the input tensor, no copy.
+    prediction_result_t result = prepare_input(fb, interpreter->input(0)->data.uint8);
+    if (result.err == ESP_OK)
     {
-        goto jpeg_dec_clean;
+        invoke(result);
     }
-
-    *out_len = out_info->width * out_info->height * 3;
-    ESP_LOGD("jpeg_decode", "Decoded JPEG image size: %dx%d, output len: %d",
-             out_info->width, out_info->height, *out_len);
-    // Calloc out_put data buffer and update inbuf ptr and inbuf_len
-    if (config.output_type == JPEG_PIXEL_FORMAT_RGB565_LE ||
-        config.output_type == JPEG_PIXEL_FORMAT_RGB565_BE ||
-        config.output_type == JPEG_PIXEL_FORMAT_CbYCrY)
-    {
-        *out_len = out_info->width * out_info->height * 2;
-    }
-    else if (config.output_type == JPEG_PIXEL_FORMAT_RGB888)
-    {
-        *out_len = out_info->width * out_info->height * 3;
-    }
-    else
-    {
-        ret = JPEG_ERR_INVALID_PARAM;
-        goto jpeg_dec_clean;
-    }
-    jpeg_io->outbuf = output_buf;
-
-    // Start decode jpeg
-    ret = jpeg_dec_process(jpeg_dec, jpeg_io);
-    if (ret != JPEG_ERR_OK)
-    {
-        goto jpeg_dec_clean;
-    }
-
-    // Decoder deinitialize
-jpeg_dec_clean:
-    jpeg_dec_close(jpeg_dec);
-    if (jpeg_io)
-    {
-        free(jpeg_io);
-    }
-    if (out_info)
-    {
-        free(out_info);
-    }
-
-    return ret;
+    return result;
 }
 
 litter_robot_detect::prediction_result_t
-litter_robot_detect::CatDetect::run_inference(const camera_fb_t *fb)
+litter_robot_detect::CatDetect::prepare_input(const camera_fb_t *fb, uint8_t *input)
 {
     prediction_result_t result;
     result.err = ESP_OK;
-    TfLiteTensor *input = interpreter->input(0);
-
-    uint32_t start_decode = esp_log_timestamp();
 
 #if USE_ESP_NEW_JPEG == 0
     ESP_LOGI(TAG, "Decoding JPEG using esp_jpeg");
     esp_jpeg_image_cfg_t jpeg_cfg = {
         .indata = fb->buf,
         .indata_size = fb->len,
-        .outbuf = input->data.uint8, // Decode directly to tensor input
-        .outbuf_size = input->bytes,
+        .outbuf = input, // Decode directly to tensor input
+        .outbuf_size = input_bytes(),
         .out_format = JPEG_IMAGE_FORMAT_RGB888,
         .out_scale = JPEG_IMAGE_SCALE_0,
         .flags = {
@@ -203,63 +134,100 @@ litter_robot_detect::CatDetect::run_inference(const camera_fb_t *fb)
         return result;
     }
 #else
-    uint8_t height = input->dims->data[1];
-    uint8_t width = input->dims->data[2];
-    ESP_LOGI(TAG, "Decoding JPEG using esp_new_jpeg to %dx%d", width, height);
-    jpeg_error_t decode_err = decode_jpeg(
-        fb->buf, fb->len, height, width, input->data.uint8, (int *)&input->bytes);
+    // With an ROI the frame is decoded at a DCT scale where the ROI still
+    // covers the tensor, into the decoder's own buffer, and only the ROI is
+    // resized into the tensor below.
+    bool crop = prepare_roi(fb, true);
+    jpeg_decoder::decoded_image_t decoded;
+    jpeg_error_t decode_err = crop ? decoder.decode(fb->buf, fb->len, decoded)
+                                   : decoder.decode(fb->buf, fb->len, decoded, input, input_bytes());
     if (decode_err != JPEG_ERR_OK)
     {
-        ESP_LOGE(TAG, "decode_jpeg failed with error %d", decode_err);
+        ESP_LOGE(TAG, "JPEG decode failed with error %d", decode_err);
         result.err = ESP_FAIL;
         return result;
     }
+    result.timings.decode_us = decoded.decode_us;
 #endif
-    uint32_t end_decode = esp_log_timestamp();
-    ESP_LOGI(TAG, "JPEG decode took %lu ms", end_decode - start_decode);
-
     // Fix for signed int8 models: convert [0,255] to [-128,127]
     // TFLite quantization often expects int8 inputs (-128 to 127) internally.
     // If inference_input_type was not strictly enforced or if the model
     // lacks a Cast/Quantize op at the entry, the input tensor might be int8.
     // Passing raw uint8 [0,255] results in wrapping (128 becomes -128), ruining
     // predictions.
-    if (input->type == kTfLiteInt8)
+    int64_t start_preprocess = esp_timer_get_time();
+#if USE_ESP_NEW_JPEG != 0
+    if (crop)
     {
-        ESP_LOGI(TAG, "Using int8 input tensor, adjusting [0,255] to [-128,127]");
-        uint8_t *data = input->data.uint8;
-        for (size_t i = 0; i < input->bytes; i++)
-        {
-            // xor 0x80 is equivalent to subtracting 128 for byte-sized values
-            // 0 (0x00) ^ 0x80 = 128 (0x80) -> interpreted as -128
-            // 255 (0xFF) ^ 0x80 = 127 (0x7F) -> interpreted as 127
-            data[i] ^= 0x80;
-        }
+        crop_roi_to_input(decoded, active_roi, input, input_width, input_height);
     }
+#endif
+    if (interpreter->input(0)->type == kTfLiteInt8)
+    {
+        uint8_to_int8(input, input_bytes());
+    }
+    result.timings.preprocess_us = esp_timer_get_time() - start_preprocess;
+    return result;
+}
 
-#if ESP_LOG_LEVEL >= ESP_LOG_INFO
-    for (int i = 0; i < 10; i++)
+litter_robot_detect::prediction_result_t
+litter_robot_detect::CatDetect::run_prepared(const uint8_t *input)
+{
+    prediction_result_t result;
+    TfLiteTensor *tensor = interpreter->input(0);
+    int64_t start_copy = esp_timer_get_time();
+    if (input != tensor->data.uint8)
     {
-        ESP_LOGD(TAG, "Input tensor data[%d]=%d", i, input->data.uint8[i]);
+        memcpy(tensor->data.uint8, input, tensor->bytes);
     }
+    result.timings.preprocess_us = esp_timer_get_time() - start_copy;
 
-    // Print the last 10 bytes of the input tensor for debugging
-    for (int i = input->bytes - 10; i < input->bytes; i++)
+    invoke(result);
+    return result;
+}
+
+litter_robot_detect::prediction_result_t
+litter_robot_detect::CatDetect::run_inference(const jpeg_decoder::decoded_image_t &image, const roi_t &crop)
+{
+    prediction_result_t result;
+    TfLiteTensor *input = interpreter->input(0);
+
+    int64_t start_preprocess = esp_timer_get_time();
+    roi_t rect = jpeg_decoder::clip_rect(crop, image.width, image.height);
+    if (!rect.width)
     {
-        ESP_LOGD(TAG, "Input tensor data[%d]=%d", i, input->data.uint8[i]);
+        rect = {.x = 0, .y = 0, .width = image.width, .height = image.height};
     }
-#endif
+    jpeg_decoder::crop_resize_nearest(image.data, image.width, 3, rect, input->data.uint8, input_width, input_height);
+    if (input->type == kTfLiteInt8)
+    {
+        uint8_to_int8(input->data.uint8, input->bytes);
+    }
+    result.timings.preprocess_us = esp_timer_get_time() - start_preprocess;
+
+    invoke(result);
+    return result;
+}
 
+void litter_robot_detect::CatDetect::invoke(prediction_result_t &result)
+{
+    TfLiteTensor *input = interpreter->input(0);
+    TRACE_BYTES(TRACE_INPUT_HEAD, 0, input->data.uint8, 16);
+    TRACE_BYTES(TRACE_INPUT_TAIL, 0, input->data.uint8 + input->bytes - 16, 16);
+
+    int64_t start_invoke = esp_timer_get_time();
     TfLiteStatus invokeStatus = this->interpreter->Invoke();
+    result.timings.invoke_us = esp_timer_get_time() - start_invoke;
     if (invokeStatus != kTfLiteOk)
     {
         ESP_LOGE(TAG, "Invoke failed");
         result.err = ESP_FAIL;
-        return result;
+        return;
     }
 
+    int64_t start_postprocess = esp_timer_get_time();
     decode_result(result);
-    return result;
+    result.timings.postprocess_us = esp_timer_get_time() - start_postprocess;
 }
 
 void litter_robot_detect::CatDetect::decode_result(
@@ -289,9 +257,6 @@ void litter_robot_detect::CatDetect::decode_result(
         return;
     }
 
-    ESP_LOGI(TAG, "empty_score=%d nachi_score=%d ngao_score=%d", empty_score,
-             nachi_score, ngao_score);
-
     uint8_t scores[] = {empty_score, nachi_score, ngao_score};
     int max_index = 0;
     for (int i = 1; i < 3; ++i)
@@ -302,6 +267,8 @@ void litter_robot_detect::CatDetect::decode_result(
         }
     }
 
+    TRACE_RECORD(TRACE_SCORES, 0, empty_score, nachi_score, ngao_score, max_index);
+
     result.empty_score = empty_score;
     result.nachi_score = nachi_score;
     result.ngao_score = ngao_score;
@@ -0,0 +1,145 @@
+#include "frame_source.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static std::string parent_name(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos)
+    {
+        return "";
+    }
+    size_t start = path.find_last_of('/', slash - 1);
+    start = start == std::string::npos ? 0 : start + 1;
+    return path.substr(start, slash - start);
+}
+
+static bool is_jpeg(const std::string &name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+    {
+        return false;
+    }
+    std::string ext = name.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "jpg" || ext == "jpeg";
+}
+
+bool host::FrameSource::add(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        fprintf(stderr, "Cannot access %s\n", path.c_str());
+        return false;
+    }
+
+    size_t before = this->frames.size();
+    if (S_ISDIR(st.st_mode))
+    {
+        this->add_directory(path, 0);
+    }
+    else
+    {
+        this->frames.push_back({path, parent_name(path)});
+    }
+    std::sort(this->frames.begin() + before, this->frames.end(),
+              [](const frame_t &a, const frame_t &b) { return a.path < b.path; });
+    return true;
+}
+
+void host::FrameSource::add_directory(const std::string &path, int depth)
+{
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+    {
+        return;
+    }
+    while (struct dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        std::string child = path + "/" + entry->d_name;
+        struct stat st;
+        if (stat(child.c_str(), &st) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && depth == 0)
+        {
+            this->add_directory(child, depth + 1);
+        }
+        else if (S_ISREG(st.st_mode) && is_jpeg(entry->d_name))
+        {
+            this->frames.push_back({child, parent_name(child)});
+        }
+    }
+    closedir(dir);
+}
+
+bool host::FrameSource::load(size_t index, camera_fb_t &fb)
+{
+    FILE *file = fopen(this->frames[index].path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    this->buffer.resize(len > 0 ? len : 0);
+    size_t read = fread(this->buffer.data(), 1, this->buffer.size(), file);
+    fclose(file);
+    if (len <= 0 || read != (size_t)len)
+    {
+        return false;
+    }
+
+    fb = {};
+    fb.buf = this->buffer.data();
+    fb.len = this->buffer.size();
+    fb.format = PIXFORMAT_JPEG;
+    return jpeg_dimensions(fb.buf, fb.len, fb.width, fb.height);
+}
+
+bool host::jpeg_dimensions(const uint8_t *jpeg, size_t len, size_t &width, size_t &height)
+{
+    if (len < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+    {
+        return false;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= len)
+    {
+        if (jpeg[pos] != 0xff)
+        {
+            return false;
+        }
+        uint8_t marker = jpeg[pos + 1];
+        if (marker == 0xff)
+        {
+            pos++;
+            continue;
+        }
+        size_t segment = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+        // Any SOFn except DHT (C4), JPG (C8) and DAC (CC).
+        if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+        {
+            if (pos + 9 > len)
+            {
+                return false;
+            }
+            height = (jpeg[pos + 5] << 8) | jpeg[pos + 6];
+            width = (jpeg[pos + 7] << 8) | jpeg[pos + 8];
+            return true;
+        }
+        pos += 2 + segment;
+    }
+    return false;
+}
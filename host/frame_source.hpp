@@ -0,0 +1,43 @@
+#pragma once
+
+#include "esp_camera.h"
+#include <string>
+#include <vector>
+
+namespace host
+{
+    // Stands in for the camera driver: hands out JPEG files as camera_fb_t.
+    //
+    // Paths may be single files or directories. Directories are searched one
+    // level deep. A frame's label is the name of the directory it is in, so a
+    // capture set laid out as frames/<class>/*.jpg can be scored for
+    // accuracy. Frames are returned in path order.
+    class FrameSource
+    {
+    public:
+        bool add(const std::string &path);
+        size_t size() const { return this->frames.size(); }
+        const std::string &path(size_t index) const { return this->frames[index].path; }
+        const std::string &label(size_t index) const { return this->frames[index].label; }
+
+        // Reads the frame into a buffer owned by the source. The returned
+        // fb stays valid until the next load().
+        bool load(size_t index, camera_fb_t &fb);
+
+    private:
+        typedef struct
+        {
+            std::string path;
+            std::string label;
+        } frame_t;
+
+        std::vector<frame_t> frames;
+        std::vector<uint8_t> buffer;
+
+        void add_directory(const std::string &path, int depth);
+    };
+
+    // Width and height from the JPEG start-of-frame marker, as the camera
+    // driver would report them in camera_fb_t.
+    bool jpeg_dimensions(const uint8_t *jpeg, size_t len, size_t &width, size_t &height);
+} // namespace host
@@ -0,0 +1,422 @@
+// Replays captured JPEG frames through the detection pipeline on a Linux
+// host and reports per-stage latency and, when a model is linked in,
+// classification accuracy against the frame labels.
+//
+//   replay [options] <frame or directory>...
+//     --repeat N       replay the whole set N times
+//     --input WxH      model input size for the decode-only pipeline (96x96)
+//     --roi X,Y,W,H    classifier region of interest in frame pixels
+//     --no-gate        run every frame, bypassing the motion gate
+//     --csv FILE       write one row of timings per frame
+//     --bench N        instead of replaying, time N frames of decoder setup
+//                      on the first frame, per frame open/close against a
+//                      persistent handle
+
+#include "esp_timer.h"
+#include "frame_source.hpp"
+#include "input_quant.hpp"
+#include "input_roi.hpp"
+#include "jpeg_decoder.hpp"
+#include "motion_gate.hpp"
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef HOST_TFLM
+#include "litter_robot_detect.hpp"
+#endif
+
+namespace
+{
+    typedef enum
+    {
+        STAGE_GATE,
+        STAGE_DECODE,
+        STAGE_PREPROCESS,
+        STAGE_INVOKE,
+        STAGE_POSTPROCESS,
+        STAGE_TOTAL,
+        STAGE_COUNT,
+    } stage_t;
+
+    const char *STAGE_NAMES[STAGE_COUNT] = {"gate", "decode", "preprocess", "invoke", "postprocess", "total"};
+    const char *CLASSES[] = {"empty", "nachi", "ngao"};
+
+    typedef struct
+    {
+        int repeat{1};
+        uint16_t input_width{96};
+        uint16_t input_height{96};
+        jpeg_decoder::rect_t roi{};
+        bool gate{true};
+        const char *csv{nullptr};
+        int bench{0};
+        std::vector<std::string> paths;
+    } options_t;
+
+    typedef struct
+    {
+        bool ok{false};
+        uint32_t stage_us[STAGE_COUNT]{};
+        std::string predicted_class;
+    } frame_result_t;
+
+#ifdef HOST_TFLM
+    // The real litter_robot_detect TFLite path, decode to postprocess.
+    class Pipeline
+    {
+    public:
+        bool setup(const options_t &options)
+        {
+            if (this->detect.setup(1024 * 1024) != ESP_OK)
+            {
+                return false;
+            }
+            this->detect.set_roi(options.roi);
+            return true;
+        }
+
+        void run(const camera_fb_t *fb, frame_result_t &result)
+        {
+            litter_robot_detect::prediction_result_t prediction = this->detect.run_inference(fb);
+            result.ok = prediction.err == ESP_OK;
+            result.stage_us[STAGE_DECODE] = prediction.timings.decode_us;
+            result.stage_us[STAGE_PREPROCESS] = prediction.timings.preprocess_us;
+            result.stage_us[STAGE_INVOKE] = prediction.timings.invoke_us;
+            result.stage_us[STAGE_POSTPROCESS] = prediction.timings.postprocess_us;
+            result.predicted_class = prediction.predicted_class;
+        }
+
+        static constexpr bool HAS_MODEL = true;
+
+    private:
+        litter_robot_detect::CatDetect detect;
+    };
+#else
+    // Without a model only decode and preprocess run, through the same ROI,
+    // crop and int8 helpers the TFLite path in litter_robot_detect uses:
+    // exact decode into the input tensor, or a DCT-scaled decode plus ROI
+    // crop, then the int8 flip.
+    class Pipeline
+    {
+    public:
+        bool setup(const options_t &options)
+        {
+            this->options = options;
+            this->tensor.resize((size_t)options.input_width * options.input_height * 3);
+            return true;
+        }
+
+        void run(const camera_fb_t *fb, frame_result_t &result)
+        {
+            if (fb->width != this->frame_width || fb->height != this->frame_height)
+            {
+                this->frame_width = fb->width;
+                this->frame_height = fb->height;
+                this->roi = this->options.roi;
+                this->crop = litter_robot_detect::configure_roi_decode(this->decoder, this->roi, fb->width, fb->height,
+                                                                       this->options.input_width,
+                                                                       this->options.input_height, true);
+            }
+
+            jpeg_decoder::decoded_image_t decoded;
+            jpeg_error_t err = this->crop
+                                   ? this->decoder.decode(fb->buf, fb->len, decoded)
+                                   : this->decoder.decode(fb->buf, fb->len, decoded, this->tensor.data(), this->tensor.size());
+            if (err != JPEG_ERR_OK)
+            {
+                fprintf(stderr, "JPEG decode failed with error %d\n", err);
+                return;
+            }
+            result.stage_us[STAGE_DECODE] = decoded.decode_us;
+
+            int64_t start = esp_timer_get_time();
+            if (this->crop)
+            {
+                litter_robot_detect::crop_roi_to_input(decoded, this->roi, this->tensor.data(),
+                                                       this->options.input_width, this->options.input_height);
+            }
+            litter_robot_detect::uint8_to_int8(this->tensor.data(), this->tensor.size());
+            result.stage_us[STAGE_PREPROCESS] = esp_timer_get_time() - start;
+            result.ok = true;
+        }
+
+        static constexpr bool HAS_MODEL = false;
+
+    private:
+        options_t options;
+        jpeg_decoder::JpegDecoder decoder;
+        jpeg_decoder::rect_t roi{};
+        bool crop{false};
+        std::vector<uint8_t> tensor;
+        size_t frame_width{0};
+        size_t frame_height{0};
+    };
+#endif
+
+    void usage(const char *argv0)
+    {
+        fprintf(stderr,
+                "usage: %s [--repeat N] [--input WxH] [--roi X,Y,W,H] [--no-gate] [--csv FILE] [--bench N] "
+                "<frame or directory>...\n",
+                argv0);
+    }
+
+    bool parse_options(int argc, char **argv, options_t &options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const char *arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (strcmp(arg, "--repeat") == 0 && has_value)
+            {
+                options.repeat = atoi(argv[++i]);
+            }
+            else if (strcmp(arg, "--input") == 0 && has_value)
+            {
+                unsigned w, h;
+                if (sscanf(argv[++i], "%ux%u", &w, &h) != 2 || !w || !h)
+                {
+                    return false;
+                }
+                options.input_width = w;
+                options.input_height = h;
+            }
+            else if (strcmp(arg, "--roi") == 0 && has_value)
+            {
+                unsigned x, y, w, h;
+                if (sscanf(argv[++i], "%u,%u,%u,%u", &x, &y, &w, &h) != 4)
+                {
+                    return false;
+                }
+                options.roi = {.x = (uint16_t)x, .y = (uint16_t)y, .width = (uint16_t)w, .height = (uint16_t)h};
+            }
+            else if (strcmp(arg, "--no-gate") == 0)
+            {
+                options.gate = false;
+            }
+            else if (strcmp(arg, "--csv") == 0 && has_value)
+            {
+                options.csv = argv[++i];
+            }
+            else if (strcmp(arg, "--bench") == 0 && has_value)
+            {
+                options.bench = atoi(argv[++i]);
+                if (options.bench <= 0)
+                {
+                    return false;
+                }
+            }
+            else if (arg[0] == '-')
+            {
+                return false;
+            }
+            else
+            {
+                options.paths.push_back(arg);
+            }
+        }
+        return !options.paths.empty() && options.repeat > 0;
+    }
+
+    uint32_t percentile(const std::vector<uint32_t> &sorted, int pct)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        size_t rank = (sorted.size() * pct + 99) / 100;
+        return sorted[rank ? rank - 1 : 0];
+    }
+
+    bool is_class(const std::string &label)
+    {
+        for (const char *name : CLASSES)
+        {
+            if (label == name)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    options_t options;
+    if (!parse_options(argc, argv, options))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    host::FrameSource source;
+    for (const auto &path : options.paths)
+    {
+        if (!source.add(path))
+        {
+            return 1;
+        }
+    }
+    if (source.size() == 0)
+    {
+        fprintf(stderr, "No JPEG frames found\n");
+        return 1;
+    }
+
+    if (options.bench)
+    {
+        camera_fb_t fb;
+        if (!source.load(0, fb))
+        {
+            fprintf(stderr, "Cannot read %s\n", source.path(0).c_str());
+            return 1;
+        }
+        jpeg_decoder::setup_benchmark_t setup;
+        if (jpeg_decoder::benchmark_setup_overhead(fb.buf, fb.len, options.bench, setup) != JPEG_ERR_OK)
+        {
+            fprintf(stderr, "Decoder setup benchmark failed\n");
+            return 1;
+        }
+        printf("decoder setup over %d frames: open/close %" PRIu32 " us, persistent %" PRIu32 " us, saved %d us\n",
+               setup.iterations, setup.reopen_us, setup.persistent_us, (int)(setup.reopen_us - setup.persistent_us));
+        return 0;
+    }
+
+    Pipeline pipeline;
+    if (!pipeline.setup(options))
+    {
+        fprintf(stderr, "Pipeline setup failed\n");
+        return 1;
+    }
+    myapp::MotionGate gate;
+    if (options.gate && gate.init() != ESP_OK)
+    {
+        return 1;
+    }
+
+    FILE *csv = nullptr;
+    if (options.csv)
+    {
+        csv = fopen(options.csv, "w");
+        if (!csv)
+        {
+            fprintf(stderr, "Cannot open %s\n", options.csv);
+            return 1;
+        }
+        fprintf(csv, "path,label,inferred,gate_us,decode_us,preprocess_us,invoke_us,postprocess_us,total_us,predicted\n");
+    }
+
+    std::vector<uint32_t> samples[STAGE_COUNT];
+    uint32_t failures = 0;
+    uint32_t labelled = 0;
+    uint32_t correct = 0;
+    for (int round = 0; round < options.repeat; round++)
+    {
+        for (size_t i = 0; i < source.size(); i++)
+        {
+            camera_fb_t fb;
+            if (!source.load(i, fb))
+            {
+                fprintf(stderr, "Cannot read %s\n", source.path(i).c_str());
+                failures++;
+                continue;
+            }
+
+            frame_result_t result;
+            int64_t start = esp_timer_get_time();
+            bool infer = true;
+            if (options.gate)
+            {
+                infer = gate.check(&fb);
+                result.stage_us[STAGE_GATE] = esp_timer_get_time() - start;
+                samples[STAGE_GATE].push_back(result.stage_us[STAGE_GATE]);
+            }
+            if (infer)
+            {
+                int64_t start_infer = esp_timer_get_time();
+                pipeline.run(&fb, result);
+                if (options.gate)
+                {
+                    gate.account_inference(esp_timer_get_time() - start_infer);
+                }
+                if (!result.ok)
+                {
+                    fprintf(stderr, "Pipeline failed on %s\n", source.path(i).c_str());
+                    failures++;
+                    continue;
+                }
+                for (int stage = STAGE_DECODE; stage < STAGE_TOTAL; stage++)
+                {
+                    samples[stage].push_back(result.stage_us[stage]);
+                }
+            }
+            result.stage_us[STAGE_TOTAL] = esp_timer_get_time() - start;
+            samples[STAGE_TOTAL].push_back(result.stage_us[STAGE_TOTAL]);
+
+            const std::string &label = source.label(i);
+            if (infer && Pipeline::HAS_MODEL && is_class(label))
+            {
+                labelled++;
+                correct += result.predicted_class == label;
+            }
+            if (csv)
+            {
+                fprintf(csv, "%s,%s,%d", source.path(i).c_str(), label.c_str(), infer);
+                for (int stage = 0; stage < STAGE_COUNT; stage++)
+                {
+                    fprintf(csv, ",%" PRIu32, result.stage_us[stage]);
+                }
+                fprintf(csv, ",%s\n", result.predicted_class.c_str());
+            }
+        }
+    }
+    if (csv)
+    {
+        fclose(csv);
+    }
+
+    printf("%-12s %8s %10s %10s %10s %10s %10s\n", "stage", "frames", "mean_us", "p50_us", "p95_us", "p99_us", "max_us");
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        std::vector<uint32_t> &values = samples[stage];
+        bool model_stage = stage == STAGE_INVOKE || stage == STAGE_POSTPROCESS;
+        if (values.empty() || (model_stage && !Pipeline::HAS_MODEL))
+        {
+            continue;
+        }
+        std::sort(values.begin(), values.end());
+        uint64_t sum = 0;
+        for (uint32_t value : values)
+        {
+            sum += value;
+        }
+        printf("%-12s %8zu %10" PRIu64 " %10" PRIu32 " %10" PRIu32 " %10" PRIu32 " %10" PRIu32 "\n",
+               STAGE_NAMES[stage], values.size(), sum / values.size(), percentile(values, 50), percentile(values, 95),
+               percentile(values, 99), values.back());
+    }
+
+    if (options.gate)
+    {
+        myapp::motion_stats_t motion = gate.get_stats();
+        printf("motion gate: checked %" PRIu32 ", skipped %" PRIu32 ", forced %" PRIu32 "\n", motion.checked, motion.skipped, motion.forced);
+    }
+    if (!Pipeline::HAS_MODEL)
+    {
+        printf("accuracy: n/a (built without a model)\n");
+    }
+    else if (labelled == 0)
+    {
+        printf("accuracy: n/a (no frames under empty/, nachi/ or ngao/)\n");
+    }
+    else
+    {
+        printf("accuracy: %" PRIu32 "/%" PRIu32 " (%.1f%%)\n", correct, labelled, 100.0 * correct / labelled);
+    }
+    printf("failures: %" PRIu32 "\n", failures);
+    return failures ? 1 : 0;
+}
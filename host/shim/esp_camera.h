@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "sdkconfig.h"
+
+typedef enum
+{
+    PIXFORMAT_RGB565,
+    PIXFORMAT_YUV422,
+    PIXFORMAT_YUV420,
+    PIXFORMAT_GRAYSCALE,
+    PIXFORMAT_JPEG,
+    PIXFORMAT_RGB888,
+} pixformat_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    size_t width;
+    size_t height;
+    pixformat_t format;
+    struct timeval timestamp;
+} camera_fb_t;
@@ -0,0 +1,49 @@
+#pragma once
+
+// Subset of esp_new_jpeg's public API, implemented on libjpeg in
+// esp_jpeg_dec.cpp so components/jpeg_decoder builds unchanged on the host.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    JPEG_ERR_OK = 0,
+    JPEG_ERR_FAIL = -1,
+    JPEG_ERR_NO_MEM = -2,
+    JPEG_ERR_NO_MORE_DATA = -3,
+    JPEG_ERR_INVALID_PARAM = -4,
+    JPEG_ERR_BAD_DATA = -5,
+    JPEG_ERR_UNSUPPORT_FMT = -6,
+    JPEG_ERR_UNSUPPORT_STD = -7,
+} jpeg_error_t;
+
+typedef enum
+{
+    JPEG_PIXEL_FORMAT_GRAY,
+    JPEG_PIXEL_FORMAT_RGB888,
+    JPEG_PIXEL_FORMAT_RGBA,
+    JPEG_PIXEL_FORMAT_YCbYCr,
+    JPEG_PIXEL_FORMAT_YCbY2YCrY2,
+    JPEG_PIXEL_FORMAT_RGB565_BE,
+    JPEG_PIXEL_FORMAT_RGB565_LE,
+    JPEG_PIXEL_FORMAT_CbYCrY,
+} jpeg_pixel_format_t;
+
+typedef enum
+{
+    JPEG_ROTATE_0D,
+    JPEG_ROTATE_90D,
+    JPEG_ROTATE_180D,
+    JPEG_ROTATE_270D,
+} jpeg_rotate_t;
+
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+} jpeg_resolution_t;
+
+void *jpeg_calloc_align(size_t size, int aligned);
+void jpeg_free_align(void *data);
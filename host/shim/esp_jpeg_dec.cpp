@@ -0,0 +1,210 @@
+#include "esp_jpeg_dec.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+// esp_new_jpeg decodes straight to the requested scale. libjpeg only scales
+// by 1/1, 1/2, 1/4 and 1/8 in the DCT, so the shim decodes at the largest of
+// those that still covers the request and finishes with a nearest-neighbour
+// resize. Latency numbers from the host are for relative comparisons only.
+
+typedef struct
+{
+    jpeg_dec_config_t config;
+    uint16_t src_width;
+    uint16_t src_height;
+} host_decoder_t;
+
+typedef struct
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} error_mgr_t;
+
+static void on_error(j_common_ptr cinfo)
+{
+    longjmp(((error_mgr_t *)cinfo->err)->jump, 1);
+}
+
+static size_t bytes_per_pixel(jpeg_pixel_format_t format)
+{
+    switch (format)
+    {
+    case JPEG_PIXEL_FORMAT_GRAY:
+        return 1;
+    case JPEG_PIXEL_FORMAT_RGB565_BE:
+    case JPEG_PIXEL_FORMAT_RGB565_LE:
+        return 2;
+    case JPEG_PIXEL_FORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+static void output_size(const host_decoder_t *dec, uint16_t *width, uint16_t *height)
+{
+    bool scaled = dec->config.scale.width != 0 && dec->config.scale.height != 0;
+    *width = scaled ? dec->config.scale.width : dec->src_width;
+    *height = scaled ? dec->config.scale.height : dec->src_height;
+}
+
+void *jpeg_calloc_align(size_t size, int aligned)
+{
+    void *data = NULL;
+    if (posix_memalign(&data, aligned < (int)sizeof(void *) ? sizeof(void *) : aligned, size) != 0)
+    {
+        return NULL;
+    }
+    memset(data, 0, size);
+    return data;
+}
+
+void jpeg_free_align(void *data)
+{
+    free(data);
+}
+
+jpeg_error_t jpeg_dec_open(jpeg_dec_config_t *config, jpeg_dec_handle_t *jpeg_dec)
+{
+    if (!config || !jpeg_dec || bytes_per_pixel(config->output_type) == 0)
+    {
+        return JPEG_ERR_INVALID_PARAM;
+    }
+    host_decoder_t *dec = (host_decoder_t *)calloc(1, sizeof(host_decoder_t));
+    if (!dec)
+    {
+        return JPEG_ERR_NO_MEM;
+    }
+    dec->config = *config;
+    *jpeg_dec = dec;
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_dec_parse_header(jpeg_dec_handle_t jpeg_dec, jpeg_dec_io_t *io, jpeg_dec_header_info_t *out_info)
+{
+    host_decoder_t *dec = (host_decoder_t *)jpeg_dec;
+    struct jpeg_decompress_struct cinfo;
+    error_mgr_t err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = on_error;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return JPEG_ERR_BAD_DATA;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, io->inbuf, io->inbuf_len);
+    jpeg_read_header(&cinfo, TRUE);
+    dec->src_width = cinfo.image_width;
+    dec->src_height = cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+
+    out_info->width = dec->src_width;
+    out_info->height = dec->src_height;
+    io->inbuf_remain = io->inbuf_len;
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_dec_get_outbuf_len(jpeg_dec_handle_t jpeg_dec, int *outbuf_len)
+{
+    host_decoder_t *dec = (host_decoder_t *)jpeg_dec;
+    uint16_t width, height;
+    output_size(dec, &width, &height);
+    *outbuf_len = (int)((size_t)width * height * bytes_per_pixel(dec->config.output_type));
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_dec_process(jpeg_dec_handle_t jpeg_dec, jpeg_dec_io_t *io)
+{
+    host_decoder_t *dec = (host_decoder_t *)jpeg_dec;
+    uint16_t width, height;
+    output_size(dec, &width, &height);
+    jpeg_pixel_format_t format = dec->config.output_type;
+    bool gray = format == JPEG_PIXEL_FORMAT_GRAY;
+
+    struct jpeg_decompress_struct cinfo;
+    error_mgr_t err;
+    uint8_t *volatile full = NULL; // volatile: read again after a longjmp
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = on_error;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        free(full);
+        return JPEG_ERR_BAD_DATA;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, io->inbuf, io->inbuf_len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    for (unsigned denom = 8; denom > 1; denom >>= 1)
+    {
+        if (cinfo.image_width / denom >= width && cinfo.image_height / denom >= height)
+        {
+            cinfo.scale_denom = denom;
+            break;
+        }
+    }
+    jpeg_start_decompress(&cinfo);
+
+    size_t components = cinfo.output_components;
+    size_t stride = (size_t)cinfo.output_width * components;
+    full = (uint8_t *)malloc(stride * cinfo.output_height);
+    if (!full)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return JPEG_ERR_NO_MEM;
+    }
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = full + (size_t)cinfo.output_scanline * stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    uint8_t *out = io->outbuf;
+    for (uint16_t y = 0; y < height; y++)
+    {
+        const uint8_t *src_row = full + (size_t)y * cinfo.output_height / height * stride;
+        for (uint16_t x = 0; x < width; x++)
+        {
+            const uint8_t *px = src_row + (size_t)x * cinfo.output_width / width * components;
+            switch (format)
+            {
+            case JPEG_PIXEL_FORMAT_GRAY:
+                *out++ = px[0];
+                break;
+            case JPEG_PIXEL_FORMAT_RGB888:
+                *out++ = px[0];
+                *out++ = px[1];
+                *out++ = px[2];
+                break;
+            default:
+            {
+                uint16_t rgb565 = ((px[0] & 0xf8) << 8) | ((px[1] & 0xfc) << 3) | (px[2] >> 3);
+                bool big_endian = format == JPEG_PIXEL_FORMAT_RGB565_BE;
+                *out++ = big_endian ? rgb565 >> 8 : rgb565 & 0xff;
+                *out++ = big_endian ? rgb565 & 0xff : rgb565 >> 8;
+                break;
+            }
+            }
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(full);
+    io->inbuf_remain = 0;
+    io->out_size = out - io->outbuf;
+    return JPEG_ERR_OK;
+}
+
+jpeg_error_t jpeg_dec_close(jpeg_dec_handle_t jpeg_dec)
+{
+    free(jpeg_dec);
+    return JPEG_ERR_OK;
+}
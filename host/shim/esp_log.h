@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline uint32_t esp_log_timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define ESP_LOG_NONE 0
+#define ESP_LOG_ERROR 1
+#define ESP_LOG_WARN 2
+#define ESP_LOG_INFO 3
+#define ESP_LOG_DEBUG 4
+#define ESP_LOG_VERBOSE 5
+#ifndef ESP_LOG_LEVEL
+#define ESP_LOG_LEVEL ESP_LOG_WARN
+#endif
+
+#define HOST_LOG(level, letter, tag, format, ...)                              \
+    do                                                                         \
+    {                                                                          \
+        if (ESP_LOG_LEVEL >= level)                                            \
+        {                                                                      \
+            fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__);  \
+        }                                                                      \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
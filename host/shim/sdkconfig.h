@@ -0,0 +1,25 @@
+#pragma once
+
+// Defaults of the Kconfig options the host build compiles against; keep in
+// step with main/Kconfig.projbuild and the component Kconfig files.
+
+#define CONFIG_MOTION_GATE 1
+#define CONFIG_MOTION_GATE_PIXEL_THRESHOLD 25
+#define CONFIG_MOTION_GATE_AREA_PERMILLE 10
+#define CONFIG_MOTION_GATE_BACKGROUND_SHIFT 4
+#define CONFIG_MOTION_GATE_MAX_SKIP 300
+
+#define CONFIG_LITTER_ROBOT_ROI_X 0
+#define CONFIG_LITTER_ROBOT_ROI_Y 0
+#define CONFIG_LITTER_ROBOT_ROI_WIDTH 0
+#define CONFIG_LITTER_ROBOT_ROI_HEIGHT 0
+
+#define CONFIG_TRACKER 1
+#define CONFIG_TRACKER_MAX_TRACKS 8
+#define CONFIG_TRACKER_MIN_HITS 3
+#define CONFIG_TRACKER_MAX_AGE 10
+#define CONFIG_TRACKER_IOU_PERMILLE 300
+#define CONFIG_TRACKER_LINE_X1 0
+#define CONFIG_TRACKER_LINE_Y1 240
+#define CONFIG_TRACKER_LINE_X2 640
+#define CONFIG_TRACKER_LINE_Y2 240
@@ -0,0 +1,128 @@
+// Synthetic box sequences through ObjectTracker: identity across frames,
+// coasting over missed detections, line crossings and per-update cost.
+
+#include "object_tracker.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace
+{
+    int failures = 0;
+
+    void expect(bool ok, const char *what)
+    {
+        if (!ok)
+        {
+            printf("FAIL: %s\n", what);
+            failures++;
+        }
+    }
+
+    myapp::track_detection_t box(int cx, int cy, int size)
+    {
+        return {(int16_t)(cx - size / 2), (int16_t)(cy - size / 2), (int16_t)(cx + size / 2), (int16_t)(cy + size / 2), 0.9f};
+    }
+
+    void moving_box_keeps_its_id()
+    {
+        myapp::ObjectTracker tracker;
+        tracker.set_line(320, 0, 320, 480);
+        uint16_t id = 0;
+        int crossings = 0;
+        int8_t direction = 0;
+        for (int frame = 0; frame < 40; frame++)
+        {
+            // 12 px per frame to the right, with a little detector jitter.
+            auto det = box(100 + frame * 12 + (frame % 3) - 1, 200, 80);
+            tracker.update(&det, 1, frame * 100000LL);
+
+            myapp::track_t tracks[myapp::ObjectTracker::MAX_TRACKS];
+            int n = tracker.tracks(tracks, myapp::ObjectTracker::MAX_TRACKS);
+            if (frame >= 2)
+            {
+                expect(n == 1, "one confirmed track");
+                if (n == 1)
+                {
+                    if (id == 0)
+                    {
+                        id = tracks[0].id;
+                    }
+                    expect(tracks[0].id == id, "stable track id");
+                }
+            }
+            const myapp::line_crossing_t *events;
+            int count = tracker.crossings(events);
+            crossings += count;
+            if (count)
+            {
+                direction = events[0].direction;
+            }
+        }
+        expect(crossings == 1, "one crossing of the vertical line");
+        // Looking down the line (+y), moving towards +x is to the left.
+        expect(direction == -1, "crossing direction");
+    }
+
+    void coasts_over_missed_frames()
+    {
+        myapp::ObjectTracker tracker;
+        uint16_t id = 0;
+        for (int frame = 0; frame < 30; frame++)
+        {
+            auto det = box(100 + frame * 8, 300, 60);
+            bool missed = frame >= 15 && frame < 20;
+            tracker.update(&det, missed ? 0 : 1, frame * 100000LL);
+
+            myapp::track_t tracks[myapp::ObjectTracker::MAX_TRACKS];
+            int n = tracker.tracks(tracks, myapp::ObjectTracker::MAX_TRACKS);
+            expect(frame < 2 || n == 1, "track survives the gap");
+            if (n == 1)
+            {
+                id = id ? id : tracks[0].id;
+                expect(tracks[0].id == id, "same id after the gap");
+            }
+        }
+    }
+
+    void separate_objects_get_separate_ids()
+    {
+        myapp::ObjectTracker tracker;
+        for (int frame = 0; frame < 20; frame++)
+        {
+            myapp::track_detection_t dets[] = {box(100, 100 + frame * 5, 60), box(500, 400 - frame * 5, 60)};
+            tracker.update(dets, 2, frame * 100000LL);
+        }
+        myapp::track_t tracks[myapp::ObjectTracker::MAX_TRACKS];
+        int n = tracker.tracks(tracks, myapp::ObjectTracker::MAX_TRACKS);
+        expect(n == 2 && tracks[0].id != tracks[1].id, "two tracks with distinct ids");
+        expect(tracker.get_stats().tracks_created == 2, "no spurious tracks");
+        expect(n == 2 && tracks[0].last_seen_us - tracks[0].first_seen_us == 1900000, "dwell time");
+    }
+
+    void lost_track_is_dropped()
+    {
+        myapp::ObjectTracker tracker;
+        auto det = box(300, 300, 50);
+        for (int frame = 0; frame < 5; frame++)
+        {
+            tracker.update(&det, 1, frame * 100000LL);
+        }
+        for (int frame = 5; frame < 5 + CONFIG_TRACKER_MAX_AGE + 1; frame++)
+        {
+            tracker.update(nullptr, 0, frame * 100000LL);
+        }
+        myapp::track_t tracks[myapp::ObjectTracker::MAX_TRACKS];
+        expect(tracker.tracks(tracks, myapp::ObjectTracker::MAX_TRACKS) == 0, "track dropped after max age");
+        expect(tracker.get_stats().tracks_lost == 1, "loss counted");
+    }
+} // namespace
+
+int main()
+{
+    moving_box_keeps_its_id();
+    coasts_over_missed_frames();
+    separate_objects_get_separate_ids();
+    lost_track_is_dropped();
+    printf("tracker failures: %d\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
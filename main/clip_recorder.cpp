@@ -0,0 +1,539 @@
+#include "clip_recorder.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_vfs_fat.h"
+#include "driver/sdmmc_host.h"
+#include "sdmmc_cmd.h"
+#include <algorithm>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr uint32_t fourcc(const char (&code)[5])
+    {
+        return code[0] | code[1] << 8 | code[2] << 16 | (uint32_t)code[3] << 24;
+    }
+
+    constexpr uint32_t AVIF_HASINDEX = 0x10;
+    constexpr uint32_t AVIIF_KEYFRAME = 0x10;
+
+    // Everything in front of the first frame: RIFF header, hdrl list with
+    // the main and the one stream header, and the movi list header. Written
+    // as a placeholder when the clip opens and again with the final counts
+    // when it closes.
+    typedef struct __attribute__((packed))
+    {
+        uint32_t riff, riff_size, avi;
+        uint32_t hdrl_list, hdrl_size, hdrl;
+        uint32_t avih, avih_size;
+        uint32_t us_per_frame, max_bytes_per_sec, padding_granularity, flags;
+        uint32_t total_frames, initial_frames, streams, suggested_buffer_size;
+        uint32_t width, height, reserved[4];
+        uint32_t strl_list, strl_size, strl;
+        uint32_t strh, strh_size;
+        uint32_t fcc_type, fcc_handler, stream_flags;
+        uint16_t priority, language;
+        uint32_t stream_initial_frames, scale, rate, start, length;
+        uint32_t stream_suggested_buffer_size, quality, sample_size;
+        int16_t frame[4];
+        uint32_t strf, strf_size;
+        uint32_t bi_size;
+        int32_t bi_width, bi_height;
+        uint16_t bi_planes, bi_bit_count;
+        uint32_t bi_compression, bi_size_image;
+        int32_t bi_x_ppm, bi_y_ppm;
+        uint32_t bi_clr_used, bi_clr_important;
+        uint32_t movi_list, movi_size, movi;
+    } avi_header_t;
+    static_assert(sizeof(avi_header_t) == 224, "AVI header layout");
+
+    // Clips are named V<7 digits>.AVI so they fit FATFS 8.3 names.
+    bool parse_clip_name(const char *name, uint32_t &number)
+    {
+        char *end;
+        if (name[0] != 'V' || strlen(name) != 12 || strcasecmp(name + 8, ".AVI") != 0)
+        {
+            return false;
+        }
+        number = strtoul(name + 1, &end, 10);
+        return end == name + 8;
+    }
+} // namespace
+
+myapp::ClipRecorder::~ClipRecorder()
+{
+    heap_caps_free(this->data);
+    heap_caps_free(this->index);
+}
+
+esp_err_t myapp::ClipRecorder::init()
+{
+    this->capacity = CONFIG_CLIP_BUFFER_KB * 1024;
+    this->data = (uint8_t *)heap_caps_malloc(this->capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    this->index = (avi_index_t *)heap_caps_malloc(MAX_CLIP_FRAMES * sizeof(avi_index_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!this->data || !this->index)
+    {
+        ESP_LOGE(TAG, "Failed to allocate the %d KB clip buffer", CONFIG_CLIP_BUFFER_KB);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = this->mount();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to mount clip storage: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // Carry on numbering after the newest clip already stored.
+    DIR *dir = opendir(MOUNT_POINT);
+    if (dir)
+    {
+        uint32_t number;
+        while (struct dirent *file = readdir(dir))
+        {
+            if (parse_clip_name(file->d_name, number))
+            {
+                this->clip_number = std::max(this->clip_number, number);
+            }
+        }
+        closedir(dir);
+    }
+    return ESP_OK;
+}
+
+esp_err_t myapp::ClipRecorder::mount()
+{
+    esp_vfs_fat_mount_config_t config = {};
+    config.max_files = 2;
+    config.allocation_unit_size = 16 * 1024;
+#if CONFIG_CLIP_STORAGE_SDCARD
+    config.format_if_mount_failed = false;
+    sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+    sdmmc_slot_config_t slot = SDMMC_SLOT_CONFIG_DEFAULT();
+    // One data line: on the ESP32-CAM the other three share pins with the
+    // flash LED and the camera.
+    slot.width = 1;
+#if CONFIG_SOC_SDMMC_USE_GPIO_MATRIX
+    slot.clk = (gpio_num_t)CONFIG_CLIP_SD_CLK;
+    slot.cmd = (gpio_num_t)CONFIG_CLIP_SD_CMD;
+    slot.d0 = (gpio_num_t)CONFIG_CLIP_SD_D0;
+#endif
+    slot.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+    sdmmc_card_t *card;
+    return esp_vfs_fat_sdmmc_mount(MOUNT_POINT, &host, &slot, &config, &card);
+#else
+    config.format_if_mount_failed = true;
+    wl_handle_t wl_handle;
+    return esp_vfs_fat_spiflash_mount_rw_wl(MOUNT_POINT, "clips", &config, &wl_handle);
+#endif
+}
+
+esp_err_t myapp::ClipRecorder::start(const task_config_t &task)
+{
+    if (xTaskCreatePinnedToCore(writer_task, task.name, task.stack, this, task.priority, &this->task_handle, task.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create writer task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void myapp::ClipRecorder::sink(SharedFrame *frame, void *ctx)
+{
+    static_cast<ClipRecorder *>(ctx)->buffer(frame->fb());
+}
+
+void myapp::ClipRecorder::buffer(const camera_fb_t *fb)
+{
+    // Runs in the capture task; only the ring bookkeeping is locked, the copy
+    // goes into space no entry refers to yet.
+    int64_t timestamp_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    if (timestamp_us - this->last_buffered_us < FRAME_INTERVAL_US || fb->len > this->capacity)
+    {
+        return;
+    }
+
+    taskENTER_CRITICAL(&this->lock);
+    size_t pos = this->write_pos;
+    bool wrapped = pos + fb->len > this->capacity;
+    if (wrapped)
+    {
+        pos = 0;
+    }
+    bool blocked = false;
+    while (this->tail != this->head)
+    {
+        const entry_t &oldest = this->entry(this->tail);
+        bool left_behind = wrapped && oldest.offset >= this->write_pos;
+        bool overlaps = oldest.offset < pos + fb->len && pos < oldest.offset + oldest.len;
+        bool full = this->head - this->tail >= MAX_ENTRIES;
+        bool expired = this->state == CLIP_IDLE && timestamp_us - oldest.timestamp_us > PRE_EVENT_US;
+        if (!left_behind && !overlaps && !full && !expired)
+        {
+            break;
+        }
+        if (this->tail == this->busy_seq)
+        {
+            blocked = true;
+            break;
+        }
+        bool unwritten = this->tail >= this->next_seq &&
+                         (this->state == CLIP_RECORDING || (this->state == CLIP_STOPPING && this->tail < this->end_seq));
+        if (unwritten)
+        {
+            this->stats.overrun++;
+            this->next_seq = this->tail + 1;
+        }
+        this->tail++;
+    }
+    if (blocked)
+    {
+        // The writer is still reading the frame this one would overwrite.
+        this->stats.overrun++;
+        taskEXIT_CRITICAL(&this->lock);
+        return;
+    }
+    this->write_pos = pos + fb->len;
+    taskEXIT_CRITICAL(&this->lock);
+
+    memcpy(this->data + pos, fb->buf, fb->len);
+    this->last_buffered_us = timestamp_us;
+
+    taskENTER_CRITICAL(&this->lock);
+    this->entry(this->head) = {
+        .offset = (uint32_t)pos,
+        .len = (uint32_t)fb->len,
+        .timestamp_us = timestamp_us,
+        .width = (uint16_t)fb->width,
+        .height = (uint16_t)fb->height,
+    };
+    this->head++;
+    this->stats.buffered++;
+    if (this->state == CLIP_RECORDING &&
+        ((this->holds == 0 && timestamp_us >= this->stop_at_us) || timestamp_us - this->clip_start_us >= MAX_CLIP_US))
+    {
+        this->state = CLIP_STOPPING;
+        this->end_seq = this->head;
+    }
+    bool wake = this->state != CLIP_IDLE;
+    taskEXIT_CRITICAL(&this->lock);
+
+    if (wake)
+    {
+        xTaskNotifyGive(this->task_handle);
+    }
+}
+
+uint32_t myapp::ClipRecorder::first_seq_after(int64_t timestamp_us) const
+{
+    for (uint32_t seq = this->tail; seq != this->head; seq++)
+    {
+        if (this->entries[seq % MAX_ENTRIES].timestamp_us >= timestamp_us)
+        {
+            return seq;
+        }
+    }
+    return this->head;
+}
+
+void myapp::ClipRecorder::trigger(const char *label, int64_t timestamp_us)
+{
+    bool wake = false;
+    taskENTER_CRITICAL(&this->lock);
+    this->holds++;
+    switch (this->state)
+    {
+    case CLIP_IDLE:
+        this->state = CLIP_RECORDING;
+        this->next_seq = this->first_seq_after(timestamp_us - PRE_EVENT_US);
+        this->clip_start_us = timestamp_us;
+        strlcpy(this->label, label, sizeof(this->label));
+        wake = true;
+        break;
+    case CLIP_STOPPING:
+        this->state = CLIP_RECORDING;
+        break;
+    case CLIP_CLOSING:
+        this->restart = true;
+        break;
+    default:
+        break;
+    }
+    taskEXIT_CRITICAL(&this->lock);
+
+    if (wake)
+    {
+        xTaskNotifyGive(this->task_handle);
+    }
+}
+
+void myapp::ClipRecorder::release(int64_t timestamp_us)
+{
+    taskENTER_CRITICAL(&this->lock);
+    if (this->holds > 0)
+    {
+        this->holds--;
+    }
+    if (this->holds == 0)
+    {
+        this->stop_at_us = timestamp_us + POST_EVENT_US;
+    }
+    taskEXIT_CRITICAL(&this->lock);
+}
+
+myapp::clip_stats_t myapp::ClipRecorder::get_stats() const
+{
+    taskENTER_CRITICAL(&this->lock);
+    clip_stats_t stats = this->stats;
+    taskEXIT_CRITICAL(&this->lock);
+    return stats;
+}
+
+void myapp::ClipRecorder::writer_task(void *pvParameters)
+{
+    auto recorder = static_cast<ClipRecorder *>(pvParameters);
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (recorder->write_next())
+        {
+        }
+    }
+}
+
+bool myapp::ClipRecorder::write_next()
+{
+    // Returns false once there is nothing left to do until the next frame.
+    taskENTER_CRITICAL(&this->lock);
+    if (this->state == CLIP_STOPPING && this->next_seq >= this->end_seq)
+    {
+        this->state = CLIP_CLOSING;
+        taskEXIT_CRITICAL(&this->lock);
+
+        this->close_clip();
+
+        // A visit still going on, e.g. a clip cut at CLIP_MAX_SECONDS,
+        // carries on in a new clip.
+        taskENTER_CRITICAL(&this->lock);
+        this->state = this->restart || this->holds > 0 ? CLIP_RECORDING : CLIP_IDLE;
+        this->clip_start_us = this->last_us;
+        this->restart = false;
+        taskEXIT_CRITICAL(&this->lock);
+        return true;
+    }
+    if (this->state == CLIP_IDLE || this->state == CLIP_CLOSING || this->next_seq == this->head)
+    {
+        taskEXIT_CRITICAL(&this->lock);
+        return false;
+    }
+    entry_t frame = this->entry(this->next_seq);
+    this->busy_seq = this->next_seq;
+    char label[sizeof(this->label)];
+    strlcpy(label, this->label, sizeof(label));
+    taskEXIT_CRITICAL(&this->lock);
+
+    bool ok = (this->file || this->open_clip(frame, label)) && this->write_frame(frame);
+
+    taskENTER_CRITICAL(&this->lock);
+    this->busy_seq = NO_SEQ;
+    this->next_seq++;
+    if (ok)
+    {
+        this->stats.clip_frames++;
+        this->stats.bytes_written += frame.len;
+        if (this->frame_count >= MAX_CLIP_FRAMES && this->state == CLIP_RECORDING)
+        {
+            this->state = CLIP_STOPPING;
+            this->end_seq = this->next_seq;
+        }
+    }
+    else
+    {
+        this->stats.write_errors++;
+        this->state = CLIP_CLOSING;
+    }
+    taskEXIT_CRITICAL(&this->lock);
+
+    if (!ok)
+    {
+        // Storage trouble (card pulled, disk full): give up on this visit
+        // instead of retrying every frame.
+        this->close_clip();
+        taskENTER_CRITICAL(&this->lock);
+        this->state = CLIP_IDLE;
+        this->restart = false;
+        taskEXIT_CRITICAL(&this->lock);
+    }
+    return ok;
+}
+
+void myapp::ClipRecorder::make_room()
+{
+    // Drop the oldest clips until CONFIG_CLIP_MIN_FREE_KB are free again.
+    uint64_t total, free;
+    while (esp_vfs_fat_info(MOUNT_POINT, &total, &free) == ESP_OK && free < CONFIG_CLIP_MIN_FREE_KB * 1024ULL)
+    {
+        DIR *dir = opendir(MOUNT_POINT);
+        if (!dir)
+        {
+            return;
+        }
+        uint32_t oldest = UINT32_MAX;
+        uint32_t number;
+        while (struct dirent *file = readdir(dir))
+        {
+            if (parse_clip_name(file->d_name, number))
+            {
+                oldest = std::min(oldest, number);
+            }
+        }
+        closedir(dir);
+
+        char path[32];
+        snprintf(path, sizeof(path), "%s/V%07lu.AVI", MOUNT_POINT, oldest);
+        if (oldest == UINT32_MAX || unlink(path) != 0)
+        {
+            return;
+        }
+        ESP_LOGI(TAG, "Deleted %s to make room", path);
+    }
+}
+
+bool myapp::ClipRecorder::open_clip(const entry_t &first, const char *label)
+{
+    this->make_room();
+    char path[32];
+    snprintf(path, sizeof(path), "%s/V%07lu.AVI", MOUNT_POINT, ++this->clip_number);
+    this->file = fopen(path, "wb");
+    if (!this->file)
+    {
+        ESP_LOGE(TAG, "Failed to create %s", path);
+        return false;
+    }
+    setvbuf(this->file, nullptr, _IOFBF, 16 * 1024);
+
+    avi_header_t placeholder{};
+    this->frame_count = 0;
+    this->movi_bytes = 4; // idx1 offsets count from the 'movi' fourcc
+    this->max_frame_len = 0;
+    this->width = first.width;
+    this->height = first.height;
+    this->first_us = first.timestamp_us;
+    this->last_us = first.timestamp_us;
+    ESP_LOGI(TAG, "Recording %s to %s", label, path);
+    return fwrite(&placeholder, sizeof(placeholder), 1, this->file) == 1;
+}
+
+bool myapp::ClipRecorder::write_frame(const entry_t &frame)
+{
+    const uint32_t chunk[2] = {fourcc("00dc"), frame.len};
+    uint32_t padded = (frame.len + 1) & ~1u;
+    if (fwrite(chunk, sizeof(chunk), 1, this->file) != 1 ||
+        fwrite(this->data + frame.offset, frame.len, 1, this->file) != 1 ||
+        (padded != frame.len && fputc(0, this->file) == EOF))
+    {
+        ESP_LOGE(TAG, "Failed to write frame");
+        return false;
+    }
+    this->index[this->frame_count++] = {
+        .chunk_id = fourcc("00dc"),
+        .flags = AVIIF_KEYFRAME,
+        .offset = this->movi_bytes,
+        .size = frame.len,
+    };
+    this->movi_bytes += sizeof(chunk) + padded;
+    this->max_frame_len = std::max(this->max_frame_len, frame.len);
+    this->last_us = frame.timestamp_us;
+    return true;
+}
+
+void myapp::ClipRecorder::close_clip()
+{
+    if (!this->file)
+    {
+        return;
+    }
+    const uint32_t idx1[2] = {fourcc("idx1"), this->frame_count * (uint32_t)sizeof(avi_index_t)};
+    fwrite(idx1, sizeof(idx1), 1, this->file);
+    fwrite(this->index, sizeof(avi_index_t), this->frame_count, this->file);
+
+    // The frame rate is what was actually recorded, not CONFIG_CLIP_FPS.
+    uint32_t us_per_frame = this->frame_count > 1 ? (this->last_us - this->first_us) / (this->frame_count - 1)
+                                                  : FRAME_INTERVAL_US;
+    us_per_frame = std::max(us_per_frame, 1u);
+    avi_header_t header = {
+        .riff = fourcc("RIFF"),
+        .riff_size = 220 + this->movi_bytes + idx1[1],
+        .avi = fourcc("AVI "),
+        .hdrl_list = fourcc("LIST"),
+        .hdrl_size = 192,
+        .hdrl = fourcc("hdrl"),
+        .avih = fourcc("avih"),
+        .avih_size = 56,
+        .us_per_frame = us_per_frame,
+        .max_bytes_per_sec = (uint32_t)((uint64_t)this->max_frame_len * 1000000 / us_per_frame),
+        .padding_granularity = 0,
+        .flags = AVIF_HASINDEX,
+        .total_frames = this->frame_count,
+        .initial_frames = 0,
+        .streams = 1,
+        .suggested_buffer_size = this->max_frame_len,
+        .width = this->width,
+        .height = this->height,
+        .reserved = {},
+        .strl_list = fourcc("LIST"),
+        .strl_size = 116,
+        .strl = fourcc("strl"),
+        .strh = fourcc("strh"),
+        .strh_size = 56,
+        .fcc_type = fourcc("vids"),
+        .fcc_handler = fourcc("MJPG"),
+        .stream_flags = 0,
+        .priority = 0,
+        .language = 0,
+        .stream_initial_frames = 0,
+        .scale = us_per_frame,
+        .rate = 1000000,
+        .start = 0,
+        .length = this->frame_count,
+        .stream_suggested_buffer_size = this->max_frame_len,
+        .quality = UINT32_MAX,
+        .sample_size = 0,
+        .frame = {0, 0, (int16_t)this->width, (int16_t)this->height},
+        .strf = fourcc("strf"),
+        .strf_size = 40,
+        .bi_size = 40,
+        .bi_width = this->width,
+        .bi_height = this->height,
+        .bi_planes = 1,
+        .bi_bit_count = 24,
+        .bi_compression = fourcc("MJPG"),
+        .bi_size_image = (uint32_t)this->width * this->height * 3,
+        .bi_x_ppm = 0,
+        .bi_y_ppm = 0,
+        .bi_clr_used = 0,
+        .bi_clr_important = 0,
+        .movi_list = fourcc("LIST"),
+        .movi_size = this->movi_bytes,
+        .movi = fourcc("movi"),
+    };
+    fseek(this->file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, this->file);
+    bool ok = !ferror(this->file);
+    ok = fclose(this->file) == 0 && ok;
+    this->file = nullptr;
+
+    if (!ok)
+    {
+        ESP_LOGE(TAG, "Failed to finish clip %lu", this->clip_number);
+        return;
+    }
+    taskENTER_CRITICAL(&this->lock);
+    this->stats.clips++;
+    taskEXIT_CRITICAL(&this->lock);
+    ESP_LOGI(TAG, "Clip %lu: %lu frames over %lld ms, %lu KB", this->clip_number, this->frame_count,
+             (this->last_us - this->first_us) / 1000, (220 + this->movi_bytes + idx1[1]) / 1024);
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "esp_err.h"
+#include "frame_hub.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "task_config.hpp"
+#include <stdio.h>
+
+namespace myapp
+{
+    typedef struct
+    {
+        uint32_t buffered{0};     // frames copied into the pre-event ring
+        uint32_t overrun{0};      // frames lost because the writer fell behind
+        uint32_t clips{0};        // clips completed
+        uint32_t clip_frames{0};  // frames written into clips
+        uint32_t write_errors{0}; // clips abandoned because the storage failed
+        uint64_t bytes_written{0};
+    } clip_stats_t;
+
+    // Records litter box visits as MJPEG AVI clips.
+    //
+    // The FrameHub sink copies up to CONFIG_CLIP_FPS frames a second, as they
+    // come from the camera, into a PSRAM byte ring that always holds the last
+    // CONFIG_CLIP_PRE_EVENT_MS of video. trigger() starts a clip at the
+    // oldest frame inside that window; a writer task then moves the ring
+    // into the file behind the sink until CONFIG_CLIP_POST_EVENT_MS after the
+    // last release(). The sink never waits for the writer: if the writer
+    // falls behind, the frames it did not reach yet are overwritten and
+    // counted as overrun.
+    class ClipRecorder
+    {
+    public:
+        ClipRecorder() = default;
+        ~ClipRecorder();
+        ClipRecorder(const ClipRecorder &) = delete;
+        ClipRecorder &operator=(const ClipRecorder &) = delete;
+
+        // Allocates the ring and mounts the clip storage.
+        esp_err_t init();
+        esp_err_t start(const task_config_t &task);
+
+        static void sink(SharedFrame *frame, void *ctx);
+
+        // A visit started at timestamp_us (frame clock). Starts a clip, or
+        // keeps the running one going; calls nest with release().
+        void trigger(const char *label, int64_t timestamp_us);
+        // A visit ended at timestamp_us; the clip ends CONFIG_CLIP_POST_EVENT_MS
+        // later unless another trigger() comes first.
+        void release(int64_t timestamp_us);
+
+        clip_stats_t get_stats() const;
+
+    private:
+        static constexpr const char *TAG{"clip_recorder"};
+        static constexpr const char *MOUNT_POINT{"/clips"};
+        static constexpr int MAX_ENTRIES = 256;
+        static constexpr uint32_t NO_SEQ = UINT32_MAX;
+        static constexpr int64_t FRAME_INTERVAL_US = 1000000 / CONFIG_CLIP_FPS;
+        static constexpr int64_t PRE_EVENT_US = CONFIG_CLIP_PRE_EVENT_MS * 1000LL;
+        static constexpr int64_t POST_EVENT_US = CONFIG_CLIP_POST_EVENT_MS * 1000LL;
+        static constexpr int64_t MAX_CLIP_US = CONFIG_CLIP_MAX_SECONDS * 1000000LL;
+        static constexpr uint32_t MAX_CLIP_FRAMES =
+            (CONFIG_CLIP_PRE_EVENT_MS / 1000 + CONFIG_CLIP_MAX_SECONDS + 1) * CONFIG_CLIP_FPS;
+
+        typedef enum
+        {
+            CLIP_IDLE,
+            CLIP_RECORDING,
+            CLIP_STOPPING, // no new frames, the writer drains up to end_seq
+            CLIP_CLOSING,  // the writer finalizes the file
+        } clip_state_t;
+
+        typedef struct
+        {
+            uint32_t offset;
+            uint32_t len;
+            int64_t timestamp_us;
+            uint16_t width;
+            uint16_t height;
+        } entry_t;
+
+        typedef struct
+        {
+            uint32_t chunk_id;
+            uint32_t flags;
+            uint32_t offset;
+            uint32_t size;
+        } avi_index_t;
+
+        // Ring: entries [tail, head) live in data, oldest first. Everything
+        // here is guarded by lock.
+        uint8_t *data{nullptr};
+        size_t capacity{0};
+        size_t write_pos{0};
+        entry_t entries[MAX_ENTRIES]{};
+        uint32_t head{0};
+        uint32_t tail{0};
+        int64_t last_buffered_us{0};
+        mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+        clip_state_t state{CLIP_IDLE};
+        int holds{0};
+        int64_t stop_at_us{0};
+        int64_t clip_start_us{0};
+        uint32_t next_seq{0}; // next entry the writer takes
+        uint32_t busy_seq{NO_SEQ}; // entry the writer is reading, never evicted
+        uint32_t end_seq{0};
+        bool restart{false};
+        char label[16]{};
+        clip_stats_t stats{};
+
+        // Writer side, only touched by the writer task.
+        TaskHandle_t task_handle{nullptr};
+        FILE *file{nullptr};
+        avi_index_t *index{nullptr};
+        uint32_t frame_count{0};
+        uint32_t movi_bytes{0};
+        uint32_t max_frame_len{0};
+        uint16_t width{0};
+        uint16_t height{0};
+        int64_t first_us{0};
+        int64_t last_us{0};
+        uint32_t clip_number{0};
+
+        esp_err_t mount();
+        void buffer(const camera_fb_t *fb);
+        entry_t &entry(uint32_t seq) { return this->entries[seq % MAX_ENTRIES]; }
+        uint32_t first_seq_after(int64_t timestamp_us) const;
+
+        static void writer_task(void *pvParameters);
+        bool write_next();
+        bool open_clip(const entry_t &first, const char *label);
+        bool write_frame(const entry_t &frame);
+        void close_clip();
+        void make_room();
+    };
+} // namespace myapp
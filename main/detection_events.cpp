@@ -0,0 +1,149 @@
+#include "detection_events.hpp"
+#include "esp_log.h"
+#include <algorithm>
+
+myapp::DetectionEvents::DetectionEvents(const char *const *class_names, int class_count)
+    : class_names(class_names), class_count(std::min(class_count, MAX_CLASSES))
+{
+    this->subscribers_lock = xSemaphoreCreateMutex();
+    this->queue = xQueueCreate(CONFIG_DETECTION_EVENTS_QUEUE_DEPTH, sizeof(detection_event_t));
+}
+
+myapp::DetectionEvents::~DetectionEvents()
+{
+    if (this->task_handle)
+    {
+        vTaskDelete(this->task_handle);
+    }
+    vQueueDelete(this->queue);
+    vSemaphoreDelete(this->subscribers_lock);
+}
+
+esp_err_t myapp::DetectionEvents::start(const task_config_t &task)
+{
+    if (xTaskCreatePinnedToCore(dispatch_task, task.name, task.stack, this, task.priority, &this->task_handle, task.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create event dispatch task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+int myapp::DetectionEvents::subscribe(detection_subscriber_t subscriber, void *ctx)
+{
+    int id = -1;
+    xSemaphoreTake(this->subscribers_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++)
+    {
+        if (!this->subscribers[i].subscriber)
+        {
+            this->subscribers[i] = {.subscriber = subscriber, .ctx = ctx};
+            id = i;
+            break;
+        }
+    }
+    xSemaphoreGive(this->subscribers_lock);
+    return id;
+}
+
+void myapp::DetectionEvents::unsubscribe(int id)
+{
+    if (id < 0 || id >= MAX_SUBSCRIBERS)
+    {
+        return;
+    }
+    xSemaphoreTake(this->subscribers_lock, portMAX_DELAY);
+    this->subscribers[id] = {};
+    xSemaphoreGive(this->subscribers_lock);
+}
+
+void myapp::DetectionEvents::update(const float *scores, int64_t timestamp_us)
+{
+    this->stats.frames++;
+    this->head = (this->head + 1) % WINDOW;
+    this->frame_us[this->head] = timestamp_us;
+    const uint32_t mask = (uint32_t)((1ull << WINDOW) - 1);
+
+    for (int id = 0; id < this->class_count; id++)
+    {
+        class_state_t &state = this->classes[id];
+        float score = scores[id];
+        bool seen = score >= (state.present ? EXIT_SCORE : ENTER_SCORE);
+        state.history = ((state.history << 1) | seen) & mask;
+        if (seen)
+        {
+            state.last_seen_us = timestamp_us;
+            state.peak_score = std::max(state.peak_score, score);
+        }
+
+        int count = __builtin_popcount(state.history);
+        if (!state.present && count >= CONFIG_DETECTION_EVENTS_CONFIRM)
+        {
+            // Date the visit from the oldest sighting in the window rather
+            // than the frame that confirmed it.
+            int oldest = 31 - __builtin_clz(state.history);
+            state.present = true;
+            state.enter_us = this->frame_us[(this->head - oldest + WINDOW) % WINDOW];
+            this->publish({
+                .type = DETECTION_ENTER,
+                .class_id = (uint8_t)id,
+                .class_name = this->class_names[id],
+                .timestamp_us = state.enter_us,
+                .duration_ms = 0,
+                .peak_score = state.peak_score,
+            });
+        }
+        else if (state.present && count <= CONFIG_DETECTION_EVENTS_RELEASE)
+        {
+            state.present = false;
+            this->publish({
+                .type = DETECTION_EXIT,
+                .class_id = (uint8_t)id,
+                .class_name = this->class_names[id],
+                .timestamp_us = state.last_seen_us,
+                .duration_ms = (uint32_t)((state.last_seen_us - state.enter_us) / 1000),
+                .peak_score = state.peak_score,
+            });
+            state.peak_score = 0;
+        }
+        else if (!state.present && state.history == 0)
+        {
+            // Sightings that never confirmed don't count towards the next visit.
+            state.peak_score = 0;
+        }
+    }
+}
+
+void myapp::DetectionEvents::publish(const detection_event_t &event)
+{
+    if (xQueueSend(this->queue, &event, 0) == pdTRUE)
+    {
+        this->stats.events++;
+    }
+    else
+    {
+        this->stats.dropped++;
+    }
+}
+
+void myapp::DetectionEvents::dispatch_task(void *pvParameters)
+{
+    auto self = static_cast<myapp::DetectionEvents *>(pvParameters);
+    detection_event_t event;
+    while (1)
+    {
+        if (xQueueReceive(self->queue, &event, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+        xSemaphoreTake(self->subscribers_lock, portMAX_DELAY);
+        for (const auto &entry : self->subscribers)
+        {
+            if (entry.subscriber)
+            {
+                entry.subscriber(event, entry.ctx);
+            }
+        }
+        xSemaphoreGive(self->subscribers_lock);
+    }
+}
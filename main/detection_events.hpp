@@ -0,0 +1,109 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "task_config.hpp"
+
+namespace myapp
+{
+    typedef enum
+    {
+        DETECTION_ENTER,
+        DETECTION_EXIT,
+    } detection_event_type_t;
+
+    typedef struct
+    {
+        detection_event_type_t type;
+        uint8_t class_id;
+        const char *class_name;
+        int64_t timestamp_us; // enter: first frame of the confirming window, exit: last frame the class was seen
+        uint32_t duration_ms; // exit only: time between the enter and exit timestamps
+        float peak_score;     // highest score seen during the visit
+    } detection_event_t;
+
+    // Called from the dispatcher task, never from the inference task. A slow
+    // subscriber delays the others but not inference.
+    typedef void (*detection_subscriber_t)(const detection_event_t &event, void *ctx);
+
+    typedef struct
+    {
+        uint32_t frames{0};  // update() calls
+        uint32_t events{0};  // events queued for dispatch
+        uint32_t dropped{0}; // events lost because the queue was full
+    } detection_events_stats_t;
+
+    // Turns per-frame class scores into debounced enter/exit events.
+    //
+    // A class enters once it was seen in CONFIG_DETECTION_EVENTS_CONFIRM of
+    // the last CONFIG_DETECTION_EVENTS_WINDOW frames and exits once it was
+    // seen in at most CONFIG_DETECTION_EVENTS_RELEASE of them. "Seen" uses
+    // the enter score threshold while the class is absent and the lower exit
+    // threshold while it is present, so a score hovering around one threshold
+    // does not flap.
+    class DetectionEvents
+    {
+    public:
+        static constexpr int MAX_CLASSES = 4;
+        static constexpr int MAX_SUBSCRIBERS = 4;
+
+        DetectionEvents(const char *const *class_names, int class_count);
+        ~DetectionEvents();
+        DetectionEvents(const DetectionEvents &) = delete;
+        DetectionEvents &operator=(const DetectionEvents &) = delete;
+
+        esp_err_t start(const task_config_t &task);
+
+        // Returns a subscription id, or -1 if all slots are in use.
+        int subscribe(detection_subscriber_t subscriber, void *ctx);
+        void unsubscribe(int id);
+
+        // Feeds one inferred frame; scores[i] in 0..1 is the best score of
+        // class i in that frame. Never blocks: events go through a queue.
+        void update(const float *scores, int64_t timestamp_us);
+
+        bool present(int class_id) const { return this->classes[class_id].present; }
+        detection_events_stats_t get_stats() const { return this->stats; }
+
+    private:
+        static constexpr const char *TAG{"detection_events"};
+        static constexpr int WINDOW = CONFIG_DETECTION_EVENTS_WINDOW;
+        static constexpr float ENTER_SCORE = CONFIG_DETECTION_EVENTS_ENTER_SCORE / 100.0f;
+        static constexpr float EXIT_SCORE = CONFIG_DETECTION_EVENTS_EXIT_SCORE / 100.0f;
+        static_assert(CONFIG_DETECTION_EVENTS_CONFIRM <= WINDOW, "confirm count larger than the window");
+        static_assert(CONFIG_DETECTION_EVENTS_RELEASE < CONFIG_DETECTION_EVENTS_CONFIRM,
+                      "release count must be below the confirm count");
+
+        typedef struct
+        {
+            uint32_t history; // bit i set: seen i frames ago
+            bool present;
+            int64_t enter_us;
+            int64_t last_seen_us;
+            float peak_score;
+        } class_state_t;
+
+        typedef struct
+        {
+            detection_subscriber_t subscriber;
+            void *ctx;
+        } subscriber_entry_t;
+
+        const char *const *class_names;
+        int class_count;
+        class_state_t classes[MAX_CLASSES]{};
+        int64_t frame_us[WINDOW]{}; // timestamps of the last WINDOW frames, ring indexed by head
+        int head{0};
+        subscriber_entry_t subscribers[MAX_SUBSCRIBERS]{};
+        SemaphoreHandle_t subscribers_lock{nullptr};
+        QueueHandle_t queue{nullptr};
+        TaskHandle_t task_handle{nullptr};
+        detection_events_stats_t stats{};
+
+        static void dispatch_task(void *pvParameters);
+        void publish(const detection_event_t &event);
+    };
+} // namespace myapp
@@ -0,0 +1,416 @@
+#include "detection_log.hpp"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include <algorithm>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+myapp::DetectionLog::~DetectionLog()
+{
+    if (this->flash_lock)
+    {
+        vSemaphoreDelete(this->flash_lock);
+    }
+}
+
+esp_err_t myapp::DetectionLog::init()
+{
+    this->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "detlog");
+    if (!this->partition)
+    {
+        ESP_LOGE(TAG, "No 'detlog' partition in the partition table");
+        return ESP_ERR_NOT_FOUND;
+    }
+    this->sector_count = this->partition->size / SECTOR_SIZE;
+    if (this->sector_count < 2)
+    {
+        ESP_LOGE(TAG, "The 'detlog' partition needs at least two sectors");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    this->flash_lock = xSemaphoreCreateMutex();
+    if (!this->flash_lock)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    return this->recover();
+}
+
+esp_err_t myapp::DetectionLog::recover()
+{
+    sector_header_t header;
+    sector_header_t head{};
+    bool found = false;
+    for (uint32_t sector = 0; sector < this->sector_count; sector++)
+    {
+        esp_err_t err = esp_partition_read(this->partition, this->sector_offset(sector), &header, sizeof(header));
+        if (err != ESP_OK)
+        {
+            // Unreadable sectors count as empty; the writer erases them when it gets there.
+            ESP_LOGW(TAG, "Failed to read sector %lu header: 0x%x", sector, err);
+            continue;
+        }
+        // Sectors are visited in index order, so >= keeps the highest (lap, index).
+        if (header.magic == MAGIC && (!found || header.lap >= head.lap))
+        {
+            head = header;
+            this->head_sector = sector;
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        ESP_LOGI(TAG, "Starting a new log over %lu sectors", this->sector_count);
+        return this->open_sector(0, 0, 0);
+    }
+
+    // Resume after the last record of the head sector. A record torn by a
+    // reset still occupies its slot but fails the CRC and is never served.
+    uint32_t next_seq = head.first_seq;
+    this->head_lap = head.lap;
+    this->write_slot = 1;
+    detection_record_t record;
+    while (this->write_slot <= RECORDS_PER_SECTOR)
+    {
+        esp_err_t err = esp_partition_read(this->partition,
+                                           this->sector_offset(this->head_sector) + this->write_slot * sizeof(record),
+                                           &record, sizeof(record));
+        // An unreadable slot is skipped like a torn one rather than written over.
+        if (err == ESP_OK && record.seq == NO_SEQ)
+        {
+            break;
+        }
+        if (err == ESP_OK && record.crc == checksum(record))
+        {
+            next_seq = record.seq + 1;
+        }
+        this->write_slot++;
+    }
+
+    // Once the log has wrapped, the oldest records are in the sector after the head.
+    uint32_t next = (this->head_sector + 1) % this->sector_count;
+    esp_err_t err = esp_partition_read(this->partition, this->sector_offset(next), &header, sizeof(header));
+    this->oldest_sector = err == ESP_OK && header.magic == MAGIC ? next : 0;
+    err = esp_partition_read(this->partition, this->sector_offset(this->oldest_sector), &header, sizeof(header));
+    if (err != ESP_OK || header.magic != MAGIC)
+    {
+        // Only the head sector is known to hold records.
+        this->oldest_sector = this->head_sector;
+        header = head;
+    }
+
+    this->stats.first_seq = header.first_seq;
+    this->stats.next_seq = next_seq;
+    this->stats.laps = this->head_lap;
+    ESP_LOGI(TAG, "Recovered records %lu..%lu, head sector %lu slot %lu, lap %lu", this->stats.first_seq,
+             next_seq, this->head_sector, this->write_slot, this->head_lap);
+    return ESP_OK;
+}
+
+esp_err_t myapp::DetectionLog::open_sector(uint32_t sector, uint32_t lap, uint32_t first_seq)
+{
+    esp_err_t err = esp_partition_erase_range(this->partition, this->sector_offset(sector), SECTOR_SIZE);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to erase sector %lu: 0x%x", sector, err);
+        return err;
+    }
+    sector_header_t header = {
+        .magic = MAGIC,
+        .lap = lap,
+        .first_seq = first_seq,
+        .reserved = {},
+    };
+    err = esp_partition_write(this->partition, this->sector_offset(sector), &header, sizeof(header));
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to write sector %lu header: 0x%x", sector, err);
+        return err;
+    }
+    this->head_sector = sector;
+    this->head_lap = lap;
+    this->write_slot = 1;
+
+    // Erasing this sector dropped the oldest records once the log wrapped.
+    uint32_t oldest = lap > 0 ? (sector + 1) % this->sector_count : 0;
+    if (esp_partition_read(this->partition, this->sector_offset(oldest), &header, sizeof(header)) != ESP_OK ||
+        header.magic != MAGIC)
+    {
+        oldest = sector;
+        header.first_seq = first_seq;
+    }
+    this->oldest_sector = oldest;
+
+    taskENTER_CRITICAL(&this->lock);
+    this->stats.erases++;
+    this->stats.laps = lap;
+    this->stats.first_seq = header.first_seq;
+    taskEXIT_CRITICAL(&this->lock);
+    return ESP_OK;
+}
+
+esp_err_t myapp::DetectionLog::start(const task_config_t &task)
+{
+    if (xTaskCreatePinnedToCore(flush_task, task.name, task.stack, this, task.priority, &this->task_handle, task.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create flush task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+uint16_t myapp::DetectionLog::checksum(const detection_record_t &record)
+{
+    return esp_rom_crc16_le(0, (const uint8_t *)&record, offsetof(detection_record_t, crc));
+}
+
+bool myapp::DetectionLog::append(detection_record_t &record)
+{
+    time_t now = time(nullptr);
+    // Anything before 2020 means SNTP has not set the clock yet.
+    bool time_valid = now > 1577836800;
+    record.time = time_valid ? now : 0;
+    record.flags = time_valid ? DETECTION_RECORD_TIME_VALID : 0;
+    record.uptime_ms = esp_timer_get_time() / 1000;
+    record.reserved = 0;
+
+    taskENTER_CRITICAL(&this->lock);
+    if (this->pending_count == PENDING_MAX)
+    {
+        this->stats.dropped++;
+        taskEXIT_CRITICAL(&this->lock);
+        return false;
+    }
+    record.seq = this->stats.next_seq++;
+    record.crc = checksum(record);
+    this->pending[this->pending_count++] = record;
+    this->stats.appended++;
+    bool wake = this->pending_count >= BATCH;
+    taskEXIT_CRITICAL(&this->lock);
+
+    if (wake && this->task_handle)
+    {
+        xTaskNotifyGive(this->task_handle);
+    }
+    return true;
+}
+
+myapp::detection_log_stats_t myapp::DetectionLog::get_stats() const
+{
+    taskENTER_CRITICAL(&this->lock);
+    detection_log_stats_t stats = this->stats;
+    taskEXIT_CRITICAL(&this->lock);
+    return stats;
+}
+
+void myapp::DetectionLog::flush_task(void *pvParameters)
+{
+    auto log = static_cast<DetectionLog *>(pvParameters);
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_DETECTION_LOG_FLUSH_S * 1000));
+        log->flush();
+    }
+}
+
+void myapp::DetectionLog::flush()
+{
+    taskENTER_CRITICAL(&this->lock);
+    int count = this->pending_count;
+    memcpy(this->flushing, this->pending, count * sizeof(detection_record_t));
+    this->pending_count = 0;
+    taskEXIT_CRITICAL(&this->lock);
+    if (count == 0)
+    {
+        return;
+    }
+
+    xSemaphoreTake(this->flash_lock, portMAX_DELAY);
+    esp_err_t err = this->write_records(this->flushing, count);
+    xSemaphoreGive(this->flash_lock);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Lost %d records: 0x%x", count, err);
+        return;
+    }
+    taskENTER_CRITICAL(&this->lock);
+    this->stats.flushes++;
+    taskEXIT_CRITICAL(&this->lock);
+}
+
+esp_err_t myapp::DetectionLog::write_records(const detection_record_t *records, int count)
+{
+    int written = 0;
+    while (written < count)
+    {
+        if (this->write_slot > RECORDS_PER_SECTOR)
+        {
+            uint32_t next = (this->head_sector + 1) % this->sector_count;
+            esp_err_t err = this->open_sector(next, next == 0 ? this->head_lap + 1 : this->head_lap, records[written].seq);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+        int n = std::min<int>(count - written, RECORDS_PER_SECTOR + 1 - this->write_slot);
+        esp_err_t err = esp_partition_write(this->partition,
+                                            this->sector_offset(this->head_sector) + this->write_slot * sizeof(detection_record_t),
+                                            &records[written], n * sizeof(detection_record_t));
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        this->write_slot += n;
+        written += n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t myapp::DetectionLog::handle_history(httpd_req_t *req)
+{
+    // Raw detection_record_t array, oldest first, flash then the records
+    // still waiting in RAM. A sector the flush task erases while it is being
+    // read is skipped by the seq check.
+    uint32_t from = 0, to = NO_SEQ, since = 0, until = UINT32_MAX, limit = UINT32_MAX;
+    char query[96];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        char value[12];
+        if (httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK)
+        {
+            from = strtoul(value, nullptr, 10);
+        }
+        if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK)
+        {
+            to = strtoul(value, nullptr, 10);
+        }
+        if (httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK)
+        {
+            since = strtoul(value, nullptr, 10);
+        }
+        if (httpd_query_key_value(query, "until", value, sizeof(value)) == ESP_OK)
+        {
+            until = strtoul(value, nullptr, 10);
+        }
+        if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK)
+        {
+            limit = strtoul(value, nullptr, 10);
+        }
+    }
+    bool time_filter = since > 0 || until < UINT32_MAX;
+    auto wanted = [&](const detection_record_t &record)
+    {
+        if (record.seq < from || record.seq > to || record.crc != checksum(record))
+        {
+            return false;
+        }
+        return !time_filter ||
+               ((record.flags & DETECTION_RECORD_TIME_VALID) && record.time >= since && record.time <= until);
+    };
+
+    detection_log_stats_t stats = this->get_stats();
+    char first_seq[12], next_seq[12], laps[12];
+    snprintf(first_seq, sizeof(first_seq), "%lu", stats.first_seq);
+    snprintf(next_seq, sizeof(next_seq), "%lu", stats.next_seq);
+    snprintf(laps, sizeof(laps), "%lu", stats.laps);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "X-Log-First-Seq", first_seq);
+    httpd_resp_set_hdr(req, "X-Log-Next-Seq", next_seq);
+    httpd_resp_set_hdr(req, "X-Log-Laps", laps);
+
+    xSemaphoreTake(this->flash_lock, portMAX_DELAY);
+    uint32_t sector = this->oldest_sector;
+    uint32_t head_sector = this->head_sector;
+    uint32_t span = (head_sector + this->sector_count - this->oldest_sector) % this->sector_count + 1;
+    xSemaphoreGive(this->flash_lock);
+
+    static constexpr int CHUNK = 16;
+    detection_record_t chunk[CHUNK];
+    detection_record_t out[CHUNK];
+    uint32_t sent = 0;
+    uint32_t last_seq = 0;
+    bool done = false;
+    for (uint32_t i = 0; i < span && !done; i++, sector = (sector + 1) % this->sector_count)
+    {
+        sector_header_t header;
+        xSemaphoreTake(this->flash_lock, portMAX_DELAY);
+        esp_err_t err = esp_partition_read(this->partition, this->sector_offset(sector), &header, sizeof(header));
+        xSemaphoreGive(this->flash_lock);
+        if (err != ESP_OK || header.magic != MAGIC || header.first_seq + RECORDS_PER_SECTOR <= from)
+        {
+            continue;
+        }
+        if (header.first_seq > to)
+        {
+            break;
+        }
+
+        for (uint32_t slot = 1; slot <= RECORDS_PER_SECTOR && !done; slot += CHUNK)
+        {
+            int n = std::min<uint32_t>(CHUNK, RECORDS_PER_SECTOR + 1 - slot);
+            xSemaphoreTake(this->flash_lock, portMAX_DELAY);
+            err = esp_partition_read(this->partition, this->sector_offset(sector) + slot * sizeof(detection_record_t),
+                                     chunk, n * sizeof(detection_record_t));
+            xSemaphoreGive(this->flash_lock);
+            if (err != ESP_OK)
+            {
+                ESP_LOGW(TAG, "Failed to read sector %lu: 0x%x", sector, err);
+                break;
+            }
+
+            int count = 0;
+            for (int j = 0; j < n; j++)
+            {
+                if (chunk[j].seq == NO_SEQ)
+                {
+                    // Rest of the sector is erased; it is the head.
+                    n = j;
+                    done = sector == head_sector;
+                    break;
+                }
+                if (wanted(chunk[j]) && (sent + count == 0 || chunk[j].seq > last_seq) && sent + count < limit)
+                {
+                    out[count++] = chunk[j];
+                    last_seq = chunk[j].seq;
+                }
+            }
+            if (count > 0 && httpd_resp_send_chunk(req, (const char *)out, count * sizeof(detection_record_t)) != ESP_OK)
+            {
+                return ESP_FAIL;
+            }
+            sent += count;
+            done = done || sent >= limit;
+        }
+    }
+
+    // Records not flushed yet. One the flush task moves to flash meanwhile is
+    // missed by this response, the next one has it.
+    for (int first = 0; sent < limit; first += CHUNK)
+    {
+        taskENTER_CRITICAL(&this->lock);
+        int n = std::max(std::min(this->pending_count - first, CHUNK), 0);
+        memcpy(chunk, this->pending + first, n * sizeof(detection_record_t));
+        taskEXIT_CRITICAL(&this->lock);
+        if (n == 0)
+        {
+            break;
+        }
+        int count = 0;
+        for (int j = 0; j < n && sent + count < limit; j++)
+        {
+            if (wanted(chunk[j]) && (sent + count == 0 || chunk[j].seq > last_seq))
+            {
+                out[count++] = chunk[j];
+                last_seq = chunk[j].seq;
+            }
+        }
+        if (count > 0 && httpd_resp_send_chunk(req, (const char *)out, count * sizeof(detection_record_t)) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+        sent += count;
+    }
+    return httpd_resp_send_chunk(req, nullptr, 0);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "task_config.hpp"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace myapp
+{
+    static constexpr uint8_t DETECTION_RECORD_TIME_VALID = 0x01; // time is wall clock, not 0
+
+    // Fixed 32 byte record, little endian as written by the CPU. /history
+    // serves an array of these, oldest first.
+    typedef struct
+    {
+        uint32_t seq;        // assigned by append(); 0xffffffff is erased flash
+        uint32_t time;       // unix seconds, 0 before the clock was set
+        uint32_t uptime_ms;  // since boot, orders records the clock missed
+        uint32_t latency_us; // frame in to detector result out
+        int16_t x1, y1, x2, y2; // frame pixels, all 0 for whole frame classifiers
+        uint8_t class_id;    // detector_class_t
+        uint8_t flags;
+        uint16_t score;      // per mille
+        uint16_t reserved;
+        uint16_t crc;        // CRC16 of everything above
+    } detection_record_t;
+    static_assert(sizeof(detection_record_t) == 32, "detection records are serialized as is");
+
+    typedef struct
+    {
+        uint32_t appended{0};
+        uint32_t dropped{0};  // RAM batch was full because flash writes fell behind
+        uint32_t flushes{0};
+        uint32_t erases{0};   // sectors erased since boot
+        uint32_t laps{0};     // times the log wrapped around the partition; every sector was erased this often
+        uint32_t first_seq{0};
+        uint32_t next_seq{0};
+    } detection_log_stats_t;
+
+    // Append-only log of detection records in the "detlog" data partition.
+    //
+    // The partition is a ring of 4 KB sectors. Each starts with a header
+    // carrying the lap it was written in, followed by records in seq order.
+    // append() only copies into a RAM batch. A background task writes the
+    // batch when CONFIG_DETECTION_LOG_BATCH_RECORDS are waiting, or every
+    // CONFIG_DETECTION_LOG_FLUSH_S seconds. Records go into already erased
+    // flash, so each sector is erased exactly once per lap and wear is even
+    // over the whole partition. At boot the sector with the highest
+    // (lap, index) is the head, and appending resumes after its last record.
+    class DetectionLog
+    {
+    public:
+        DetectionLog() = default;
+        ~DetectionLog();
+        DetectionLog(const DetectionLog &) = delete;
+        DetectionLog &operator=(const DetectionLog &) = delete;
+
+        // Finds the partition and recovers the head of the log.
+        esp_err_t init();
+        esp_err_t start(const task_config_t &task);
+
+        // Fills in seq, time, uptime_ms, flags and crc, and queues the
+        // record. Never touches flash. Returns false if it was dropped.
+        bool append(detection_record_t &record);
+
+        // httpd handler body for /history?from=&to=&since=&until=&limit=.
+        // from/to are inclusive seq bounds, since/until unix seconds.
+        esp_err_t handle_history(httpd_req_t *req);
+
+        detection_log_stats_t get_stats() const;
+
+    private:
+        static constexpr const char *TAG{"detection_log"};
+        static constexpr size_t SECTOR_SIZE = 4096;
+        static constexpr uint32_t RECORDS_PER_SECTOR = SECTOR_SIZE / sizeof(detection_record_t) - 1;
+        static constexpr uint32_t MAGIC = 0x474c5444; // "DTLG"
+        static constexpr int BATCH = CONFIG_DETECTION_LOG_BATCH_RECORDS;
+        static constexpr int PENDING_MAX = 2 * BATCH;
+        static constexpr uint32_t NO_SEQ = UINT32_MAX;
+
+        // Takes the first record slot of every sector.
+        typedef struct
+        {
+            uint32_t magic;
+            uint32_t lap;
+            uint32_t first_seq;
+            uint8_t reserved[20];
+        } sector_header_t;
+        static_assert(sizeof(sector_header_t) == sizeof(detection_record_t), "header fills one record slot");
+
+        const esp_partition_t *partition{nullptr};
+        uint32_t sector_count{0};
+        TaskHandle_t task_handle{nullptr};
+        // Serializes flash access between the flush task and /history readers.
+        SemaphoreHandle_t flash_lock{nullptr};
+
+        // Flash position, changed by the flush task under flash_lock.
+        uint32_t head_sector{0};
+        uint32_t head_lap{0};
+        uint32_t write_slot{0}; // next free record slot in head_sector, 1-based
+        uint32_t oldest_sector{0};
+
+        mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        detection_record_t pending[PENDING_MAX]{};
+        int pending_count{0};
+        detection_record_t flushing[PENDING_MAX]{}; // flush task only
+        detection_log_stats_t stats{};
+
+        esp_err_t recover();
+        esp_err_t open_sector(uint32_t sector, uint32_t lap, uint32_t first_seq);
+        static void flush_task(void *pvParameters);
+        void flush();
+        esp_err_t write_records(const detection_record_t *records, int count);
+        size_t sector_offset(uint32_t sector) const { return (size_t)sector * SECTOR_SIZE; }
+        static uint16_t checksum(const detection_record_t &record);
+    };
+} // namespace myapp
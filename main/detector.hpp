@@ -0,0 +1,86 @@
+#pragma once
+
+#include "esp_camera.h"
+#include "esp_err.h"
+#include "jpeg_decoder.hpp"
+#include "sdkconfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace myapp
+{
+    // Every backend reports into the same class set so events, metrics and
+    // logs do not depend on which one is running. Classes a backend cannot
+    // see stay at 0.
+    typedef enum
+    {
+        DETECTOR_CLASS_CAT,
+        DETECTOR_CLASS_NACHI,
+        DETECTOR_CLASS_NGAO,
+        DETECTOR_CLASS_COUNT,
+    } detector_class_t;
+
+    static constexpr const char *DETECTOR_CLASS_NAMES[DETECTOR_CLASS_COUNT] = {"cat", "nachi", "ngao"};
+
+    static constexpr int DETECTOR_MAX_BOXES = 10;
+
+    // Input slots a pipelined backend keeps, see Detector::prepare().
+    static constexpr int DETECTOR_INPUT_SLOTS = 2;
+
+    // One detector box, in frame pixels.
+    typedef struct
+    {
+        int16_t x1, y1, x2, y2;
+        float score;
+    } detector_box_t;
+
+    typedef struct
+    {
+        esp_err_t err{ESP_OK};
+        // Stages a backend does not have stay at 0 and are not recorded.
+        uint32_t decode_us{0};
+        uint32_t preprocess_us{0};
+        uint32_t invoke_us{0};
+        uint32_t classify_us{0};
+        uint32_t postprocess_us{0};
+        float scores[DETECTOR_CLASS_COUNT]{};
+        detector_box_t boxes[DETECTOR_MAX_BOXES]{};
+        int box_count{0};
+        const char *label{nullptr}; // classifier verdict, static storage; nullptr if none
+    } detector_result_t;
+
+    // A model that turns a camera frame into a detector_result_t. Backends
+    // are created through create_detector() and loaded before their first
+    // run(); run() and infer() are only ever called from the inference task,
+    // prepare() only from the pipeline's prepare task.
+    class Detector
+    {
+    public:
+        virtual ~Detector() = default;
+
+        virtual const char *name() const = 0;
+        virtual esp_err_t load() = 0;
+        virtual void run(const camera_fb_t *fb, detector_result_t &result) = 0;
+
+        // run() split in two for the pipelined mode: prepare() decodes and
+        // preprocesses the frame into input slot `slot`, infer() runs the
+        // model on that slot and fills in the rest of result. prepare() of
+        // one slot runs on the other core while infer() of the other slot
+        // runs here; the same slot is never used by both at once. Backends
+        // that cannot split leave pipelined() false and only get run().
+        virtual bool pipelined() const { return false; }
+        virtual void prepare(const camera_fb_t *fb, int slot, detector_result_t &result) {}
+        virtual void infer(int slot, detector_result_t &result) {}
+
+        // Restricts the backend to a region of the frame. Returns false if
+        // the backend always looks at the whole frame.
+        virtual bool set_roi(const jpeg_decoder::rect_t &roi) { return false; }
+    };
+
+    // Backends compiled into this firmware, in registration order.
+    size_t detector_count();
+    const char *detector_name(size_t index);
+
+    // Returns a new, not yet loaded backend, or nullptr for an unknown name.
+    Detector *create_detector(const char *name);
+} // namespace myapp
@@ -0,0 +1,385 @@
+#include "detector.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <algorithm>
+#include <new>
+#include <string.h>
+#ifdef CONFIG_DETECTION_USES_CAT_DETECT
+#include "cat_detect.hpp"
+#endif
+#ifdef CONFIG_DETECTION_USES_LITTER_ROBOT
+#include "litter_robot_detect.hpp"
+#endif
+
+namespace myapp
+{
+    static constexpr const char *TAG = "detector";
+
+#ifdef CONFIG_DETECTION_USES_CAT_DETECT
+    // ESPDet cat detector. The frame is decoded straight to the smallest DCT
+    // scale that still covers the model input; the detector letterboxes from
+    // there and does its own box decoding, so all of it counts as invoke.
+    // Each input slot has its own decoder, and so its own decoded image.
+    class EspDetDetector : public Detector
+    {
+    public:
+        EspDetDetector(const char *name, CatDetect::model_type_t model_type, uint16_t input_size)
+            : detector_name(name), model_type(model_type), input_size(input_size)
+        {
+        }
+
+        ~EspDetDetector() override { delete this->detect; }
+
+        const char *name() const override { return this->detector_name; }
+
+        esp_err_t load() override
+        {
+            // A decoder only allocates its output on the first decode, so an
+            // unused slot costs nothing.
+            for (auto &decoder : this->decoders)
+            {
+                if (decoder.configure(JPEG_PIXEL_FORMAT_RGB888, this->input_size, this->input_size, false) != JPEG_ERR_OK)
+                {
+                    ESP_LOGE(TAG, "Failed to configure JPEG decoder");
+                    return ESP_FAIL;
+                }
+            }
+            this->detect = new (std::nothrow) CatDetect(this->model_type, false);
+            return this->detect ? ESP_OK : ESP_ERR_NO_MEM;
+        }
+
+        void run(const camera_fb_t *fb, detector_result_t &result) override
+        {
+            this->prepare(fb, 0, result);
+            if (result.err == ESP_OK)
+            {
+                this->infer(0, result);
+            }
+        }
+
+        bool pipelined() const override { return true; }
+
+        void prepare(const camera_fb_t *fb, int slot, detector_result_t &result) override
+        {
+            jpeg_error_t decode_err = this->decoders[slot].decode(fb->buf, fb->len, this->decoded[slot]);
+            if (decode_err != JPEG_ERR_OK)
+            {
+                ESP_LOGE(TAG, "JPEG decode failed with error %d", decode_err);
+                result.err = ESP_FAIL;
+                return;
+            }
+            result.decode_us = this->decoded[slot].decode_us;
+        }
+
+        void infer(int slot, detector_result_t &result) override
+        {
+            const jpeg_decoder::decoded_image_t &decoded = this->decoded[slot];
+            dl::image::img_t img = {
+                .data = decoded.data,
+                .width = decoded.width,
+                .height = decoded.height,
+                .pix_type = dl::image::DL_IMAGE_PIX_TYPE_RGB888,
+            };
+
+            int64_t start_infer = esp_timer_get_time();
+            auto &detect_results = this->detect->run(img);
+            result.invoke_us = esp_timer_get_time() - start_infer;
+
+            // Boxes come back in decoded coordinates, report them in frame
+            // coordinates.
+            int scale = decoded.scale_denom;
+            for (const auto &res : detect_results)
+            {
+                result.scores[DETECTOR_CLASS_CAT] = std::max(result.scores[DETECTOR_CLASS_CAT], res.score);
+                if (result.box_count < DETECTOR_MAX_BOXES)
+                {
+                    result.boxes[result.box_count++] = {
+                        .x1 = (int16_t)(res.box[0] * scale),
+                        .y1 = (int16_t)(res.box[1] * scale),
+                        .x2 = (int16_t)(res.box[2] * scale),
+                        .y2 = (int16_t)(res.box[3] * scale),
+                        .score = res.score,
+                    };
+                }
+            }
+        }
+
+        // The image the last prepare() of slot decoded; valid until the next
+        // prepare() of that slot.
+        const jpeg_decoder::decoded_image_t &image(int slot) const { return this->decoded[slot]; }
+
+    private:
+        const char *detector_name;
+        CatDetect::model_type_t model_type;
+        uint16_t input_size;
+        CatDetect *detect{nullptr};
+        jpeg_decoder::JpegDecoder decoders[DETECTOR_INPUT_SLOTS];
+        jpeg_decoder::decoded_image_t decoded[DETECTOR_INPUT_SLOTS]{};
+    };
+#endif
+
+#ifdef CONFIG_DETECTION_USES_LITTER_ROBOT
+#ifdef CONFIG_LITTER_ROBOT_MODEL_ESP_PPQ
+    static constexpr const char *CLASSIFIER_NAME = "ppq";
+#else
+    static constexpr const char *CLASSIFIER_NAME = "tflite";
+#endif
+
+    static esp_err_t load_classifier(litter_robot_detect::CatDetect *&classifier)
+    {
+        classifier = new (std::nothrow) litter_robot_detect::CatDetect();
+        if (!classifier)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        esp_err_t err = classifier->setup(1024 * 1024);
+#ifdef LITTER_ROBOT_DETECT_TEST_STATIC_IMAGE
+        // Self test on the embedded image, once: the first load is the one
+        // at boot, later ones are /detector swaps on the inference task.
+        static bool tested = false;
+        if (err == ESP_OK && !tested)
+        {
+            tested = true;
+            classifier->test_model();
+        }
+#endif
+        return err;
+    }
+
+    // Copies the nachi/ngao verdict of the classifier into result.
+    static void apply_prediction(const litter_robot_detect::prediction_result_t &prediction, detector_result_t &result)
+    {
+        const uint8_t scores[] = {prediction.empty_score, prediction.nachi_score, prediction.ngao_score};
+        int best = std::max_element(scores, scores + 3) - scores;
+        result.scores[DETECTOR_CLASS_NACHI] = prediction.nachi_score / 255.0f;
+        result.scores[DETECTOR_CLASS_NGAO] = prediction.ngao_score / 255.0f;
+        result.label = litter_robot_detect::CLASS_NAMES[best].c_str();
+        result.preprocess_us = prediction.timings.preprocess_us;
+        result.postprocess_us = prediction.timings.postprocess_us;
+    }
+
+    // The litter_robot_detect classifier on the whole frame or its ROI. The
+    // component is built with either the TFLite or the ESP-DL PPQ model, so
+    // only one of the two is ever registered. run() decodes straight into
+    // the model input; the pipelined mode decodes into one of two input
+    // buffers instead, and the model input is copied from it.
+    class ClassifierDetector : public Detector
+    {
+    public:
+        ~ClassifierDetector() override
+        {
+            delete this->classifier;
+            for (uint8_t *input : this->inputs)
+            {
+                heap_caps_free(input);
+            }
+        }
+
+        const char *name() const override { return CLASSIFIER_NAME; }
+
+        esp_err_t load() override
+        {
+            esp_err_t err = load_classifier(this->classifier);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            for (uint8_t *&input : this->inputs)
+            {
+                input = (uint8_t *)heap_caps_malloc(this->classifier->input_bytes(), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+                if (!input)
+                {
+                    ESP_LOGE(TAG, "Failed to allocate input slot");
+                    return ESP_ERR_NO_MEM;
+                }
+            }
+            return ESP_OK;
+        }
+
+        void run(const camera_fb_t *fb, detector_result_t &result) override
+        {
+            auto prediction = this->classifier->run_inference(fb);
+            result.err = prediction.err;
+            if (prediction.err != ESP_OK)
+            {
+                return;
+            }
+            this->apply(prediction, result);
+            result.decode_us = prediction.timings.decode_us;
+        }
+
+        bool pipelined() const override { return true; }
+
+        void prepare(const camera_fb_t *fb, int slot, detector_result_t &result) override
+        {
+            auto prediction = this->classifier->prepare_input(fb, this->inputs[slot]);
+            result.err = prediction.err;
+            result.decode_us = prediction.timings.decode_us;
+            result.preprocess_us = prediction.timings.preprocess_us;
+        }
+
+        void infer(int slot, detector_result_t &result) override
+        {
+            uint32_t preprocess_us = result.preprocess_us;
+            auto prediction = this->classifier->run_prepared(this->inputs[slot]);
+            result.err = prediction.err;
+            if (prediction.err != ESP_OK)
+            {
+                return;
+            }
+            this->apply(prediction, result);
+            // The copy into the model input is preprocessing too.
+            result.preprocess_us += preprocess_us;
+        }
+
+        bool set_roi(const jpeg_decoder::rect_t &roi) override
+        {
+            this->classifier->set_roi(roi);
+            return true;
+        }
+
+    private:
+        litter_robot_detect::CatDetect *classifier{nullptr};
+        uint8_t *inputs[DETECTOR_INPUT_SLOTS]{};
+
+        void apply(const litter_robot_detect::prediction_result_t &prediction, detector_result_t &result)
+        {
+            apply_prediction(prediction, result);
+            // "Not empty" is the classifier's notion of a cat being there.
+            result.scores[DETECTOR_CLASS_CAT] = 1.0f - prediction.empty_score / 255.0f;
+            result.invoke_us = prediction.timings.invoke_us;
+        }
+    };
+#endif
+
+#if defined(CONFIG_DETECTION_USES_CAT_DETECT) && defined(CONFIG_DETECTION_USES_LITTER_ROBOT) && \
+    (CONFIG_FLASH_ESPDET_PICO_224_224_CAT || CONFIG_CAT_DETECT_MODEL_IN_SDCARD)
+#define CASCADE_AVAILABLE 1
+    // ESPDet 224 on every frame, the classifier only when it finds a cat and
+    // only on the crop around the best box, taken from the image already
+    // decoded for the detector.
+    class CascadeDetector : public Detector
+    {
+    public:
+        ~CascadeDetector() override { delete this->classifier; }
+
+        const char *name() const override { return "cascade"; }
+
+        esp_err_t load() override
+        {
+            esp_err_t err = this->detector.load();
+            return err == ESP_OK ? load_classifier(this->classifier) : err;
+        }
+
+        void run(const camera_fb_t *fb, detector_result_t &result) override
+        {
+            this->prepare(fb, 0, result);
+            if (result.err == ESP_OK)
+            {
+                this->infer(0, result);
+            }
+        }
+
+        bool pipelined() const override { return true; }
+
+        void prepare(const camera_fb_t *fb, int slot, detector_result_t &result) override
+        {
+            this->detector.prepare(fb, slot, result);
+        }
+
+        void infer(int slot, detector_result_t &result) override
+        {
+            this->detector.infer(slot, result);
+            if (result.err != ESP_OK || result.box_count == 0)
+            {
+                return;
+            }
+
+            const detector_box_t *best = std::max_element(
+                result.boxes, result.boxes + result.box_count,
+                [](const detector_box_t &a, const detector_box_t &b)
+                { return a.score < b.score; });
+            const jpeg_decoder::decoded_image_t &image = this->detector.image(slot);
+            int scale = image.scale_denom;
+            int margin_x = (best->x2 - best->x1) * CONFIG_CASCADE_CROP_MARGIN / 100;
+            int margin_y = (best->y2 - best->y1) * CONFIG_CASCADE_CROP_MARGIN / 100;
+            int x1 = std::max((best->x1 - margin_x) / scale, 0);
+            int y1 = std::max((best->y1 - margin_y) / scale, 0);
+            int x2 = std::min((best->x2 + margin_x) / scale, (int)image.width);
+            int y2 = std::min((best->y2 + margin_y) / scale, (int)image.height);
+            litter_robot_detect::roi_t crop = {
+                .x = (uint16_t)x1,
+                .y = (uint16_t)y1,
+                .width = (uint16_t)std::max(x2 - x1, 0),
+                .height = (uint16_t)std::max(y2 - y1, 0),
+            };
+
+            auto prediction = this->classifier->run_inference(image, crop);
+            result.err = prediction.err;
+            if (prediction.err != ESP_OK)
+            {
+                return;
+            }
+            apply_prediction(prediction, result);
+            result.classify_us = prediction.timings.invoke_us;
+        }
+
+    private:
+        // Always the cheap 224 model: it runs on every frame, and the
+        // classifier decides between the cats on the crop anyway.
+        EspDetDetector detector{"cascade", CatDetect::ESPDET_PICO_224_224_CAT, 224};
+        litter_robot_detect::CatDetect *classifier{nullptr};
+    };
+#endif
+
+    typedef struct
+    {
+        const char *name;
+        Detector *(*create)();
+    } backend_t;
+
+    static const backend_t BACKENDS[] = {
+#ifdef CONFIG_DETECTION_USES_CAT_DETECT
+#if CONFIG_FLASH_ESPDET_PICO_224_224_CAT || CONFIG_CAT_DETECT_MODEL_IN_SDCARD
+        {"espdet224", []() -> Detector *
+         { return new (std::nothrow) EspDetDetector("espdet224", CatDetect::ESPDET_PICO_224_224_CAT, 224); }},
+#endif
+#if CONFIG_FLASH_ESPDET_PICO_416_416_CAT || CONFIG_CAT_DETECT_MODEL_IN_SDCARD
+        {"espdet416", []() -> Detector *
+         { return new (std::nothrow) EspDetDetector("espdet416", CatDetect::ESPDET_PICO_416_416_CAT, 416); }},
+#endif
+#endif
+#ifdef CONFIG_DETECTION_USES_LITTER_ROBOT
+        {CLASSIFIER_NAME, []() -> Detector *
+         { return new (std::nothrow) ClassifierDetector(); }},
+#endif
+#ifdef CASCADE_AVAILABLE
+        {"cascade", []() -> Detector *
+         { return new (std::nothrow) CascadeDetector(); }},
+#endif
+    };
+} // namespace myapp
+
+size_t myapp::detector_count()
+{
+    return sizeof(BACKENDS) / sizeof(BACKENDS[0]);
+}
+
+const char *myapp::detector_name(size_t index)
+{
+    return index < detector_count() ? BACKENDS[index].name : nullptr;
+}
+
+myapp::Detector *myapp::create_detector(const char *name)
+{
+    for (const auto &backend : BACKENDS)
+    {
+        if (strcmp(backend.name, name) == 0)
+        {
+            return backend.create();
+        }
+    }
+    ESP_LOGE(TAG, "Unknown detector '%s'", name);
+    return nullptr;
+}
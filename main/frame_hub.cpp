@@ -0,0 +1,224 @@
+#include "frame_hub.hpp"
+#include "esp_log.h"
+#include "stage_metrics.hpp"
+
+void myapp::SharedFrame::release()
+{
+    // Read the buffer first: once the count hits zero the capture task may
+    // reuse this entry for the next frame.
+    camera_fb_t *fb = this->frame;
+    if (this->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        esp_camera_fb_return(fb);
+    }
+}
+
+myapp::FrameHub::FrameHub()
+{
+    this->sinks_lock = xSemaphoreCreateMutex();
+}
+
+myapp::FrameHub::~FrameHub()
+{
+    if (this->task_handle)
+    {
+        vTaskDelete(this->task_handle);
+    }
+    if (this->latest)
+    {
+        this->latest->release();
+    }
+    vSemaphoreDelete(this->sinks_lock);
+}
+
+esp_err_t myapp::FrameHub::start(const task_config_t &task)
+{
+    if (xTaskCreatePinnedToCore(capture_task, task.name, task.stack, this, task.priority, &this->task_handle, task.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create capture task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+int myapp::FrameHub::subscribe(frame_sink_t sink, void *ctx)
+{
+    int id = -1;
+    xSemaphoreTake(this->sinks_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_SINKS; i++)
+    {
+        if (!this->sinks[i].sink)
+        {
+            this->sinks[i] = {.sink = sink, .ctx = ctx};
+            id = i;
+            break;
+        }
+    }
+    xSemaphoreGive(this->sinks_lock);
+    return id;
+}
+
+void myapp::FrameHub::unsubscribe(int id)
+{
+    if (id < 0 || id >= MAX_SINKS)
+    {
+        return;
+    }
+    xSemaphoreTake(this->sinks_lock, portMAX_DELAY);
+    this->sinks[id] = {};
+    xSemaphoreGive(this->sinks_lock);
+}
+
+myapp::SharedFrame *myapp::FrameHub::acquire_latest()
+{
+    taskENTER_CRITICAL(&this->latest_lock);
+    SharedFrame *frame = this->latest;
+    if (frame)
+    {
+        frame->retain();
+    }
+    taskEXIT_CRITICAL(&this->latest_lock);
+    return frame;
+}
+
+myapp::hub_stats_t myapp::FrameHub::get_stats() const
+{
+    hub_stats_t stats;
+    stats.captured = this->sequence.load(std::memory_order_relaxed);
+    stats.capture_failures = this->capture_failures.load(std::memory_order_relaxed);
+    stats.skipped = this->skipped.load(std::memory_order_relaxed);
+    for (const auto &entry : this->sinks)
+    {
+        if (entry.sink)
+        {
+            stats.sinks++;
+        }
+    }
+    return stats;
+}
+
+void myapp::FrameHub::capture_task(void *pvParameters)
+{
+    static_cast<myapp::FrameHub *>(pvParameters)->run();
+}
+
+void myapp::FrameHub::run()
+{
+    while (1)
+    {
+        camera_fb_t *fb;
+        {
+            StageSpan span(STAGE_CAPTURE);
+            fb = esp_camera_fb_get();
+        }
+        if (!fb)
+        {
+            ESP_LOGE(TAG, "Camera capture failed");
+            this->capture_failures.fetch_add(1, std::memory_order_relaxed);
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        uint8_t every = this->skip_every.load(std::memory_order_relaxed);
+        if (++this->skip_phase < every)
+        {
+            esp_camera_fb_return(fb);
+            this->skipped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        this->skip_phase = 0;
+
+        SharedFrame *frame = this->claim(fb);
+        if (!frame)
+        {
+            ESP_LOGW(TAG, "No free frame entry, dropping capture");
+            esp_camera_fb_return(fb);
+            continue;
+        }
+
+        this->dispatch(frame);
+
+        // The hub keeps a reference on the newest frame for snapshot readers.
+        taskENTER_CRITICAL(&this->latest_lock);
+        SharedFrame *previous = this->latest;
+        this->latest = frame;
+        taskEXIT_CRITICAL(&this->latest_lock);
+        if (previous)
+        {
+            previous->release();
+        }
+    }
+}
+
+myapp::SharedFrame *myapp::FrameHub::claim(camera_fb_t *fb)
+{
+    for (auto &frame : this->pool)
+    {
+        if (frame.refs.load(std::memory_order_acquire) == 0)
+        {
+            frame.frame = fb;
+            frame.sequence = this->sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+            frame.refs.store(1, std::memory_order_release);
+            return &frame;
+        }
+    }
+    return nullptr;
+}
+
+void myapp::FrameHub::dispatch(SharedFrame *frame)
+{
+    xSemaphoreTake(this->sinks_lock, portMAX_DELAY);
+    for (const auto &entry : this->sinks)
+    {
+        if (entry.sink)
+        {
+            entry.sink(frame, entry.ctx);
+        }
+    }
+    xSemaphoreGive(this->sinks_lock);
+}
+
+myapp::FrameQueue::FrameQueue(UBaseType_t depth)
+{
+    this->queue = xQueueCreate(depth, sizeof(SharedFrame *));
+}
+
+myapp::FrameQueue::~FrameQueue()
+{
+    this->drain();
+    vQueueDelete(this->queue);
+}
+
+void myapp::FrameQueue::sink(SharedFrame *frame, void *ctx)
+{
+    auto self = static_cast<myapp::FrameQueue *>(ctx);
+    frame->retain();
+    while (xQueueSend(self->queue, &frame, 0) != pdTRUE)
+    {
+        SharedFrame *oldest = nullptr;
+        if (xQueueReceive(self->queue, &oldest, 0) == pdTRUE)
+        {
+            oldest->release();
+            self->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+myapp::SharedFrame *myapp::FrameQueue::receive(TickType_t timeout)
+{
+    SharedFrame *frame = nullptr;
+    if (xQueueReceive(this->queue, &frame, timeout) != pdTRUE)
+    {
+        return nullptr;
+    }
+    return frame;
+}
+
+void myapp::FrameQueue::drain()
+{
+    SharedFrame *frame = nullptr;
+    while (xQueueReceive(this->queue, &frame, 0) == pdTRUE)
+    {
+        frame->release();
+    }
+}
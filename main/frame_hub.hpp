@@ -0,0 +1,121 @@
+#pragma once
+
+#include "esp_camera.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "task_config.hpp"
+#include <atomic>
+
+namespace myapp
+{
+    // A driver frame shared between any number of consumers. The buffer goes
+    // back to the camera driver when the last reference is released.
+    class SharedFrame
+    {
+    public:
+        const camera_fb_t *fb() const { return this->frame; }
+        uint32_t seq() const { return this->sequence; }
+        void retain() { this->refs.fetch_add(1, std::memory_order_relaxed); }
+        void release();
+
+    private:
+        friend class FrameHub;
+        camera_fb_t *frame{nullptr};
+        uint32_t sequence{0};
+        std::atomic<uint16_t> refs{0};
+    };
+
+    // Called from the capture task for every new frame. Sinks must not block;
+    // a sink that keeps the frame beyond the call has to retain() it.
+    typedef void (*frame_sink_t)(SharedFrame *frame, void *ctx);
+
+    typedef struct
+    {
+        uint32_t captured{0};
+        uint32_t capture_failures{0};
+        uint32_t skipped{0}; // returned to the driver unseen, see set_skip()
+        uint32_t sinks{0};
+    } hub_stats_t;
+
+    // Owns esp_camera_fb_get()/esp_camera_fb_return() and fans every captured
+    // frame out to the registered sinks.
+    class FrameHub
+    {
+    public:
+        FrameHub();
+        ~FrameHub();
+        esp_err_t start(const task_config_t &task);
+
+        // Returns a subscription id, or -1 if all sink slots are in use.
+        int subscribe(frame_sink_t sink, void *ctx);
+        // Once this returns the sink is guaranteed not to be running.
+        void unsubscribe(int id);
+
+        // Retained reference to the newest frame, or nullptr before the first
+        // capture. The caller must release() it. The hub holds the newest
+        // frame until the next one arrives, which pins one driver buffer
+        // even without any consumer (see CAMERA_FB_COUNT).
+        SharedFrame *acquire_latest();
+
+        // Hands only every `every`th frame to the sinks and returns the rest
+        // to the driver straight away. 1 passes every frame.
+        void set_skip(uint8_t every) { this->skip_every.store(every ? every : 1, std::memory_order_relaxed); }
+
+        hub_stats_t get_stats() const;
+
+    private:
+        static constexpr const char *TAG{"frame_hub"};
+        static constexpr int MAX_SINKS = CONFIG_FRAME_HUB_MAX_SINKS;
+        // One entry per driver buffer, plus one so a free entry always exists.
+        static constexpr int POOL_SIZE = CONFIG_CAMERA_FB_COUNT + 1;
+
+        typedef struct
+        {
+            frame_sink_t sink;
+            void *ctx;
+        } sink_entry_t;
+
+        SharedFrame pool[POOL_SIZE];
+        sink_entry_t sinks[MAX_SINKS]{};
+        SemaphoreHandle_t sinks_lock{nullptr};
+        portMUX_TYPE latest_lock = portMUX_INITIALIZER_UNLOCKED;
+        SharedFrame *latest{nullptr};
+        TaskHandle_t task_handle{nullptr};
+        // Written by the capture task only, read by get_stats() from any task.
+        std::atomic<uint32_t> sequence{0};
+        std::atomic<uint32_t> capture_failures{0};
+        std::atomic<uint8_t> skip_every{1};
+        uint8_t skip_phase{0};
+        std::atomic<uint32_t> skipped{0};
+
+        static void capture_task(void *pvParameters);
+        void run();
+        SharedFrame *claim(camera_fb_t *fb);
+        void dispatch(SharedFrame *frame);
+    };
+
+    // Per-consumer mailbox fed by a FrameHub sink. Holds at most `depth`
+    // frames; when full the oldest frame is released to make room, so a slow
+    // consumer drops frames instead of stalling capture.
+    class FrameQueue
+    {
+    public:
+        explicit FrameQueue(UBaseType_t depth = 1);
+        ~FrameQueue();
+        FrameQueue(const FrameQueue &) = delete;
+        FrameQueue &operator=(const FrameQueue &) = delete;
+
+        static void sink(SharedFrame *frame, void *ctx);
+        // Returns a retained frame the caller must release(), or nullptr on timeout.
+        SharedFrame *receive(TickType_t timeout);
+        void drain();
+        uint32_t overwritten() const { return this->dropped.load(std::memory_order_relaxed); }
+
+    private:
+        QueueHandle_t queue;
+        std::atomic<uint32_t> dropped{0};
+    };
+} // namespace myapp
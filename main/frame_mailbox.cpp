@@ -0,0 +1,97 @@
+#include "frame_mailbox.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include <string.h>
+
+myapp::FrameMailbox::~FrameMailbox()
+{
+    for (auto &slot : this->slots)
+    {
+        heap_caps_free(slot.fb.buf);
+        slot.fb.buf = nullptr;
+    }
+}
+
+esp_err_t myapp::FrameMailbox::init(size_t slot_capacity)
+{
+    for (auto &slot : this->slots)
+    {
+        if (!this->reserve(slot, slot_capacity))
+        {
+            ESP_LOGE(TAG, "Failed to allocate %u byte slot", slot_capacity);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+bool myapp::FrameMailbox::reserve(slot_t &slot, size_t len)
+{
+    if (slot.capacity >= len)
+    {
+        return true;
+    }
+
+    // Frames only outgrow the initial capacity on unusually detailed scenes,
+    // so growing here keeps the steady state allocation free.
+    uint8_t *buf = (uint8_t *)heap_caps_realloc(slot.fb.buf, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!buf)
+    {
+        return false;
+    }
+    slot.fb.buf = buf;
+    slot.capacity = len;
+    return true;
+}
+
+bool myapp::FrameMailbox::publish(const camera_fb_t *fb)
+{
+    slot_t &slot = this->slots[this->back];
+    if (!this->reserve(slot, fb->len))
+    {
+        this->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint8_t *buf = slot.fb.buf;
+    memcpy(buf, fb->buf, fb->len);
+    slot.fb = *fb;
+    slot.fb.buf = buf;
+    slot.seq = this->published.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    uint8_t prev = this->middle.exchange(this->back | FRESH_BIT, std::memory_order_acq_rel);
+    this->back = prev & INDEX_MASK;
+    if (prev & FRESH_BIT)
+    {
+        this->superseded.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+const camera_fb_t *myapp::FrameMailbox::consume()
+{
+    if (!(this->middle.load(std::memory_order_acquire) & FRESH_BIT))
+    {
+        return nullptr;
+    }
+
+    // Only the consumer clears FRESH_BIT, so the slot we swap in is always fresh.
+    uint8_t prev = this->middle.exchange(this->front, std::memory_order_acq_rel);
+    this->front = prev & INDEX_MASK;
+
+    const slot_t &slot = this->slots[this->front];
+    this->consumed.fetch_add(1, std::memory_order_relaxed);
+    this->last_lag.store(this->published.load(std::memory_order_relaxed) - slot.seq, std::memory_order_relaxed);
+    return &slot.fb;
+}
+
+myapp::mailbox_stats_t myapp::FrameMailbox::get_stats() const
+{
+    mailbox_stats_t stats;
+    stats.published = this->published.load(std::memory_order_relaxed);
+    stats.consumed = this->consumed.load(std::memory_order_relaxed);
+    stats.superseded = this->superseded.load(std::memory_order_relaxed);
+    stats.dropped = this->dropped.load(std::memory_order_relaxed);
+    stats.last_lag = this->last_lag.load(std::memory_order_relaxed);
+    return stats;
+}
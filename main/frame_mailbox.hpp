@@ -0,0 +1,72 @@
+#pragma once
+
+#include "esp_camera.h"
+#include "esp_err.h"
+#include <atomic>
+
+namespace myapp
+{
+    typedef struct
+    {
+        uint32_t published{0};  // frames handed in by the producer
+        uint32_t consumed{0};   // frames picked up by the consumer
+        uint32_t superseded{0}; // frames overwritten before the consumer saw them
+        uint32_t dropped{0};    // frames rejected because a slot could not hold them
+        uint32_t last_lag{0};   // frames published since the one last consumed was captured
+    } mailbox_stats_t;
+
+    // Single-producer / single-consumer "latest frame wins" mailbox.
+    //
+    // Three slots own their own PSRAM storage: the producer fills its back slot
+    // and swaps it with the shared middle slot, the consumer swaps its front slot
+    // with the middle slot when a fresh frame is waiting. Neither side ever
+    // blocks, and the producer returns the driver buffer as soon as publish()
+    // returns.
+    class FrameMailbox
+    {
+    public:
+        FrameMailbox() = default;
+        ~FrameMailbox();
+        FrameMailbox(const FrameMailbox &) = delete;
+        FrameMailbox &operator=(const FrameMailbox &) = delete;
+
+        esp_err_t init(size_t slot_capacity);
+
+        // Producer side. Copies the frame into the back slot and makes it the
+        // newest frame. Returns false if the frame was dropped.
+        bool publish(const camera_fb_t *fb);
+
+        // Consumer side. Returns the newest unseen frame, or nullptr if nothing
+        // new was published since the last call. The frame stays valid until
+        // the next call to consume().
+        const camera_fb_t *consume();
+
+        mailbox_stats_t get_stats() const;
+
+    private:
+        static constexpr uint8_t SLOT_COUNT = 3;
+        static constexpr uint8_t INDEX_MASK = 0x03;
+        static constexpr uint8_t FRESH_BIT = 0x80;
+        static constexpr const char *TAG{"frame_mailbox"};
+
+        typedef struct
+        {
+            camera_fb_t fb;
+            size_t capacity;
+            uint32_t seq;
+        } slot_t;
+
+        slot_t slots[SLOT_COUNT]{};
+        std::atomic<uint8_t> middle{1};
+        uint8_t back{0};  // owned by the producer
+        uint8_t front{2}; // owned by the consumer
+
+        std::atomic<uint32_t> published{0};
+        std::atomic<uint32_t> consumed{0};
+        std::atomic<uint32_t> superseded{0};
+        std::atomic<uint32_t> dropped{0};
+        std::atomic<uint32_t> last_lag{0};
+
+        bool reserve(slot_t &slot, size_t len);
+    };
+} // namespace myapp
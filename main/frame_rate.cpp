@@ -0,0 +1,154 @@
+#include "frame_rate.hpp"
+#include "esp_camera.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <algorithm>
+#include <math.h>
+
+esp_err_t myapp::FrameRateController::start(demand_fn demand, void *ctx, int xclk_mhz, int ledc_timer,
+                                            const task_config_t &task)
+{
+    this->demand = demand;
+    this->ctx = ctx;
+    this->max_xclk_mhz = xclk_mhz;
+    this->xclk_mhz = xclk_mhz;
+    this->ledc_timer = ledc_timer;
+    // The driver has been running at the full XCLK since it started.
+    this->settled = true;
+    hub_stats_t hub_stats = this->hub.get_stats();
+    this->last_frames = hub_stats.captured + hub_stats.skipped;
+    this->last_us = esp_timer_get_time();
+    this->stats.full_rate = true;
+    this->stats.xclk_mhz = xclk_mhz;
+
+    if (xTaskCreatePinnedToCore(controller_task, task.name, task.stack, this, task.priority, &this->task_handle,
+                                task.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create frame rate task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void myapp::FrameRateController::account_inference(uint32_t us)
+{
+    uint32_t average = this->service_us.load(std::memory_order_relaxed);
+    this->service_us.store(average ? average - average / 8 + us / 8 : us, std::memory_order_relaxed);
+}
+
+void myapp::FrameRateController::request_full_rate()
+{
+    this->full_rate_requested.store(true, std::memory_order_relaxed);
+    if (this->task_handle)
+    {
+        xTaskNotifyGive(this->task_handle);
+    }
+}
+
+myapp::frame_rate_stats_t myapp::FrameRateController::get_stats() const
+{
+    taskENTER_CRITICAL(&this->lock);
+    frame_rate_stats_t stats = this->stats;
+    taskEXIT_CRITICAL(&this->lock);
+    return stats;
+}
+
+void myapp::FrameRateController::controller_task(void *pvParameters)
+{
+    auto controller = static_cast<FrameRateController *>(pvParameters);
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_FRAME_RATE_PERIOD_MS));
+        controller->update();
+    }
+}
+
+void myapp::FrameRateController::update()
+{
+    int64_t now = esp_timer_get_time();
+    hub_stats_t hub_stats = this->hub.get_stats();
+    uint32_t frames = hub_stats.captured + hub_stats.skipped;
+    float sensor_fps = now > this->last_us ? (frames - this->last_frames) * 1e6f / (now - this->last_us) : 0;
+    this->last_us = now;
+    this->last_frames = frames;
+
+    taskENTER_CRITICAL(&this->lock);
+    float full_fps = this->stats.full_fps;
+    taskEXIT_CRITICAL(&this->lock);
+    // Only a period spent entirely at the full XCLK tells what the sensor
+    // can do; the frame size and sensor mode fix it otherwise.
+    if (this->settled && this->xclk_mhz == this->max_xclk_mhz && sensor_fps > 0)
+    {
+        full_fps = full_fps > 0 ? full_fps * 0.75f + sensor_fps * 0.25f : sensor_fps;
+    }
+
+    uint32_t service_us = this->service_us.load(std::memory_order_relaxed);
+    float needed = this->demand ? this->demand(this->ctx) : 0;
+    bool requested = this->full_rate_requested.exchange(false, std::memory_order_relaxed);
+    float target = service_us ? CONFIG_FRAME_RATE_HEADROOM_PCT * 10000.0f / service_us : 0;
+    target = std::max({target, needed, (float)CONFIG_FRAME_RATE_MIN_FPS});
+
+    // Nothing to scale from until both the sensor and the detector were measured.
+    bool full_rate = requested || needed >= FULL_RATE || !service_us || full_fps <= 0 || target >= full_fps;
+    int xclk_mhz = this->max_xclk_mhz;
+    uint8_t skip = 1;
+    if (!full_rate)
+    {
+        if (this->xclk_supported)
+        {
+            xclk_mhz = (int)ceilf(this->max_xclk_mhz * target / full_fps);
+            xclk_mhz = std::clamp(xclk_mhz, CONFIG_FRAME_RATE_MIN_XCLK_MHZ, this->max_xclk_mhz);
+            // Step down only by more than 1 MHz, so a noisy average does not
+            // retune the sensor every period. Stepping up is never held back.
+            if (xclk_mhz < this->xclk_mhz && this->xclk_mhz - xclk_mhz < 2)
+            {
+                xclk_mhz = this->xclk_mhz;
+            }
+        }
+        float fps = full_fps * xclk_mhz / this->max_xclk_mhz;
+        skip = (uint8_t)std::clamp((int)(fps / target), 1, 255);
+    }
+
+    this->settled = xclk_mhz == this->xclk_mhz && skip == this->skip;
+    this->apply(xclk_mhz, skip);
+
+    taskENTER_CRITICAL(&this->lock);
+    this->stats.full_rate = full_rate;
+    this->stats.xclk_mhz = this->xclk_mhz;
+    this->stats.skip = this->skip;
+    this->stats.sensor_fps = sensor_fps;
+    this->stats.full_fps = full_fps;
+    this->stats.target_fps = full_rate ? full_fps : target;
+    this->stats.service_us = service_us;
+    taskEXIT_CRITICAL(&this->lock);
+}
+
+void myapp::FrameRateController::apply(int xclk_mhz, uint8_t skip)
+{
+    if (xclk_mhz != this->xclk_mhz)
+    {
+        sensor_t *sensor = esp_camera_sensor_get();
+        if (!sensor || !sensor->set_xclk || sensor->set_xclk(sensor, this->ledc_timer, xclk_mhz) != 0)
+        {
+            // Skipping frames alone still saves the work downstream of
+            // capture; the next period works out the skip ratio for it.
+            ESP_LOGW(TAG, "Sensor did not take a %d MHz XCLK, falling back to skipping frames", xclk_mhz);
+            this->xclk_supported = false;
+            this->settled = false;
+            return;
+        }
+        this->xclk_mhz = xclk_mhz;
+        taskENTER_CRITICAL(&this->lock);
+        this->stats.changes++;
+        taskEXIT_CRITICAL(&this->lock);
+    }
+    if (skip != this->skip)
+    {
+        this->hub.set_skip(skip);
+        this->skip = skip;
+    }
+    if (!this->settled)
+    {
+        ESP_LOGI(TAG, "Camera at %d MHz XCLK, passing 1 in %u frames", this->xclk_mhz, this->skip);
+    }
+}
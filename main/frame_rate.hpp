@@ -0,0 +1,88 @@
+#pragma once
+
+#include "esp_err.h"
+#include "frame_hub.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "task_config.hpp"
+#include <atomic>
+
+namespace myapp
+{
+    typedef struct
+    {
+        bool full_rate{false};   // a consumer wanted every frame the sensor gives
+        int xclk_mhz{0};
+        uint8_t skip{1};         // FrameHub passes every skip-th frame
+        float sensor_fps{0};     // frames out of the driver over the last period
+        float full_fps{0};       // sensor rate at the full XCLK, 0 until measured
+        float target_fps{0};     // rate the controller aimed for
+        uint32_t service_us{0};  // detector time per frame, averaged
+        uint32_t changes{0};     // XCLK changes since boot
+    } frame_rate_stats_t;
+
+    // Runs the camera only as fast as its consumers need.
+    //
+    // While a consumer wants every frame (a /stream viewer, a pipeline
+    // benchmark) the sensor runs at the configured XCLK and the FrameHub
+    // passes every frame. Otherwise the target is what the detector can take,
+    // from its averaged time per frame, plus CONFIG_FRAME_RATE_HEADROOM_PCT so
+    // a fresh frame is waiting when it finishes. The frame rate of the sensor
+    // follows its XCLK, so the controller scales XCLK down towards the target
+    // and, below CONFIG_FRAME_RATE_MIN_XCLK_MHZ, has the FrameHub skip frames
+    // for the rest. A slower XCLK means fewer frames DMAed into PSRAM and less
+    // bandwidth taken from the model.
+    class FrameRateController
+    {
+    public:
+        // Frame rate the other consumers need right now: 0 if only the
+        // detector matters, FULL_RATE for every frame the sensor gives.
+        typedef float (*demand_fn)(void *ctx);
+        static constexpr float FULL_RATE = 1000.0f;
+
+        explicit FrameRateController(FrameHub &hub) : hub(hub) {}
+        FrameRateController(const FrameRateController &) = delete;
+        FrameRateController &operator=(const FrameRateController &) = delete;
+
+        // xclk_mhz and ledc_timer come from the camera config the driver was
+        // started with.
+        esp_err_t start(demand_fn demand, void *ctx, int xclk_mhz, int ledc_timer, const task_config_t &task);
+
+        // Inference task: detector time for one frame, counting only the
+        // slower stage when the two overlap.
+        void account_inference(uint32_t us);
+        // Goes back to the full rate now rather than at the next period, for
+        // a consumer that is about to start.
+        void request_full_rate();
+
+        frame_rate_stats_t get_stats() const;
+
+    private:
+        static constexpr const char *TAG{"frame_rate"};
+
+        FrameHub &hub;
+        TaskHandle_t task_handle{nullptr};
+        demand_fn demand{nullptr};
+        void *ctx{nullptr};
+        int max_xclk_mhz{0};
+        int ledc_timer{0};
+        bool xclk_supported{true};
+        std::atomic<uint32_t> service_us{0};
+        std::atomic<bool> full_rate_requested{false};
+
+        // Controller task only.
+        int xclk_mhz{0};
+        uint8_t skip{1};
+        bool settled{false}; // the current setting held for the whole last period
+        int64_t last_us{0};
+        uint32_t last_frames{0};
+
+        mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        frame_rate_stats_t stats{};
+
+        static void controller_task(void *pvParameters);
+        void update();
+        void apply(int xclk_mhz, uint8_t skip);
+    };
+} // namespace myapp
@@ -0,0 +1,268 @@
+#include "inference_pipeline.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+myapp::InferencePipeline::~InferencePipeline()
+{
+    if (this->free_slots)
+    {
+        vQueueDelete(this->free_slots);
+    }
+    if (this->ready_slots)
+    {
+        vQueueDelete(this->ready_slots);
+    }
+}
+
+esp_err_t myapp::InferencePipeline::start(prepare_fn prepare, void *ctx, const task_config_t &task)
+{
+    this->prepare = prepare;
+    this->ctx = ctx;
+    this->free_slots = xQueueCreate(DETECTOR_INPUT_SLOTS, sizeof(int));
+    this->ready_slots = xQueueCreate(DETECTOR_INPUT_SLOTS, sizeof(int));
+    if (!this->free_slots || !this->ready_slots)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    // Paused: the inference task holds every slot until update() resumes.
+    if (xTaskCreatePinnedToCore(prepare_task, task.name, task.stack, this, task.priority, &this->task_handle, task.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create prepare task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void myapp::InferencePipeline::notify()
+{
+    xTaskNotifyGive(this->task_handle);
+}
+
+void myapp::InferencePipeline::prepare_task(void *pvParameters)
+{
+    auto pipeline = static_cast<InferencePipeline *>(pvParameters);
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Only take the frame once a slot is free, so it is the newest one
+        // by the time the model gets to it.
+        int index;
+        int64_t start_wait = esp_timer_get_time();
+        xQueueReceive(pipeline->free_slots, &index, portMAX_DELAY);
+        int64_t waited = esp_timer_get_time() - start_wait;
+
+        pipeline_slot_t &slot = pipeline->slots[index];
+        slot = {};
+        bool prepared = pipeline->prepare(slot, index, pipeline->ctx);
+        xQueueSend(prepared ? pipeline->ready_slots : pipeline->free_slots, &index, 0);
+
+        taskENTER_CRITICAL(&pipeline->lock);
+        if (prepared)
+        {
+            pipeline->stats.prepared++;
+            // Time spent paused is not the model's fault.
+            if (pipeline->active())
+            {
+                pipeline->stats.prepare_wait_us += waited;
+            }
+        }
+        else
+        {
+            pipeline->stats.skipped++;
+        }
+        taskEXIT_CRITICAL(&pipeline->lock);
+    }
+}
+
+myapp::pipeline_slot_t *myapp::InferencePipeline::acquire(int &index, TickType_t wait)
+{
+    int64_t start_wait = esp_timer_get_time();
+    bool ready = xQueueReceive(this->ready_slots, &index, wait) == pdTRUE;
+    int64_t waited = esp_timer_get_time() - start_wait;
+    taskENTER_CRITICAL(&this->lock);
+    this->stats.infer_wait_us += waited;
+    taskEXIT_CRITICAL(&this->lock);
+    return ready ? &this->slots[index] : nullptr;
+}
+
+void myapp::InferencePipeline::release(int index)
+{
+    xQueueSend(this->free_slots, &index, 0);
+}
+
+void myapp::InferencePipeline::frame_done()
+{
+    taskENTER_CRITICAL(&this->lock);
+    this->stats.frames++;
+    taskEXIT_CRITICAL(&this->lock);
+}
+
+void myapp::InferencePipeline::pause()
+{
+    if (this->paused)
+    {
+        return;
+    }
+    this->running.store(false, std::memory_order_release);
+
+    // The prepare task only holds a slot while it works on it, so every
+    // slot comes back soon. Prepared frames that were not inferred yet are
+    // dropped.
+    int held = 0;
+    while (held < DETECTOR_INPUT_SLOTS)
+    {
+        int index;
+        if (xQueueReceive(this->ready_slots, &index, 0) == pdTRUE ||
+            xQueueReceive(this->free_slots, &index, pdMS_TO_TICKS(10)) == pdTRUE)
+        {
+            held++;
+        }
+    }
+    this->paused = true;
+}
+
+void myapp::InferencePipeline::resume()
+{
+    if (!this->paused)
+    {
+        return;
+    }
+    for (int index = 0; index < DETECTOR_INPUT_SLOTS; index++)
+    {
+        xQueueSend(this->free_slots, &index, 0);
+    }
+    this->paused = false;
+    this->running.store(true, std::memory_order_release);
+}
+
+bool myapp::InferencePipeline::update(bool supported, uint32_t camera_frames)
+{
+    taskENTER_CRITICAL(&this->lock);
+    bool wanted = this->wanted;
+    int bench_request = this->bench_request;
+    this->bench_request = 0;
+    this->supported = supported;
+    uint32_t frames = this->stats.frames;
+    taskEXIT_CRITICAL(&this->lock);
+
+    int64_t now = esp_timer_get_time();
+    int phase = this->bench_phase.load(std::memory_order_relaxed);
+    if (bench_request > 0)
+    {
+        ESP_LOGI(TAG, "Benchmarking %d s sequential, then %d s pipelined", bench_request, bench_request);
+        taskENTER_CRITICAL(&this->lock);
+        this->bench_seconds = bench_request;
+        this->sequential_fps = 0;
+        this->pipelined_fps = 0;
+        this->sequential_camera_fps = 0;
+        this->pipelined_camera_fps = 0;
+        taskEXIT_CRITICAL(&this->lock);
+        phase = BENCH_SEQUENTIAL;
+        this->phase_start_us = now;
+        this->phase_start_frames = frames;
+        this->phase_start_camera_frames = camera_frames;
+    }
+    else if (phase != BENCH_IDLE && now - this->phase_start_us >= this->bench_seconds * 1000000LL)
+    {
+        float fps = (frames - this->phase_start_frames) * 1000000.0f / (now - this->phase_start_us);
+        float camera_fps = (camera_frames - this->phase_start_camera_frames) * 1000000.0f / (now - this->phase_start_us);
+        taskENTER_CRITICAL(&this->lock);
+        if (phase == BENCH_SEQUENTIAL)
+        {
+            this->sequential_fps = fps;
+            this->sequential_camera_fps = camera_fps;
+        }
+        else
+        {
+            this->pipelined_fps = fps;
+            this->pipelined_camera_fps = camera_fps;
+        }
+        taskEXIT_CRITICAL(&this->lock);
+
+        if (phase == BENCH_SEQUENTIAL)
+        {
+            phase = BENCH_PIPELINED;
+            this->phase_start_us = now;
+            this->phase_start_frames = frames;
+            this->phase_start_camera_frames = camera_frames;
+        }
+        else
+        {
+            phase = BENCH_IDLE;
+            ESP_LOGI(TAG, "Benchmark: sequential %.2f fps (camera %.2f), pipelined %.2f fps (camera %.2f)",
+                     this->sequential_fps, this->sequential_camera_fps, this->pipelined_fps,
+                     this->pipelined_camera_fps);
+        }
+    }
+    this->bench_phase.store(phase, std::memory_order_relaxed);
+
+    if (phase != BENCH_IDLE)
+    {
+        wanted = phase == BENCH_PIPELINED;
+    }
+    if (wanted && supported)
+    {
+        this->resume();
+        return true;
+    }
+    this->pause();
+    return false;
+}
+
+esp_err_t myapp::InferencePipeline::handle(httpd_req_t *req)
+{
+    char query[64];
+    char value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "mode", value, sizeof(value)) == ESP_OK)
+        {
+            bool wanted = strcmp(value, "sequential") != 0;
+            taskENTER_CRITICAL(&this->lock);
+            this->wanted = wanted;
+            taskEXIT_CRITICAL(&this->lock);
+        }
+        if (httpd_query_key_value(query, "bench", value, sizeof(value)) == ESP_OK)
+        {
+            int seconds = std::clamp(atoi(value), 1, 300);
+            taskENTER_CRITICAL(&this->lock);
+            this->bench_request = seconds;
+            taskEXIT_CRITICAL(&this->lock);
+        }
+    }
+
+    taskENTER_CRITICAL(&this->lock);
+    bool wanted = this->wanted;
+    bool supported = this->supported;
+    pipeline_stats_t stats = this->stats;
+    float sequential_fps = this->sequential_fps;
+    float pipelined_fps = this->pipelined_fps;
+    float sequential_camera_fps = this->sequential_camera_fps;
+    float pipelined_camera_fps = this->pipelined_camera_fps;
+    taskEXIT_CRITICAL(&this->lock);
+
+    char buf[384];
+    snprintf(buf, sizeof(buf),
+             "{\"mode\":\"%s\",\"active\":%s,\"supported\":%s,\"frames\":%lu,\"prepared\":%lu,\"skipped\":%lu,"
+             "\"prepare_wait_ms\":%llu,\"infer_wait_ms\":%llu,\"bench\":{\"running\":%s,\"sequential_fps\":%.2f,"
+             "\"sequential_camera_fps\":%.2f,\"pipelined_fps\":%.2f,\"pipelined_camera_fps\":%.2f}}",
+             wanted ? "pipelined" : "sequential", this->active() ? "true" : "false", supported ? "true" : "false",
+             stats.frames, stats.prepared, stats.skipped, stats.prepare_wait_us / 1000, stats.infer_wait_us / 1000,
+             this->benchmarking() ? "true" : "false", sequential_fps, sequential_camera_fps, pipelined_fps,
+             pipelined_camera_fps);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
+
+myapp::pipeline_stats_t myapp::InferencePipeline::get_stats() const
+{
+    taskENTER_CRITICAL(&this->lock);
+    pipeline_stats_t stats = this->stats;
+    taskEXIT_CRITICAL(&this->lock);
+    return stats;
+}
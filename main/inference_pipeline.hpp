@@ -0,0 +1,119 @@
+#pragma once
+
+#include "detector.hpp"
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "task_config.hpp"
+#include <atomic>
+
+namespace myapp
+{
+    typedef struct
+    {
+        detector_result_t result;
+        int64_t frame_us{0};
+        bool gated{false}; // the motion gate rejected the frame: only frame_us is set
+    } pipeline_slot_t;
+
+    typedef struct
+    {
+        uint32_t prepared{0};
+        uint32_t skipped{0};         // frames the prepare function passed on
+        uint32_t frames{0};          // frames finished by the inference task, both modes
+        uint64_t prepare_wait_us{0}; // prepare task waiting for a free slot: the model is the bottleneck
+        uint64_t infer_wait_us{0};   // inference task waiting for a prepared slot: decode is the bottleneck
+    } pipeline_stats_t;
+
+    // Two stage inference: a prepare task on the other core decodes and
+    // preprocesses frame N+1 into one input slot while the inference task
+    // runs the model on frame N in the other. Slots travel between the two
+    // through a free and a ready queue, so neither stage ever touches a slot
+    // the other one holds, and the prepare task only takes a new frame once
+    // a slot is free, which keeps it the newest one.
+    //
+    // The inference task owns the mode. It calls update() between frames,
+    // which pauses the pipeline (collects every slot, so the prepare task is
+    // idle and the detector can be swapped) for the sequential mode and
+    // resumes it for the pipelined one. /pipeline?bench=N runs N seconds in
+    // each mode and reports frames per second for both, each next to the
+    // rate the camera delivered meanwhile: neither mode can beat that, so
+    // equal results with a camera bound run are no sign of a broken pipeline.
+    class InferencePipeline
+    {
+    public:
+        // Fills slot `index` from the newest frame. Runs in the prepare task.
+        // Returns false if there was nothing to prepare.
+        typedef bool (*prepare_fn)(pipeline_slot_t &slot, int index, void *ctx);
+
+        InferencePipeline() = default;
+        ~InferencePipeline();
+        InferencePipeline(const InferencePipeline &) = delete;
+        InferencePipeline &operator=(const InferencePipeline &) = delete;
+
+        // Starts the prepare task, paused.
+        esp_err_t start(prepare_fn prepare, void *ctx, const task_config_t &task);
+
+        // True while frames go to the prepare task rather than the inference task.
+        bool active() const { return this->running.load(std::memory_order_acquire); }
+        void notify();
+
+        // Inference task side. update() applies a requested mode or bench
+        // phase; supported says whether the current detector can be split,
+        // camera_frames counts the frames the camera has delivered so far.
+        // Returns true if the pipelined mode is on.
+        bool update(bool supported, uint32_t camera_frames);
+        pipeline_slot_t *acquire(int &index, TickType_t wait);
+        void release(int index);
+        void frame_done();
+        void pause();
+        bool benchmarking() const { return this->bench_phase.load(std::memory_order_relaxed) != BENCH_IDLE; }
+
+        // httpd handler body for /pipeline?mode=pipelined|sequential&bench=seconds.
+        esp_err_t handle(httpd_req_t *req);
+
+        pipeline_stats_t get_stats() const;
+
+    private:
+        static constexpr const char *TAG{"inference_pipeline"};
+
+        typedef enum
+        {
+            BENCH_IDLE,
+            BENCH_SEQUENTIAL,
+            BENCH_PIPELINED,
+        } bench_phase_t;
+
+        pipeline_slot_t slots[DETECTOR_INPUT_SLOTS]{};
+        QueueHandle_t free_slots{nullptr};
+        QueueHandle_t ready_slots{nullptr};
+        TaskHandle_t task_handle{nullptr};
+        prepare_fn prepare{nullptr};
+        void *ctx{nullptr};
+        std::atomic<bool> running{false};
+        bool paused{true}; // inference task only
+
+        // Requests from /pipeline and what is reported back, under lock.
+        mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        bool wanted{true};
+        bool supported{false};
+        int bench_request{0};
+        int bench_seconds{0};
+        float sequential_fps{0};
+        float pipelined_fps{0};
+        float sequential_camera_fps{0};
+        float pipelined_camera_fps{0};
+        pipeline_stats_t stats{};
+
+        // Bench progress, inference task only.
+        std::atomic<int> bench_phase{BENCH_IDLE};
+        int64_t phase_start_us{0};
+        uint32_t phase_start_frames{0};
+        uint32_t phase_start_camera_frames{0};
+
+        static void prepare_task(void *pvParameters);
+        void resume();
+    };
+} // namespace myapp
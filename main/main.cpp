@@ -1,14 +1,173 @@
 #include "main.hpp"
+#ifdef CONFIG_DETECTION_LOG
+#include "esp_netif_sntp.h"
+#endif
+#include <algorithm>
+#include <errno.h>
+#include <stdlib.h>
 
 myapp::CameraApp::CameraApp()
 {
+    this->boot_events = xEventGroupCreate();
 }
 
 myapp::CameraApp::~CameraApp()
 {
-#if defined(CONFIG_DETECTION_CAT_DETECT) || defined(CONFIG_DETECTION_LITTER_ROBOT_TFLITE)
-    delete detect;
+    delete this->detector;
+    vEventGroupDelete(this->boot_events);
+}
+
+esp_err_t myapp::CameraApp::boot(WifiManager &wifi)
+{
+    this->wifi = &wifi;
+    wifi.start(on_network_ready, this);
+    this->mark_boot(BOOT_WIFI_STARTED);
+
+    if (xTaskCreatePinnedToCore(init_task, TASK_INIT.name, TASK_INIT.stack, this, TASK_INIT.priority, NULL,
+                                TASK_INIT.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create init task");
+        return ESP_ERR_NO_MEM;
+    }
+
+#ifdef CONFIG_TASK_STATS
+    this->task_monitor.start(TASK_MONITOR);
+#endif
+
+    // Whichever of network and pipeline comes up first gets its service
+    // started first.
+    esp_err_t result = ESP_OK;
+    EventBits_t handled = 0;
+    while (handled != (BOOT_NETWORK_BIT | BOOT_INIT_DONE_BIT))
+    {
+        EventBits_t bits = xEventGroupWaitBits(this->boot_events, (BOOT_NETWORK_BIT | BOOT_INIT_DONE_BIT) & ~handled,
+                                               pdFALSE, pdFALSE, portMAX_DELAY);
+        if ((bits & BOOT_INIT_DONE_BIT) && !(handled & BOOT_INIT_DONE_BIT))
+        {
+            handled |= BOOT_INIT_DONE_BIT;
+            result = this->init_result;
+            if (result != ESP_OK)
+            {
+                ESP_LOGE(TAG, "Camera init failed with error 0x%x, running without the pipeline", result);
+            }
+            else
+            {
+                result = this->start_pipeline();
+            }
+        }
+        if ((bits & BOOT_NETWORK_BIT) && !(handled & BOOT_NETWORK_BIT))
+        {
+            handled |= BOOT_NETWORK_BIT;
+            this->start_http_server_task();
+            this->mark_boot(BOOT_HTTP_STARTED);
+        }
+    }
+    return result;
+}
+
+esp_err_t myapp::CameraApp::start_pipeline()
+{
+#ifdef CONFIG_INFERENCE_PIPELINE
+    ESP_ERROR_CHECK(this->pipeline.start(prepare_frame, this, TASK_PREPARE));
+#endif
+    if (xTaskCreatePinnedToCore(run_inference_task, TASK_INFERENCE.name, TASK_INFERENCE.stack, this,
+                                TASK_INFERENCE.priority, &this->ai_task_handler, TASK_INFERENCE.core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create inference task");
+        return ESP_ERR_NO_MEM;
+    }
+    this->frame_hub.subscribe(on_frame, this);
+    this->detection_events.subscribe(on_detection_event, this);
+    ESP_ERROR_CHECK(this->detection_events.start(TASK_EVENTS));
+    ESP_ERROR_CHECK(this->frame_hub.start(TASK_CAPTURE));
+    ESP_ERROR_CHECK(this->stream_server.start(TASK_STREAM));
+#ifdef CONFIG_CLIP_RECORDER
+    if (this->clips_ready && this->clip_recorder.start(TASK_CLIP_WRITER) == ESP_OK)
+    {
+        this->frame_hub.subscribe(ClipRecorder::sink, &this->clip_recorder);
+    }
+    else
+    {
+        this->clips_ready = false;
+    }
+#endif
+#ifdef CONFIG_DETECTION_LOG
+    if (this->detection_log_ready && this->detection_log.start(TASK_DETECTION_LOG) != ESP_OK)
+    {
+        this->detection_log_ready = false;
+    }
+#endif
+#ifdef CONFIG_FRAME_RATE_CONTROL
+    ESP_ERROR_CHECK(this->frame_rate.start(frame_demand, this, camera_config.xclk_freq_hz / 1000000,
+                                           camera_config.ledc_timer, TASK_FRAME_RATE));
+#endif
+    this->mark_boot(BOOT_PIPELINE_STARTED);
+    return ESP_OK;
+}
+
+void myapp::CameraApp::init_task(void *pvParameters)
+{
+    auto app = static_cast<myapp::CameraApp *>(pvParameters);
+    esp_err_t err = app->setup_camera();
+    if (err == ESP_OK)
+    {
+        app->mark_boot(BOOT_CAMERA_READY);
+        err = app->setup_model();
+    }
+    if (err == ESP_OK)
+    {
+        app->mark_boot(BOOT_MODEL_READY);
+        err = app->inference_mailbox.init(CONFIG_FRAME_MAILBOX_SLOT_SIZE);
+    }
+#ifdef CONFIG_MOTION_GATE
+    if (err == ESP_OK)
+    {
+        err = app->motion_gate.init();
+    }
+#endif
+#ifdef CONFIG_CLIP_RECORDER
+    // Missing storage only costs the clips, not detection.
+    app->clips_ready = err == ESP_OK && app->clip_recorder.init() == ESP_OK;
+#endif
+#ifdef CONFIG_DETECTION_LOG
+    app->detection_log_ready = err == ESP_OK && app->detection_log.init() == ESP_OK;
 #endif
+    app->init_result = err;
+    xEventGroupSetBits(app->boot_events, BOOT_INIT_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+void myapp::CameraApp::on_network_ready(const esp_netif_ip_info_t &ip_info, void *ctx)
+{
+    auto app = static_cast<myapp::CameraApp *>(ctx);
+    app->mark_boot(BOOT_NETWORK_UP);
+#ifdef CONFIG_DETECTION_LOG
+    // SNTP keeps resyncing on its own across reconnects.
+    if (!app->sntp_started)
+    {
+        esp_sntp_config_t sntp_config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_DETECTION_LOG_SNTP_SERVER);
+        app->sntp_started = esp_netif_sntp_init(&sntp_config) == ESP_OK;
+    }
+#endif
+    xEventGroupSetBits(app->boot_events, BOOT_NETWORK_BIT);
+}
+
+void myapp::CameraApp::mark_boot(boot_phase_t phase)
+{
+    // Only the first occurrence counts; later reconnects are not boot.
+    if (this->boot_us[phase])
+    {
+        return;
+    }
+    this->boot_us[phase] = esp_timer_get_time();
+    ESP_LOGI(TAG, "Boot: %s at %lld ms", BOOT_PHASE_NAMES[phase], this->boot_us[phase] / 1000);
+
+    if (phase == BOOT_FIRST_INFERENCE)
+    {
+        ESP_LOGI(TAG, "Boot summary: wifi %lld ms, camera %lld ms, model %lld ms, first inference %lld ms",
+                 this->boot_us[BOOT_NETWORK_UP] / 1000, this->boot_us[BOOT_CAMERA_READY] / 1000,
+                 this->boot_us[BOOT_MODEL_READY] / 1000, this->boot_us[BOOT_FIRST_INFERENCE] / 1000);
+    }
 }
 
 esp_err_t myapp::CameraApp::setup_camera()
@@ -49,22 +208,107 @@ esp_err_t myapp::CameraApp::setup_camera()
 
 esp_err_t myapp::CameraApp::setup_model()
 {
-#ifdef CONFIG_DETECTION_CAT_DETECT
-    detect = new CatDetect();
-#elif defined(CONFIG_DETECTION_LITTER_ROBOT_TFLITE)
-    detect = new litter_robot_detect::CatDetect();
-    ESP_ERROR_CHECK(detect->setup(1024 * 1024));
-    detect->test_model();
+    jpeg_decoder::rect_t roi;
+    if (load_roi(roi) == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Using stored ROI x=%d y=%d w=%d h=%d", roi.x, roi.y, roi.width, roi.height);
+        this->roi = roi;
+    }
 
-#endif
+    char name[sizeof(this->active_detector)];
+    if (load_detector_name(name, sizeof(name)) != ESP_OK)
+    {
+        strlcpy(name, CONFIG_DETECTOR_DEFAULT, sizeof(name));
+    }
+    esp_err_t err = this->switch_detector(name);
+    if (err != ESP_OK && strcmp(name, CONFIG_DETECTOR_DEFAULT) != 0)
+    {
+        ESP_LOGW(TAG, "Falling back to the %s detector", CONFIG_DETECTOR_DEFAULT);
+        err = this->switch_detector(CONFIG_DETECTOR_DEFAULT);
+    }
+    return err;
+}
+
+esp_err_t myapp::CameraApp::switch_detector(const char *name)
+{
+    // The running model goes first: two of them rarely fit in PSRAM at once.
+    char previous[sizeof(this->active_detector)] = "";
+    if (this->detector)
+    {
+        strlcpy(previous, this->detector->name(), sizeof(previous));
+        delete this->detector;
+        this->detector = nullptr;
+    }
+
+    int64_t start = esp_timer_get_time();
+    Detector *next = create_detector(name);
+    esp_err_t err = next ? next->load() : ESP_ERR_NOT_FOUND;
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to load the %s detector: 0x%x", name, err);
+        delete next;
+        if (previous[0] != '\0')
+        {
+            this->switch_detector(previous);
+        }
+        return err;
+    }
+    taskENTER_CRITICAL(&this->detector_lock);
+    jpeg_decoder::rect_t roi = this->roi;
+    strlcpy(this->active_detector, name, sizeof(this->active_detector));
+    taskEXIT_CRITICAL(&this->detector_lock);
+    next->set_roi(roi);
+    this->detector = next;
+    ESP_LOGI(TAG, "Detector %s loaded in %lld ms", name, (esp_timer_get_time() - start) / 1000);
     return ESP_OK;
 }
 
+void myapp::CameraApp::apply_pending()
+{
+    char name[sizeof(this->pending_detector)];
+    taskENTER_CRITICAL(&this->detector_lock);
+    strlcpy(name, this->pending_detector, sizeof(name));
+    this->pending_detector[0] = '\0';
+    jpeg_decoder::rect_t roi = this->roi;
+    bool roi_dirty = this->roi_dirty;
+    this->roi_dirty = false;
+    taskEXIT_CRITICAL(&this->detector_lock);
+
+    if (roi_dirty && this->detector)
+    {
+        this->detector->set_roi(roi);
+    }
+    if (name[0] == '\0' || (this->detector && strcmp(name, this->detector->name()) == 0))
+    {
+        return;
+    }
+
+#ifdef CONFIG_INFERENCE_PIPELINE
+    // The prepare task must not be inside the old detector; the next
+    // update() resumes the pipeline.
+    this->pipeline.pause();
+#endif
+    if (this->switch_detector(name) == ESP_OK)
+    {
+        esp_err_t err = this->save_detector_name(name);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to store detector: 0x%x", err);
+        }
+    }
+}
+
 httpd_handle_t myapp::CameraApp::start_http_server_task()
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = 80;
     config.ctrl_port = 32768;
+    // Every viewer keeps its socket open, leave room for the other endpoints.
+    config.max_open_sockets = StreamServer::MAX_CLIENTS + 3;
+    config.max_uri_handlers = 16;
+    config.task_priority = TASK_HTTPD.priority;
+    config.core_id = TASK_HTTPD.core;
+    config.stack_size = TASK_HTTPD.stack;
 
     httpd_handle_t server = NULL;
     if (httpd_start(&server, &config) == ESP_OK)
@@ -76,6 +320,99 @@ httpd_handle_t myapp::CameraApp::start_http_server_task()
             .handler = stream_handler,
             .user_ctx = this};
         httpd_register_uri_handler(server, &stream_uri);
+
+        httpd_uri_t stream_stats_uri = {
+            .uri = "/stream/stats",
+            .method = HTTP_GET,
+            .handler = stream_stats_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &stream_stats_uri);
+
+        httpd_uri_t stream_bench_uri = {
+            .uri = "/stream/bench",
+            .method = HTTP_GET,
+            .handler = stream_bench_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &stream_bench_uri);
+
+        httpd_uri_t wifi_profile_uri = {
+            .uri = "/wifi/profile",
+            .method = HTTP_GET,
+            .handler = wifi_profile_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &wifi_profile_uri);
+
+        httpd_uri_t detector_uri = {
+            .uri = "/detector",
+            .method = HTTP_GET,
+            .handler = detector_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &detector_uri);
+
+        // Snapshot Endpoint
+        httpd_uri_t capture_uri = {
+            .uri = "/capture",
+            .method = HTTP_GET,
+            .handler = capture_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &capture_uri);
+
+        httpd_uri_t metrics_uri = {
+            .uri = "/metrics",
+            .method = HTTP_GET,
+            .handler = metrics_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &metrics_uri);
+
+        httpd_uri_t bench_uri = {
+            .uri = "/bench",
+            .method = HTTP_GET,
+            .handler = bench_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &bench_uri);
+
+#if CONFIG_INFERENCE_TRACE
+        httpd_uri_t trace_uri = {
+            .uri = "/trace",
+            .method = HTTP_GET,
+            .handler = trace_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &trace_uri);
+#endif
+
+        httpd_uri_t roi_uri = {
+            .uri = "/roi",
+            .method = HTTP_GET,
+            .handler = roi_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &roi_uri);
+
+#ifdef CONFIG_INFERENCE_PIPELINE
+        httpd_uri_t pipeline_uri = {
+            .uri = "/pipeline",
+            .method = HTTP_GET,
+            .handler = pipeline_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &pipeline_uri);
+#endif
+
+#ifdef CONFIG_DETECTION_LOG
+        httpd_uri_t history_uri = {
+            .uri = "/history",
+            .method = HTTP_GET,
+            .handler = history_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &history_uri);
+#endif
+
+#ifdef CONFIG_TASK_STATS
+        httpd_uri_t tasks_uri = {
+            .uri = "/tasks",
+            .method = HTTP_GET,
+            .handler = tasks_handler,
+            .user_ctx = this};
+        httpd_register_uri_handler(server, &tasks_uri);
+#endif
     }
     return server;
 }
@@ -85,113 +422,782 @@ void myapp::CameraApp::run_inference_task(void *pvParameters)
     auto app = static_cast<myapp::CameraApp *>(pvParameters);
     while (1)
     {
+#ifdef CONFIG_INFERENCE_PIPELINE
+        if (app->pipeline.update(app->detector && app->detector->pipelined(), app->frame_hub.get_stats().captured))
+        {
+            // The prepare task took this frame on the other core while the
+            // model was busy with the previous one: decoded into the slot,
+            // or only timestamped when the motion gate stopped it.
+            int index;
+            pipeline_slot_t *slot = app->pipeline.acquire(index, pdMS_TO_TICKS(100));
+            if (!slot)
+            {
+                // No frame came out of the prepare task in time, e.g. the
+                // camera is slowed down or stalled, so /detector and /roi
+                // changes are applied here as well.
+                app->apply_pending();
+                continue;
+            }
+#ifdef CONFIG_MOTION_GATE
+            if (slot->gated)
+            {
+                app->repeat_scores(slot->frame_us);
+                app->pipeline.release(index);
+                app->apply_pending();
+                continue;
+            }
+#endif
+            int64_t start_infer = esp_timer_get_time();
+            if (slot->result.err == ESP_OK)
+            {
+                app->detector->infer(index, slot->result);
+            }
+            app->finish_inference(slot->result, slot->frame_us);
+            app->pipeline.release(index);
+#ifdef CONFIG_MOTION_GATE
+            app->motion_gate.account_inference(esp_timer_get_time() - start_infer);
+#endif
+            app->mark_boot(BOOT_FIRST_INFERENCE);
+            app->pipeline.frame_done();
+            app->apply_pending();
+            if (app->pipeline.get_stats().frames % CONFIG_FRAME_MAILBOX_STATS_INTERVAL == 0)
+            {
+                app->log_stats();
+            }
+            continue;
+        }
+#endif
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        if (app->inference_fb)
+        const camera_fb_t *fb = app->inference_mailbox.consume();
+        if (!fb)
         {
-            app->run_inference(app->inference_fb);
+            continue;
+        }
+        app->apply_pending();
 
-            // AI is finally done, NOW we return the buffer to the camera driver
-            esp_camera_fb_return(app->inference_fb);
-            app->inference_fb = NULL;
+#ifdef CONFIG_MOTION_GATE
+        if (app->passes_gate(fb))
+        {
+            int64_t start_infer = esp_timer_get_time();
+            app->run_inference(fb);
+            app->motion_gate.account_inference(esp_timer_get_time() - start_infer);
+            app->mark_boot(BOOT_FIRST_INFERENCE);
+        }
+        else
+        {
+            app->repeat_scores(frame_time_us(fb));
+        }
+#else
+        app->run_inference(fb);
+        app->mark_boot(BOOT_FIRST_INFERENCE);
+#endif
+#ifdef CONFIG_INFERENCE_PIPELINE
+        app->pipeline.frame_done();
+#endif
+
+        if (app->inference_mailbox.get_stats().consumed % CONFIG_FRAME_MAILBOX_STATS_INTERVAL == 0)
+        {
+            app->log_stats();
+        }
+    }
+}
+
+void myapp::CameraApp::log_stats()
+{
+    auto stats = this->inference_mailbox.get_stats();
+    ESP_LOGI(TAG, "Frames published: %lu, inferred: %lu, superseded: %lu, dropped: %lu, lag: %lu",
+             stats.published, stats.consumed, stats.superseded, stats.dropped, stats.last_lag);
+#ifdef CONFIG_INFERENCE_PIPELINE
+    auto pipelined = this->pipeline.get_stats();
+    ESP_LOGI(TAG, "Pipeline: %s, frames %lu, prepared %lu, skipped %lu, prepare waited %llu ms, infer waited %llu ms",
+             this->pipeline.active() ? "pipelined" : "sequential", pipelined.frames, pipelined.prepared,
+             pipelined.skipped, pipelined.prepare_wait_us / 1000, pipelined.infer_wait_us / 1000);
+#endif
+#ifdef CONFIG_MOTION_GATE
+    auto motion = this->motion_gate.get_stats();
+    ESP_LOGI(TAG, "Motion gate: checked %lu, skipped %lu, forced %lu, gate %llu ms, saved ~%llu ms",
+             motion.checked, motion.skipped, motion.forced, motion.gate_us / 1000, motion.saved_us / 1000);
+#endif
+#ifdef CONFIG_CLIP_RECORDER
+    auto clips = this->clip_recorder.get_stats();
+    ESP_LOGI(TAG, "Clips: %lu written, %lu frames, %llu KB, buffered %lu, overrun %lu, errors %lu",
+             clips.clips, clips.clip_frames, clips.bytes_written / 1024, clips.buffered, clips.overrun,
+             clips.write_errors);
+#endif
+#ifdef CONFIG_DETECTION_LOG
+    auto history = this->detection_log.get_stats();
+    ESP_LOGI(TAG, "Detection log: records %lu..%lu, appended %lu, dropped %lu, flushes %lu, erases %lu, laps %lu",
+             history.first_seq, history.next_seq, history.appended, history.dropped, history.flushes,
+             history.erases, history.laps);
+#endif
+#ifdef CONFIG_TRACKER
+    auto tracking = this->tracker.get_stats();
+    ESP_LOGI(TAG, "Tracker: created %lu, confirmed %lu, lost %lu, crossings %lu, update %lu us",
+             tracking.tracks_created, tracking.tracks_confirmed, tracking.tracks_lost, tracking.crossings,
+             tracking.update_us_avg);
+#endif
+#ifdef CONFIG_FRAME_RATE_CONTROL
+    auto rate = this->frame_rate.get_stats();
+    ESP_LOGI(TAG, "Frame rate: %s, sensor %.1f fps (%.1f at full rate), target %.1f fps, XCLK %d MHz, skip %u, "
+             "detector %lu us, changes %lu",
+             rate.full_rate ? "full" : "throttled", rate.sensor_fps, rate.full_fps, rate.target_fps, rate.xclk_mhz,
+             rate.skip, rate.service_us, rate.changes);
+#endif
+}
+
+#ifdef CONFIG_FRAME_RATE_CONTROL
+float myapp::CameraApp::frame_demand(void *ctx)
+{
+    // Runs in the frame rate task.
+    auto app = static_cast<myapp::CameraApp *>(ctx);
+    if (app->stream_server.camera_clients() > 0)
+    {
+        return FrameRateController::FULL_RATE;
+    }
+#ifdef CONFIG_INFERENCE_PIPELINE
+    if (app->pipeline.benchmarking())
+    {
+        return FrameRateController::FULL_RATE;
+    }
+#endif
+#ifdef CONFIG_CLIP_RECORDER
+    if (app->clips_ready)
+    {
+        return CONFIG_CLIP_FPS;
+    }
+#endif
+    return 0;
+}
+#endif
+
+void myapp::CameraApp::on_frame(SharedFrame *frame, void *ctx)
+{
+    // Runs in the capture task: the mailbox copies the frame, so inference
+    // never holds a driver buffer.
+    auto app = static_cast<myapp::CameraApp *>(ctx);
+    if (!app->inference_mailbox.publish(frame->fb()))
+    {
+        return;
+    }
+#ifdef CONFIG_INFERENCE_PIPELINE
+    if (app->pipeline.active())
+    {
+        app->pipeline.notify();
+        return;
+    }
+#endif
+    xTaskNotifyGive(app->ai_task_handler);
+}
+
+#ifdef CONFIG_INFERENCE_PIPELINE
+bool myapp::CameraApp::prepare_frame(pipeline_slot_t &slot, int index, void *ctx)
+{
+    // Runs in the prepare task. The detector is not swapped while it holds
+    // a slot, see InferencePipeline::pause().
+    auto app = static_cast<myapp::CameraApp *>(ctx);
+    const camera_fb_t *fb = app->inference_mailbox.consume();
+    if (!fb)
+    {
+        return false;
+    }
+    slot.frame_us = frame_time_us(fb);
+#ifdef CONFIG_MOTION_GATE
+    if (!app->passes_gate(fb))
+    {
+        // Handed on anyway: the event stage has to count the frame.
+        slot.gated = true;
+        return true;
+    }
+#endif
+    app->detector->prepare(fb, index, slot.result);
+    return true;
+}
+#endif
+
+#ifdef CONFIG_MOTION_GATE
+void myapp::CameraApp::repeat_scores(int64_t frame_us)
+{
+    // Inference task only, like every other update().
+    this->detection_events.update(this->last_scores, frame_us);
+}
+
+bool myapp::CameraApp::passes_gate(const camera_fb_t *fb)
+{
+#ifdef CONFIG_INFERENCE_PIPELINE
+    // A benchmark measures the model, not the scene.
+    if (this->pipeline.benchmarking())
+    {
+        return true;
+    }
+#endif
+    return this->motion_gate.check(fb);
+}
+#endif
+
+void myapp::CameraApp::on_detection_event(const detection_event_t &event, void *ctx)
+{
+    auto app = static_cast<myapp::CameraApp *>(ctx);
+    if (event.type == DETECTION_ENTER)
+    {
+        ESP_LOGI(TAG, "Event: %s entered at %lld ms (peak score %.2f)", event.class_name,
+                 event.timestamp_us / 1000, event.peak_score);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Event: %s left at %lld ms after %lu ms (peak score %.2f)", event.class_name,
+                 event.timestamp_us / 1000, event.duration_ms, event.peak_score);
+    }
+#ifdef CONFIG_CLIP_RECORDER
+    if (app->clips_ready)
+    {
+        if (event.type == DETECTION_ENTER)
+        {
+            app->clip_recorder.trigger(event.class_name, event.timestamp_us);
+        }
+        else
+        {
+            app->clip_recorder.release(event.timestamp_us);
         }
     }
+#endif
 }
 
 void myapp::CameraApp::run_inference(const camera_fb_t *fb)
 {
-#ifdef CONFIG_DETECTION_CAT_DETECT
-    uint32_t start_decode = esp_log_timestamp();
-    dl::image::jpeg_img_t jpeg_img = {
-        .data = fb->buf,
-        .data_len = fb->len,
-    };
-    auto img = dl::image::sw_decode_jpeg(jpeg_img, dl::image::DL_IMAGE_PIX_TYPE_RGB888);
-    uint32_t end_decode = esp_log_timestamp();
-    ESP_LOGI(TAG, "JPEG decode took %lu ms", end_decode - start_decode);
-
-    uint32_t start_infer = esp_log_timestamp();
-    auto &detect_results = detect->run(img);
-    uint32_t end_infer = esp_log_timestamp();
-    ESP_LOGI(TAG, "Inference took %lu ms", end_infer - start_infer);
-
-    for (const auto &res : detect_results)
-    {
-        ESP_LOGI(TAG,
-                 "[category: %d, score: %f, x1: %d, y1: %d, x2: %d, y2: %d]",
-                 res.category,
-                 res.score,
-                 res.box[0],
-                 res.box[1],
-                 res.box[2],
-                 res.box[3]);
-    }
-    heap_caps_free(img.data);
-#elifdef CONFIG_DETECTION_LITTER_ROBOT_TFLITE
-    uint32_t start_infer = esp_log_timestamp();
-    auto result = detect->run_inference(fb);
-    uint32_t end_infer = esp_log_timestamp();
-    ESP_LOGI(TAG, "Inference took %lu ms", end_infer - start_infer);
+    if (!this->detector)
+    {
+        return;
+    }
+    detector_result_t result;
+    this->detector->run(fb, result);
+    this->finish_inference(result, frame_time_us(fb));
+}
+
+void myapp::CameraApp::finish_inference(const detector_result_t &result, int64_t frame_us)
+{
     if (result.err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Inference error: 0x%x", result.err);
+        ESP_LOGE(TAG, "Detector %s error: 0x%x", this->detector->name(), result.err);
         return;
     }
-    else
+
+    // A stage the backend does not have is 0 and would only skew its histogram.
+    const struct
+    {
+        stage_t stage;
+        uint32_t us;
+    } stages[] = {
+        {STAGE_DECODE, result.decode_us},
+        {STAGE_PREPROCESS, result.preprocess_us},
+        {STAGE_INVOKE, result.invoke_us},
+        {STAGE_CLASSIFY, result.classify_us},
+        {STAGE_POSTPROCESS, result.postprocess_us},
+    };
+    StageMetrics &metrics = StageMetrics::instance();
+    for (const auto &stage : stages)
+    {
+        if (stage.us > 0)
+        {
+            metrics.record(stage.stage, stage.us);
+        }
+    }
+#ifdef CONFIG_FRAME_RATE_CONTROL
+    uint32_t prepare_us = result.decode_us + result.preprocess_us;
+    uint32_t model_us = result.invoke_us + result.classify_us + result.postprocess_us;
+    bool overlapped = false;
+#ifdef CONFIG_INFERENCE_PIPELINE
+    overlapped = this->pipeline.active();
+#endif
+    this->frame_rate.account_inference(overlapped ? std::max(prepare_us, model_us) : prepare_us + model_us);
+#endif
+
+    for (int i = 0; i < result.box_count; i++)
+    {
+        const detector_box_t &box = result.boxes[i];
+        TRACE_RECORD(TRACE_BOX, (uint16_t)(box.score * 1000), (uint32_t)box.x1, (uint32_t)box.y1, (uint32_t)box.x2,
+                     (uint32_t)box.y2);
+    }
+    if (result.label)
+    {
+        ESP_LOGD(TAG, "Predicted class: %s", result.label);
+    }
+#ifdef CONFIG_MOTION_GATE
+    memcpy(this->last_scores, result.scores, sizeof(this->last_scores));
+#endif
+    this->detection_events.update(result.scores, frame_us);
+#ifdef CONFIG_DETECTION_LOG
+    this->log_detection(result, frame_us);
+#endif
+
+#ifdef CONFIG_TRACKER
+    track_detection_t boxes[DETECTOR_MAX_BOXES];
+    for (int i = 0; i < result.box_count; i++)
     {
-        ESP_LOGI(TAG, "Predicted class: %s", result.predicted_class.c_str());
+        const detector_box_t &box = result.boxes[i];
+        boxes[i] = {.x1 = box.x1, .y1 = box.y1, .x2 = box.x2, .y2 = box.y2, .score = box.score};
+    }
+    this->tracker.update(boxes, result.box_count, frame_us);
+    const line_crossing_t *crossings;
+    int crossing_count = this->tracker.crossings(crossings);
+    for (int i = 0; i < crossing_count; i++)
+    {
+        ESP_LOGI(TAG, "Track %u crossed the line %s after %lu ms", crossings[i].id,
+                 crossings[i].direction > 0 ? "forward" : "backward", crossings[i].dwell_ms);
     }
 #endif
 }
 
-static esp_err_t myapp::stream_handler(httpd_req_t *req)
+#ifdef CONFIG_DETECTION_LOG
+void myapp::CameraApp::log_detection(const detector_result_t &result, int64_t frame_us)
 {
-    camera_fb_t *fb = NULL;
-    esp_err_t res = ESP_OK;
-    char *part_buf[64];
+    if (!this->detection_log_ready || frame_us - this->last_logged_us < CONFIG_DETECTION_LOG_INTERVAL_MS * 1000LL)
+    {
+        return;
+    }
+    // Which cat it is says more than that it is a cat.
+    int best = DETECTOR_CLASS_CAT;
+    for (int i = DETECTOR_CLASS_CAT + 1; i < DETECTOR_CLASS_COUNT; i++)
+    {
+        if (result.scores[i] >= CONFIG_DETECTION_LOG_MIN_SCORE / 100.0f && result.scores[i] > result.scores[best])
+        {
+            best = i;
+        }
+    }
+    if (result.scores[best] < CONFIG_DETECTION_LOG_MIN_SCORE / 100.0f)
+    {
+        return;
+    }
 
-    httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    detection_record_t record{};
+    record.class_id = best;
+    record.score = result.scores[best] * 1000;
+    record.latency_us = esp_timer_get_time() - frame_us;
+    const detector_box_t *box = nullptr;
+    for (int i = 0; i < result.box_count; i++)
+    {
+        if (!box || result.boxes[i].score > box->score)
+        {
+            box = &result.boxes[i];
+        }
+    }
+    if (box)
+    {
+        record.x1 = box->x1;
+        record.y1 = box->y1;
+        record.x2 = box->x2;
+        record.y2 = box->y2;
+    }
+    this->detection_log.append(record);
+    this->last_logged_us = frame_us;
+}
+#endif
 
-    while (true)
+esp_err_t myapp::CameraApp::load_roi(jpeg_decoder::rect_t &roi)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK)
     {
-        fb = esp_camera_fb_get();
-        if (!fb)
+        return err;
+    }
+    size_t len = sizeof(roi);
+    err = nvs_get_blob(handle, "roi", &roi, &len);
+    nvs_close(handle);
+    if (err == ESP_OK && len != sizeof(roi))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+esp_err_t myapp::CameraApp::save_roi(const jpeg_decoder::rect_t &roi)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_blob(handle, "roi", &roi, sizeof(roi));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t myapp::CameraApp::handle_bench(httpd_req_t *req)
+{
+    // GET /bench?test=decoder_setup|logging&n=100 runs a microbenchmark on a
+    // copy of the newest frame and reports the per-frame times as JSON.
+    char test[24] = "decoder_setup";
+    int iterations = 0;
+    char query[64];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        char value[8];
+        httpd_query_key_value(query, "test", test, sizeof(test));
+        if (httpd_query_key_value(query, "n", value, sizeof(value)) == ESP_OK)
         {
-            ESP_LOGE("HTTP", "Camera capture failed");
-            res = ESP_FAIL;
-            break;
+            iterations = std::clamp(atoi(value), 1, 1000);
         }
+    }
+    bool logging = strcmp(test, "logging") == 0;
+    if (!logging && strcmp(test, "decoder_setup") != 0)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown test");
+        return ESP_FAIL;
+    }
+    // Every logging iteration writes eight lines to the console, some 45 ms
+    // at 115200 baud, and the whole run blocks this httpd task. A handful is
+    // plenty to average a cost that size.
+    if (logging)
+    {
+        iterations = iterations ? std::min(iterations, 10) : 5;
+    }
+    else if (!iterations)
+    {
+        iterations = 100;
+    }
 
-        // 1. Send the boundary
-        res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+    SharedFrame *frame = this->frame_hub.acquire_latest();
+    if (!frame)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No frame captured yet");
+        return ESP_FAIL;
+    }
+    // A copy, so a long run does not hold a driver buffer.
+    size_t len = frame->fb()->len;
+    auto jpeg = (uint8_t *)heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (jpeg)
+    {
+        memcpy(jpeg, frame->fb()->buf, len);
+    }
+    frame->release();
+    if (!jpeg)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+
+    char buf[160];
+    if (logging)
+    {
+        inference_trace::logging_benchmark_t times;
+        inference_trace::benchmark_logging(jpeg, iterations, times);
+        heap_caps_free(jpeg);
+        snprintf(buf, sizeof(buf), "{\"test\":\"logging\",\"iterations\":%d,\"log_us\":%lu,\"trace_us\":%lu}",
+                 times.iterations, times.log_us, times.trace_us);
+        httpd_resp_set_type(req, "application/json");
+        return httpd_resp_sendstr(req, buf);
+    }
 
-        // 2. Send the header (JPEG length)
-        size_t hlen = snprintf((char *)part_buf, 64, _STREAM_PART, fb->len);
-        res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+    jpeg_decoder::setup_benchmark_t setup;
+    jpeg_error_t err = jpeg_decoder::benchmark_setup_overhead(jpeg, len, iterations, setup);
+    heap_caps_free(jpeg);
+    if (err != JPEG_ERR_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Decoder failed");
+        return ESP_FAIL;
+    }
+    snprintf(buf, sizeof(buf),
+             "{\"test\":\"decoder_setup\",\"iterations\":%d,\"reopen_us\":%lu,\"persistent_us\":%lu}",
+             setup.iterations, setup.reopen_us, setup.persistent_us);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
+
+// Reads `key` from the query into `out` when it is a whole number in
+// [0, max]; a missing key leaves `out` as it was.
+static bool parse_roi_value(const char *query, const char *key, long max, uint16_t &out)
+{
+    char value[8];
+    if (httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK)
+    {
+        return true;
+    }
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno != 0 || parsed < 0 || parsed > max)
+    {
+        return false;
+    }
+    out = (uint16_t)parsed;
+    return true;
+}
 
-        // 3. Send the actual JPEG data
-        res = httpd_resp_send_chunk(req, (const char *)fb->buf, fb->len);
+esp_err_t myapp::CameraApp::handle_roi(httpd_req_t *req)
+{
+    // GET /roi reports the current ROI; GET /roi?x=..&y=..&w=..&h=.. sets and
+    // stores it. w=0 or h=0 goes back to the whole frame.
+    taskENTER_CRITICAL(&this->detector_lock);
+    jpeg_decoder::rect_t roi = this->roi;
+    taskEXIT_CRITICAL(&this->detector_lock);
+    char query[64];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        const resolution_info_t &frame = resolution[camera_config.frame_size];
+        if (!parse_roi_value(query, "x", frame.width - 1, roi.x) ||
+            !parse_roi_value(query, "y", frame.height - 1, roi.y) ||
+            !parse_roi_value(query, "w", frame.width, roi.width) ||
+            !parse_roi_value(query, "h", frame.height, roi.height) || roi.x + roi.width > frame.width ||
+            roi.y + roi.height > frame.height)
+        {
+            char message[64];
+            snprintf(message, sizeof(message), "ROI must lie within the %ux%u frame", frame.width, frame.height);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, message);
+            return ESP_FAIL;
+        }
+        if (roi.width && roi.height && (roi.width < ROI_MIN_SIZE || roi.height < ROI_MIN_SIZE))
+        {
+            char message[64];
+            snprintf(message, sizeof(message), "ROI must be at least %ux%u", ROI_MIN_SIZE, ROI_MIN_SIZE);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, message);
+            return ESP_FAIL;
+        }
 
-        // --- HANDOVER LOGIC FOR AI ---
-        // If AI is idle, hand it this buffer.
-        // If AI is busy, we MUST return it now so the camera can reuse it.
-        if (app->inference_fb == NULL)
+        taskENTER_CRITICAL(&this->detector_lock);
+        this->roi = roi;
+        this->roi_dirty = true;
+        taskEXIT_CRITICAL(&this->detector_lock);
+        esp_err_t err = this->save_roi(roi);
+        if (err != ESP_OK)
         {
-            app->inference_fb = fb;
-            xTaskNotifyGive(app->ai_task_handler);
-            // We do NOT return fb here; inference_task will do it.
+            ESP_LOGE(TAG, "Failed to store ROI: 0x%x", err);
         }
-        else
+    }
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), "{\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d}", roi.x, roi.y, roi.width, roi.height);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
+
+esp_err_t myapp::CameraApp::load_detector_name(char *name, size_t len)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_get_str(handle, "detector", name, &len);
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t myapp::CameraApp::save_detector_name(const char *name)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_str(handle, "detector", name);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t myapp::CameraApp::handle_detector(httpd_req_t *req)
+{
+    // GET /detector reports the active detector and the ones compiled in;
+    // ?name=... switches on the inference task before its next frame. The
+    // model load takes a moment, poll /detector to see it become active.
+    char query[48];
+    char name[sizeof(this->pending_detector)];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "name", name, sizeof(name)) == ESP_OK)
+    {
+        bool known = false;
+        for (size_t i = 0; i < detector_count(); i++)
         {
-            esp_camera_fb_return(fb);
+            known |= strcmp(name, detector_name(i)) == 0;
         }
+        if (!known)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown detector");
+            return ESP_FAIL;
+        }
+        taskENTER_CRITICAL(&this->detector_lock);
+        strlcpy(this->pending_detector, name, sizeof(this->pending_detector));
+        taskEXIT_CRITICAL(&this->detector_lock);
+        ESP_LOGI(TAG, "Switching to the %s detector", name);
+    }
+
+    char active[sizeof(this->active_detector)];
+    taskENTER_CRITICAL(&this->detector_lock);
+    strlcpy(active, this->active_detector, sizeof(active));
+    strlcpy(name, this->pending_detector, sizeof(name));
+    taskEXIT_CRITICAL(&this->detector_lock);
+
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "{\"active\":\"%s\",\"pending\":\"%s\",\"available\":[", active, name);
+    for (size_t i = 0; i < detector_count() && len < (int)sizeof(buf); i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s\"%s\"", i ? "," : "", detector_name(i));
+    }
+    if (len < (int)sizeof(buf))
+    {
+        snprintf(buf + len, sizeof(buf) - len, "]}");
+    }
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
 
-        if (res != ESP_OK)
-            break;
+esp_err_t myapp::CameraApp::handle_wifi_profile(httpd_req_t *req)
+{
+    // GET /wifi/profile reports the active profile; ?name=max|balanced|low_power
+    // switches to it. The response goes out before the switch because a
+    // bandwidth or protocol change reassociates.
+    wifi_profile_t profile = this->wifi->get_profile();
+    char query[32];
+    char name[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "name", name, sizeof(name)) == ESP_OK &&
+        !WifiManager::parse_profile(name, profile))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown profile");
+        return ESP_FAIL;
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{\"profile\":\"%s\"}", WifiManager::profile_name(profile));
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t res = httpd_resp_sendstr(req, buf);
+    esp_err_t err = this->wifi->set_profile(profile);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to switch WiFi profile: 0x%x", err);
     }
     return res;
 }
 
+static esp_err_t myapp::stream_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+#ifdef CONFIG_FRAME_RATE_CONTROL
+    app->frame_rate.request_full_rate();
+#endif
+    return app->stream_server.handle(req, WifiManager::profile_name(app->wifi->get_profile()));
+}
+
+static esp_err_t myapp::stream_stats_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->stream_server.handle_stats(req, WifiManager::profile_name(app->wifi->get_profile()));
+}
+
+static esp_err_t myapp::stream_bench_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->stream_server.handle_bench(req, WifiManager::profile_name(app->wifi->get_profile()));
+}
+
+static esp_err_t myapp::wifi_profile_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->handle_wifi_profile(req);
+}
+
+static esp_err_t myapp::detector_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->handle_detector(req);
+}
+
+static esp_err_t myapp::capture_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    SharedFrame *frame = app->frame_hub.acquire_latest();
+    if (!frame)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No frame captured yet");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    esp_err_t res = httpd_resp_send(req, (const char *)frame->fb()->buf, frame->fb()->len);
+    frame->release();
+    return res;
+}
+
+static esp_err_t myapp::metrics_handler(httpd_req_t *req)
+{
+    return StageMetrics::instance().handle(req);
+}
+
+static esp_err_t myapp::bench_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->handle_bench(req);
+}
+
+#if CONFIG_INFERENCE_TRACE
+static esp_err_t myapp::trace_handler(httpd_req_t *req)
+{
+    // Raw inference_trace::record_t array, oldest first.
+    auto records = (inference_trace::record_t *)heap_caps_malloc(
+        CONFIG_INFERENCE_TRACE_RECORDS * sizeof(inference_trace::record_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!records)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    size_t count = inference_trace::snapshot(records, CONFIG_INFERENCE_TRACE_RECORDS);
+
+    char overwritten[12];
+    snprintf(overwritten, sizeof(overwritten), "%lu", inference_trace::overwritten());
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "X-Trace-Overwritten", overwritten);
+    esp_err_t res = httpd_resp_send(req, (const char *)records, count * sizeof(inference_trace::record_t));
+    heap_caps_free(records);
+    return res;
+}
+#endif
+
+static esp_err_t myapp::roi_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->handle_roi(req);
+}
+
+#ifdef CONFIG_INFERENCE_PIPELINE
+static esp_err_t myapp::pipeline_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->pipeline.handle(req);
+}
+#endif
+
+#ifdef CONFIG_DETECTION_LOG
+static esp_err_t myapp::history_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    if (!app->detection_log_ready)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Detection log unavailable");
+        return ESP_FAIL;
+    }
+    return app->detection_log.handle_history(req);
+}
+#endif
+
+#ifdef CONFIG_TASK_STATS
+static esp_err_t myapp::tasks_handler(httpd_req_t *req)
+{
+    auto app = static_cast<myapp::CameraApp *>(req->user_ctx);
+    return app->task_monitor.handle(req);
+}
+#endif
+
 extern "C" void app_main()
 {
     // Initialize NVS
@@ -204,19 +1210,7 @@ extern "C" void app_main()
     ESP_ERROR_CHECK(ret);
 
     static myapp::CameraApp camera_app;
-
-    myapp::WifiManager wifi_manager = myapp::WifiManager("chi-ngao", "khongcopass");
-    wifi_manager.setup_wifi();
-
-    esp_err_t err = camera_app.setup_camera();
-    camera_app.setup_model();
+    static myapp::WifiManager wifi_manager("chi-ngao", "khongcopass");
     ESP_LOGI(myapp::CameraApp::TAG, "Running with cpp");
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(myapp::CameraApp::TAG, "Camera init failed with error 0x%x", err);
-        return;
-    }
-
-    xTaskCreatePinnedToCore(myapp::CameraApp::run_inference_task, "ai_task", 16384, &camera_app, tskIDLE_PRIORITY, &camera_app.ai_task_handler, 1);
-    camera_app.start_http_server_task();
-}
\ No newline at end of file
+    camera_app.boot(wifi_manager);
+}
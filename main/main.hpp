@@ -7,22 +7,72 @@
 #include "freertos/FreeRTOS.h"
 #include "driver/gpio.h"
 #include "wifi_manager.hpp"
-#include "nvs_flash.h"
-#ifdef CONFIG_DETECTION_CAT_DETECT
-#include "cat_detect.hpp"
-#include "dl_image_jpeg.hpp"
-#elif defined(CONFIG_DETECTION_LITTER_ROBOT_TFLITE)
-#include "litter_robot_detect.hpp"
+#include "frame_mailbox.hpp"
+#include "frame_hub.hpp"
+#include "stream_server.hpp"
+#include "motion_gate.hpp"
+#include "detection_events.hpp"
+#include "object_tracker.hpp"
+#ifdef CONFIG_CLIP_RECORDER
+#include "clip_recorder.hpp"
+#endif
+#ifdef CONFIG_DETECTION_LOG
+#include "detection_log.hpp"
+#endif
+#ifdef CONFIG_INFERENCE_PIPELINE
+#include "inference_pipeline.hpp"
 #endif
+#ifdef CONFIG_TASK_STATS
+#include "task_monitor.hpp"
+#endif
+#ifdef CONFIG_FRAME_RATE_CONTROL
+#include "frame_rate.hpp"
+#endif
+#include "stage_metrics.hpp"
+#include "inference_trace.hpp"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "detector.hpp"
 #include "esp_http_server.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include <string.h>
 
 namespace myapp
 {
     static esp_err_t stream_handler(httpd_req_t *req);
-#define PART_BOUNDARY "123456789000000000000987654321"
-    static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-    static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-    static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+    static esp_err_t stream_stats_handler(httpd_req_t *req);
+    static esp_err_t stream_bench_handler(httpd_req_t *req);
+    static esp_err_t wifi_profile_handler(httpd_req_t *req);
+    static esp_err_t detector_handler(httpd_req_t *req);
+    static esp_err_t capture_handler(httpd_req_t *req);
+    static esp_err_t metrics_handler(httpd_req_t *req);
+    static esp_err_t bench_handler(httpd_req_t *req);
+#if CONFIG_INFERENCE_TRACE
+    static esp_err_t trace_handler(httpd_req_t *req);
+#endif
+    static esp_err_t roi_handler(httpd_req_t *req);
+#ifdef CONFIG_INFERENCE_PIPELINE
+    static esp_err_t pipeline_handler(httpd_req_t *req);
+#endif
+#ifdef CONFIG_DETECTION_LOG
+    static esp_err_t history_handler(httpd_req_t *req);
+#endif
+#ifdef CONFIG_TASK_STATS
+    static esp_err_t tasks_handler(httpd_req_t *req);
+#endif
+
+    typedef enum
+    {
+        BOOT_WIFI_STARTED,
+        BOOT_NETWORK_UP,
+        BOOT_CAMERA_READY,
+        BOOT_MODEL_READY,
+        BOOT_PIPELINE_STARTED,
+        BOOT_HTTP_STARTED,
+        BOOT_FIRST_INFERENCE,
+        BOOT_PHASE_COUNT,
+    } boot_phase_t;
 
     class CameraApp
     {
@@ -32,18 +82,109 @@ namespace myapp
         esp_err_t setup_camera();
         esp_err_t setup_model();
         httpd_handle_t start_http_server_task();
+
+        // Boot runs as three independent threads of work: WiFi association
+        // (driven by the event loop), camera + model setup on core 1, and
+        // app_main, which starts each dependent service as soon as what it
+        // needs is ready. A failed camera or model setup leaves the pipeline
+        // stopped, but HTTP still starts so the failure can be looked into.
+        esp_err_t boot(WifiManager &wifi);
+        esp_err_t start_pipeline();
+        static void init_task(void *pvParameters);
+        static void on_network_ready(const esp_netif_ip_info_t &ip_info, void *ctx);
+        void mark_boot(boot_phase_t phase);
         static void run_inference_task(void *pvParameters);
+        static void on_frame(SharedFrame *frame, void *ctx);
+        static void on_detection_event(const detection_event_t &event, void *ctx);
         static constexpr const char *TAG = "camera_app";
         void run_inference(const camera_fb_t *fb);
+        void finish_inference(const detector_result_t &result, int64_t frame_us);
+        void log_stats();
+        static int64_t frame_time_us(const camera_fb_t *fb)
+        {
+            return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        }
         TaskHandle_t ai_task_handler;
-        camera_fb_t *inference_fb;
+        FrameMailbox inference_mailbox;
+        FrameHub frame_hub;
+        StreamServer stream_server{frame_hub};
+#ifdef CONFIG_FRAME_RATE_CONTROL
+        FrameRateController frame_rate{frame_hub};
+        static float frame_demand(void *ctx);
+#endif
+        DetectionEvents detection_events{DETECTOR_CLASS_NAMES, DETECTOR_CLASS_COUNT};
+#ifdef CONFIG_MOTION_GATE
+        MotionGate motion_gate;
+        bool passes_gate(const camera_fb_t *fb);
+        // Scores of the last inferred frame, repeated into the event stage for
+        // frames the gate skips so a still scene still fills the window.
+        float last_scores[DETECTOR_CLASS_COUNT]{};
+        void repeat_scores(int64_t frame_us);
+#endif
+#ifdef CONFIG_INFERENCE_PIPELINE
+        InferencePipeline pipeline;
+        static bool prepare_frame(pipeline_slot_t &slot, int index, void *ctx);
+#endif
+#ifdef CONFIG_CLIP_RECORDER
+        ClipRecorder clip_recorder;
+        bool clips_ready{false};
+#endif
+#ifdef CONFIG_DETECTION_LOG
+        DetectionLog detection_log;
+        bool detection_log_ready{false};
+#endif
+#ifdef CONFIG_TASK_STATS
+        TaskMonitor task_monitor;
+#endif
+        esp_err_t handle_roi(httpd_req_t *req);
+        esp_err_t handle_detector(httpd_req_t *req);
+        esp_err_t handle_bench(httpd_req_t *req);
+        esp_err_t handle_wifi_profile(httpd_req_t *req);
+        WifiManager *wifi{nullptr};
 
     private:
-#ifdef CONFIG_DETECTION_CAT_DETECT
-        CatDetect *detect;
-#elif defined(CONFIG_DETECTION_LITTER_ROBOT_TFLITE)
-        litter_robot_detect::CatDetect *detect;
+        static constexpr const char *NVS_NAMESPACE = "camera_app";
+        static constexpr EventBits_t BOOT_NETWORK_BIT = BIT0;
+        static constexpr EventBits_t BOOT_INIT_DONE_BIT = BIT1;
+        static constexpr const char *BOOT_PHASE_NAMES[BOOT_PHASE_COUNT] = {
+            "wifi started", "network up", "camera ready", "model ready",
+            "pipeline started", "http started", "first inference"};
+
+        EventGroupHandle_t boot_events{nullptr};
+        esp_err_t init_result{ESP_OK};
+        int64_t boot_us[BOOT_PHASE_COUNT]{};
+#ifdef CONFIG_TRACKER
+        ObjectTracker tracker;
+#endif
+#ifdef CONFIG_DETECTION_LOG
+        bool sntp_started{false};
+        int64_t last_logged_us{0};
+        void log_detection(const detector_result_t &result, int64_t frame_us);
 #endif
+
+        // The detector is only touched by the inference task. /detector and
+        // /roi leave their change under detector_lock and the task applies
+        // it before its next frame.
+        Detector *detector{nullptr};
+        portMUX_TYPE detector_lock = portMUX_INITIALIZER_UNLOCKED;
+        char active_detector[16]{};
+        char pending_detector[16]{};
+        bool roi_dirty{false};
+        esp_err_t switch_detector(const char *name);
+        void apply_pending();
+
+        // The ROI is kept in NVS so a setting made through /roi survives a
+        // reboot and a detector switch; the Kconfig values are only the
+        // initial default. Backends that look at the whole frame ignore it.
+        jpeg_decoder::rect_t roi{CONFIG_LITTER_ROBOT_ROI_X, CONFIG_LITTER_ROBOT_ROI_Y,
+                                 CONFIG_LITTER_ROBOT_ROI_WIDTH, CONFIG_LITTER_ROBOT_ROI_HEIGHT};
+        // An eighth of the smallest model input (96x96): anything smaller is
+        // upscaled more than the 1/8 DCT scale step can make up for.
+        static constexpr uint16_t ROI_MIN_SIZE = 12;
+        esp_err_t load_roi(jpeg_decoder::rect_t &roi);
+        esp_err_t save_roi(const jpeg_decoder::rect_t &roi);
+        esp_err_t load_detector_name(char *name, size_t len);
+        esp_err_t save_detector_name(const char *name);
         uint8_t current_tick = 0;
         static constexpr gpio_config_t io_config = gpio_config_t{
             .pin_bit_mask = (1ULL << CAM_PIN_FLASH),
@@ -76,7 +217,7 @@ namespace myapp
             .pixel_format = PIXFORMAT_JPEG,
             .frame_size = FRAMESIZE_VGA,
             .jpeg_quality = 12,
-            .fb_count = 2,
+            .fb_count = CONFIG_CAMERA_FB_COUNT,
             .fb_location = CAMERA_FB_IN_PSRAM,
             .grab_mode = CAMERA_GRAB_WHEN_EMPTY,
             .sccb_i2c_port = 0};
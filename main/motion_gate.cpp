@@ -0,0 +1,115 @@
+#include "motion_gate.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdlib.h>
+
+myapp::MotionGate::~MotionGate()
+{
+    heap_caps_free(this->background);
+    this->background = nullptr;
+}
+
+esp_err_t myapp::MotionGate::init()
+{
+    // An 8x8 minimum lets the decoder pick the largest usable scale.
+    if (this->decoder.configure(JPEG_PIXEL_FORMAT_GRAY, 8, 8, false) != JPEG_ERR_OK)
+    {
+        ESP_LOGE(TAG, "Failed to configure JPEG decoder");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+bool myapp::MotionGate::check(const camera_fb_t *fb)
+{
+    int64_t start = esp_timer_get_time();
+    this->stats.checked++;
+
+    jpeg_decoder::decoded_image_t image;
+    jpeg_error_t err = this->decoder.decode(fb->buf, fb->len, image);
+    if (err != JPEG_ERR_OK)
+    {
+        ESP_LOGW(TAG, "JPEG decode failed with error %d, passing frame", err);
+        this->since_passed = 0;
+        return true;
+    }
+
+    bool pass;
+    if ((size_t)image.width * image.height != this->pixels)
+    {
+        // First frame or a resolution change: nothing to compare against yet.
+        pass = true;
+        this->stats.last_changed = 1000;
+        if (!this->reset_background(image))
+        {
+            this->stats.gate_us += esp_timer_get_time() - start;
+            return true;
+        }
+    }
+    else
+    {
+        uint32_t changed = 0;
+        for (size_t i = 0; i < this->pixels; i++)
+        {
+            int luma = image.data[i];
+            int diff = luma - (this->background[i] >> 8);
+            if (abs(diff) > CONFIG_MOTION_GATE_PIXEL_THRESHOLD)
+            {
+                changed++;
+            }
+            // Running average: background += (frame - background) / 2^shift.
+            int32_t bg = this->background[i];
+            this->background[i] = bg + (((luma << 8) - bg) >> CONFIG_MOTION_GATE_BACKGROUND_SHIFT);
+        }
+        this->stats.last_changed = changed * 1000 / this->pixels;
+        pass = this->stats.last_changed >= CONFIG_MOTION_GATE_AREA_PERMILLE;
+    }
+
+    if (!pass && CONFIG_MOTION_GATE_MAX_SKIP > 0 && this->since_passed >= CONFIG_MOTION_GATE_MAX_SKIP)
+    {
+        pass = true;
+        this->stats.forced++;
+    }
+
+    if (pass)
+    {
+        this->since_passed = 0;
+    }
+    else
+    {
+        this->since_passed++;
+        this->stats.skipped++;
+        this->stats.saved_us += this->stats.inference_us_avg;
+    }
+    this->stats.gate_us += esp_timer_get_time() - start;
+    return pass;
+}
+
+void myapp::MotionGate::account_inference(uint32_t inference_us)
+{
+    // Exponential moving average over roughly the last 8 inferences.
+    this->stats.inference_us_avg = this->stats.inference_us_avg == 0
+                                       ? inference_us
+                                       : this->stats.inference_us_avg + ((int32_t)inference_us - (int32_t)this->stats.inference_us_avg) / 8;
+}
+
+bool myapp::MotionGate::reset_background(const jpeg_decoder::decoded_image_t &image)
+{
+    size_t pixels = (size_t)image.width * image.height;
+    uint16_t *background = (uint16_t *)heap_caps_realloc(this->background, pixels * sizeof(uint16_t),
+                                                         MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!background)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %ux%u background", image.width, image.height);
+        return false;
+    }
+    this->background = background;
+    this->pixels = pixels;
+    for (size_t i = 0; i < pixels; i++)
+    {
+        this->background[i] = image.data[i] << 8;
+    }
+    ESP_LOGI(TAG, "Background reset at %dx%d (1/%d)", image.width, image.height, image.scale_denom);
+    return true;
+}
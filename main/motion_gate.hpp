@@ -0,0 +1,57 @@
+#pragma once
+
+#include "esp_camera.h"
+#include "esp_err.h"
+#include "jpeg_decoder.hpp"
+
+namespace myapp
+{
+    typedef struct
+    {
+        uint32_t checked{0};          // frames looked at by the gate
+        uint32_t skipped{0};          // frames that did not reach the model
+        uint32_t forced{0};           // frames passed only because of MOTION_GATE_MAX_SKIP
+        uint32_t last_changed{0};     // changed pixels in the last frame, per mille
+        uint64_t gate_us{0};          // total time spent decoding and differencing
+        uint64_t saved_us{0};         // estimated inference time not spent on skipped frames
+        uint32_t inference_us_avg{0}; // moving average the saving is estimated from
+    } motion_stats_t;
+
+    // Cheap change detector in front of the model. Each frame is decoded to
+    // grayscale at the coarsest DCT scale esp_new_jpeg allows (1/8, or 1/4
+    // when 1/8 would not give a multiple of 8, e.g. 160x120 for VGA) and
+    // compared with a running-average background. Only frames where enough
+    // pixels changed are passed on; every CONFIG_MOTION_GATE_MAX_SKIP frames
+    // one is passed regardless so a scene that stopped moving is still
+    // re-evaluated.
+    class MotionGate
+    {
+    public:
+        MotionGate() = default;
+        ~MotionGate();
+        MotionGate(const MotionGate &) = delete;
+        MotionGate &operator=(const MotionGate &) = delete;
+
+        esp_err_t init();
+
+        // Returns true if the frame should go to the model. Decode errors fail
+        // open so a broken gate never hides frames.
+        bool check(const camera_fb_t *fb);
+
+        // Feeds the measured inference time into the saved-time estimate.
+        void account_inference(uint32_t inference_us);
+
+        motion_stats_t get_stats() const { return this->stats; }
+
+    private:
+        static constexpr const char *TAG{"motion_gate"};
+
+        jpeg_decoder::JpegDecoder decoder;
+        uint16_t *background{nullptr}; // 8.8 fixed point luma
+        size_t pixels{0};
+        uint32_t since_passed{0};
+        motion_stats_t stats{};
+
+        bool reset_background(const jpeg_decoder::decoded_image_t &image);
+    };
+} // namespace myapp
@@ -0,0 +1,329 @@
+#include "object_tracker.hpp"
+#include "esp_timer.h"
+#include <algorithm>
+#include <stdlib.h>
+
+namespace
+{
+    constexpr int Q = 16;
+    constexpr int32_t ONE = 1 << Q;
+
+    // Noise terms in px^2 and (px/frame)^2. Detector boxes jitter by a few
+    // pixels; cats accelerate slowly compared to the inference rate.
+    constexpr int32_t MEASUREMENT_NOISE = 16 * ONE;
+    constexpr int32_t POSITION_NOISE = 1 * ONE;
+    constexpr int32_t VELOCITY_NOISE = ONE / 4;
+    constexpr int32_t INITIAL_VELOCITY_VARIANCE = 100 * ONE;
+    // Keeps the covariance of long unmatched tracks inside 32 bits.
+    constexpr int32_t MAX_VARIANCE = 30000 * ONE;
+
+    int32_t q_mul(int32_t a, int32_t b)
+    {
+        return (int32_t)(((int64_t)a * b) >> Q);
+    }
+
+    int32_t q_div(int32_t a, int32_t b)
+    {
+        return (int32_t)(((int64_t)a << Q) / b);
+    }
+
+    int16_t to_px(int32_t q)
+    {
+        return (int16_t)((q + ONE / 2) >> Q);
+    }
+} // namespace
+
+myapp::ObjectTracker::ObjectTracker()
+{
+    this->set_line(CONFIG_TRACKER_LINE_X1, CONFIG_TRACKER_LINE_Y1, CONFIG_TRACKER_LINE_X2, CONFIG_TRACKER_LINE_Y2);
+}
+
+void myapp::ObjectTracker::set_line(int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+{
+    this->line[0] = x1;
+    this->line[1] = y1;
+    this->line[2] = x2;
+    this->line[3] = y2;
+    for (auto &slot : this->slots)
+    {
+        slot.side = 0;
+    }
+}
+
+void myapp::ObjectTracker::update(const track_detection_t *detections, int count, int64_t timestamp_us)
+{
+    int64_t start = esp_timer_get_time();
+    count = std::min(count, MAX_TRACKS);
+    this->crossing_count = 0;
+
+    for (auto &slot : this->slots)
+    {
+        if (slot.used)
+        {
+            predict(slot.cx);
+            predict(slot.cy);
+        }
+    }
+
+    // Greedy assignment, best pair first. With at most MAX_TRACKS on each
+    // side this is cheaper than the Hungarian method and gives the same
+    // answer whenever the boxes are not contested.
+    int iou[MAX_TRACKS][MAX_TRACKS];
+    for (int t = 0; t < MAX_TRACKS; t++)
+    {
+        for (int d = 0; d < count; d++)
+        {
+            iou[t][d] = this->slots[t].used ? iou_permille(this->slots[t], detections[d]) : -1;
+        }
+    }
+    bool track_matched[MAX_TRACKS]{};
+    bool det_matched[MAX_TRACKS]{};
+    while (true)
+    {
+        int best = CONFIG_TRACKER_IOU_PERMILLE - 1, best_t = -1, best_d = -1;
+        for (int t = 0; t < MAX_TRACKS; t++)
+        {
+            for (int d = 0; d < count; d++)
+            {
+                if (!track_matched[t] && !det_matched[d] && iou[t][d] > best)
+                {
+                    best = iou[t][d];
+                    best_t = t;
+                    best_d = d;
+                }
+            }
+        }
+        if (best_t < 0)
+        {
+            break;
+        }
+        track_matched[best_t] = det_matched[best_d] = true;
+        this->correct_track(this->slots[best_t], detections[best_d], timestamp_us);
+    }
+
+    // Fast movers at a low frame rate may not overlap their prediction at
+    // all; accept a detection whose centre is within half the track size.
+    for (int t = 0; t < MAX_TRACKS; t++)
+    {
+        slot_t &slot = this->slots[t];
+        if (!slot.used || track_matched[t])
+        {
+            continue;
+        }
+        int32_t cx = to_px(slot.cx.pos), cy = to_px(slot.cy.pos);
+        int32_t reach = std::max(to_px(slot.width), to_px(slot.height)) / 2;
+        int32_t best = reach * reach + 1;
+        int best_d = -1;
+        for (int d = 0; d < count; d++)
+        {
+            if (det_matched[d])
+            {
+                continue;
+            }
+            int32_t dx = (detections[d].x1 + detections[d].x2) / 2 - cx;
+            int32_t dy = (detections[d].y1 + detections[d].y2) / 2 - cy;
+            if (dx * dx + dy * dy < best)
+            {
+                best = dx * dx + dy * dy;
+                best_d = d;
+            }
+        }
+        if (best_d >= 0)
+        {
+            track_matched[t] = det_matched[best_d] = true;
+            this->correct_track(slot, detections[best_d], timestamp_us);
+        }
+    }
+
+    for (int t = 0; t < MAX_TRACKS; t++)
+    {
+        slot_t &slot = this->slots[t];
+        if (!slot.used || track_matched[t])
+        {
+            continue;
+        }
+        slot.misses++;
+        // Tentative tracks die on their first miss, confirmed ones coast.
+        if (!slot.confirmed || slot.misses > CONFIG_TRACKER_MAX_AGE)
+        {
+            this->stats.tracks_lost += slot.confirmed ? 1 : 0;
+            slot.used = false;
+        }
+    }
+
+    for (int d = 0; d < count; d++)
+    {
+        if (det_matched[d])
+        {
+            continue;
+        }
+        for (auto &slot : this->slots)
+        {
+            if (!slot.used)
+            {
+                this->start_track(slot, detections[d], timestamp_us);
+                break;
+            }
+        }
+    }
+
+    this->stats.updates++;
+    uint32_t update_us = esp_timer_get_time() - start;
+    // Exponential moving average over roughly the last 16 updates.
+    this->stats.update_us_avg = this->stats.updates == 1
+                                    ? update_us
+                                    : this->stats.update_us_avg + ((int32_t)update_us - (int32_t)this->stats.update_us_avg) / 16;
+}
+
+int myapp::ObjectTracker::tracks(track_t *out, int max) const
+{
+    int n = 0;
+    for (const auto &slot : this->slots)
+    {
+        if (!slot.used || !slot.confirmed || n >= max)
+        {
+            continue;
+        }
+        int32_t half_w = slot.width / 2, half_h = slot.height / 2;
+        out[n++] = {
+            .id = slot.id,
+            .x1 = to_px(slot.cx.pos - half_w),
+            .y1 = to_px(slot.cy.pos - half_h),
+            .x2 = to_px(slot.cx.pos + half_w),
+            .y2 = to_px(slot.cy.pos + half_h),
+            .hits = slot.hits,
+            .misses = slot.misses,
+            .first_seen_us = slot.first_seen_us,
+            .last_seen_us = slot.last_seen_us,
+        };
+    }
+    return n;
+}
+
+void myapp::ObjectTracker::init_axis(axis_filter_t &axis, q16_t measured)
+{
+    axis = {
+        .pos = measured,
+        .vel = 0,
+        .p_pp = MEASUREMENT_NOISE,
+        .p_pv = 0,
+        .p_vv = INITIAL_VELOCITY_VARIANCE,
+    };
+}
+
+void myapp::ObjectTracker::predict(axis_filter_t &axis)
+{
+    // x = F x, P = F P F' + Q with F = [[1, 1], [0, 1]]
+    // Each term is already near MAX_VARIANCE on a track that coasts for
+    // long, so the sums are taken in 64 bits and clamped from there.
+    axis.pos += axis.vel;
+    int64_t p_pp = (int64_t)axis.p_pp + 2 * (int64_t)axis.p_pv + axis.p_vv + POSITION_NOISE;
+    int64_t p_pv = (int64_t)axis.p_pv + axis.p_vv;
+    axis.p_pp = (q16_t)std::min<int64_t>(p_pp, MAX_VARIANCE);
+    axis.p_pv = (q16_t)std::clamp<int64_t>(p_pv, -MAX_VARIANCE, MAX_VARIANCE);
+    axis.p_vv = std::min(axis.p_vv + VELOCITY_NOISE, MAX_VARIANCE);
+}
+
+void myapp::ObjectTracker::correct(axis_filter_t &axis, q16_t measured)
+{
+    // Position only measurement, H = [1, 0].
+    q16_t s = axis.p_pp + MEASUREMENT_NOISE;
+    q16_t k_pos = q_div(axis.p_pp, s);
+    q16_t k_vel = q_div(axis.p_pv, s);
+    q16_t innovation = measured - axis.pos;
+    axis.pos += q_mul(k_pos, innovation);
+    axis.vel += q_mul(k_vel, innovation);
+    axis.p_vv -= q_mul(k_vel, axis.p_pv);
+    axis.p_pp -= q_mul(k_pos, axis.p_pp);
+    axis.p_pv -= q_mul(k_pos, axis.p_pv);
+}
+
+int myapp::ObjectTracker::iou_permille(const slot_t &slot, const track_detection_t &det)
+{
+    int32_t half_w = slot.width / 2, half_h = slot.height / 2;
+    int32_t tx1 = to_px(slot.cx.pos - half_w), tx2 = to_px(slot.cx.pos + half_w);
+    int32_t ty1 = to_px(slot.cy.pos - half_h), ty2 = to_px(slot.cy.pos + half_h);
+    int32_t ix = std::min<int32_t>(tx2, det.x2) - std::max<int32_t>(tx1, det.x1);
+    int32_t iy = std::min<int32_t>(ty2, det.y2) - std::max<int32_t>(ty1, det.y1);
+    if (ix <= 0 || iy <= 0)
+    {
+        return 0;
+    }
+    int32_t inter = ix * iy;
+    int32_t area = (tx2 - tx1) * (ty2 - ty1) + (det.x2 - det.x1) * (det.y2 - det.y1) - inter;
+    return area > 0 ? inter * 1000 / area : 0;
+}
+
+void myapp::ObjectTracker::start_track(slot_t &slot, const track_detection_t &det, int64_t timestamp_us)
+{
+    slot = {};
+    slot.used = true;
+    slot.id = this->next_id++;
+    if (this->next_id == 0)
+    {
+        this->next_id = 1;
+    }
+    init_axis(slot.cx, ((det.x1 + det.x2) << Q) / 2);
+    init_axis(slot.cy, ((det.y1 + det.y2) << Q) / 2);
+    slot.width = (det.x2 - det.x1) << Q;
+    slot.height = (det.y2 - det.y1) << Q;
+    slot.hits = 1;
+    slot.first_seen_us = timestamp_us;
+    slot.last_seen_us = timestamp_us;
+    slot.side = this->line_side(slot);
+    this->stats.tracks_created++;
+    if (CONFIG_TRACKER_MIN_HITS <= 1)
+    {
+        slot.confirmed = true;
+        this->stats.tracks_confirmed++;
+    }
+}
+
+void myapp::ObjectTracker::correct_track(slot_t &slot, const track_detection_t &det, int64_t timestamp_us)
+{
+    correct(slot.cx, ((det.x1 + det.x2) << Q) / 2);
+    correct(slot.cy, ((det.y1 + det.y2) << Q) / 2);
+    // Box size is not part of the motion model, a running average is enough.
+    slot.width += (((det.x2 - det.x1) << Q) - slot.width) / 4;
+    slot.height += (((det.y2 - det.y1) << Q) - slot.height) / 4;
+    slot.hits++;
+    slot.misses = 0;
+    slot.last_seen_us = timestamp_us;
+    if (!slot.confirmed && slot.hits >= CONFIG_TRACKER_MIN_HITS)
+    {
+        slot.confirmed = true;
+        this->stats.tracks_confirmed++;
+    }
+
+    int8_t side = this->line_side(slot);
+    if (side == 0)
+    {
+        return;
+    }
+    if (slot.confirmed && slot.side != 0 && side != slot.side)
+    {
+        this->last_crossings[this->crossing_count++] = {
+            .id = slot.id,
+            .direction = side,
+            .timestamp_us = timestamp_us,
+            .dwell_ms = (uint32_t)((timestamp_us - slot.first_seen_us) / 1000),
+        };
+        this->stats.crossings++;
+    }
+    slot.side = side;
+}
+
+int8_t myapp::ObjectTracker::line_side(const slot_t &slot) const
+{
+    int32_t lx = this->line[2] - this->line[0], ly = this->line[3] - this->line[1];
+    if (lx == 0 && ly == 0)
+    {
+        return 0;
+    }
+    // Sign of the cross product of the line direction and the centre
+    // relative to the first end point. Image y points down, so positive is
+    // to the right when looking from p1 to p2.
+    int64_t cross = (int64_t)lx * (to_px(slot.cy.pos) - this->line[1]) -
+                    (int64_t)ly * (to_px(slot.cx.pos) - this->line[0]);
+    return cross > 0 ? 1 : (cross < 0 ? -1 : 0);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "sdkconfig.h"
+#include <stdint.h>
+
+namespace myapp
+{
+    // One detector box for the current frame, in frame pixels.
+    typedef struct
+    {
+        int16_t x1, y1, x2, y2;
+        float score;
+    } track_detection_t;
+
+    typedef struct
+    {
+        uint16_t id;            // stable for the life of the track, never reused before wrapping
+        int16_t x1, y1, x2, y2; // filtered box, frame pixels
+        uint16_t hits;          // frames matched to a detection
+        uint16_t misses;        // consecutive frames without a match
+        int64_t first_seen_us;
+        int64_t last_seen_us;
+    } track_t;
+
+    typedef struct
+    {
+        uint16_t id;
+        int8_t direction; // +1 crossed from the left of the line to the right (looking from p1 to p2), -1 back
+        int64_t timestamp_us;
+        uint32_t dwell_ms; // time the track had existed when it crossed
+    } line_crossing_t;
+
+    typedef struct
+    {
+        uint32_t updates{0};
+        uint32_t tracks_created{0};
+        uint32_t tracks_confirmed{0};
+        uint32_t tracks_lost{0};
+        uint32_t crossings{0};
+        uint32_t update_us_avg{0};
+    } tracker_stats_t;
+
+    // SORT-style multi-object tracker. Every track carries a constant-velocity
+    // Kalman filter per centre axis in Q16.16 fixed point (position and
+    // velocity, dt = one inferred frame) and a smoothed box size. Each frame
+    // the tracks are predicted forward, matched to detections greedily by
+    // IoU, then by centre distance for boxes that moved too far to overlap,
+    // and corrected with the matched box. A track is reported once it was
+    // matched CONFIG_TRACKER_MIN_HITS times and dropped after
+    // CONFIG_TRACKER_MAX_AGE frames without a match.
+    class ObjectTracker
+    {
+    public:
+        static constexpr int MAX_TRACKS = CONFIG_TRACKER_MAX_TRACKS;
+
+        ObjectTracker();
+
+        // Runs one tracking step. Extra detections beyond MAX_TRACKS are ignored.
+        void update(const track_detection_t *detections, int count, int64_t timestamp_us);
+
+        // Copies the confirmed tracks into out; returns how many were written.
+        int tracks(track_t *out, int max) const;
+
+        // Crossings of the counting line produced by the last update().
+        int crossings(const line_crossing_t *&out) const
+        {
+            out = this->last_crossings;
+            return this->crossing_count;
+        }
+
+        // A line with both ends equal disables crossing detection.
+        void set_line(int16_t x1, int16_t y1, int16_t x2, int16_t y2);
+
+        tracker_stats_t get_stats() const { return this->stats; }
+
+    private:
+        typedef int32_t q16_t;
+
+        typedef struct
+        {
+            q16_t pos;
+            q16_t vel;
+            // Covariance [[p_pp, p_pv], [p_pv, p_vv]]
+            q16_t p_pp;
+            q16_t p_pv;
+            q16_t p_vv;
+        } axis_filter_t;
+
+        typedef struct
+        {
+            bool used;
+            bool confirmed;
+            int8_t side;
+            uint16_t id;
+            axis_filter_t cx;
+            axis_filter_t cy;
+            q16_t width;
+            q16_t height;
+            uint16_t hits;
+            uint16_t misses;
+            int64_t first_seen_us;
+            int64_t last_seen_us;
+        } slot_t;
+
+        slot_t slots[MAX_TRACKS]{};
+        line_crossing_t last_crossings[MAX_TRACKS]{};
+        int crossing_count{0};
+        int16_t line[4]{};
+        uint16_t next_id{1};
+        tracker_stats_t stats{};
+
+        static void predict(axis_filter_t &axis);
+        static void correct(axis_filter_t &axis, q16_t measured);
+        static void init_axis(axis_filter_t &axis, q16_t measured);
+        static int iou_permille(const slot_t &slot, const track_detection_t &det);
+        void start_track(slot_t &slot, const track_detection_t &det, int64_t timestamp_us);
+        void correct_track(slot_t &slot, const track_detection_t &det, int64_t timestamp_us);
+        int8_t line_side(const slot_t &slot) const;
+    };
+} // namespace myapp
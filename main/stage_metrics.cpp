@@ -0,0 +1,109 @@
+#include "stage_metrics.hpp"
+#include <stdio.h>
+
+void myapp::LatencyHistogram::record(uint32_t us)
+{
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT && us > BOUNDS_US[bucket])
+    {
+        bucket++;
+    }
+    taskENTER_CRITICAL(&this->lock);
+    this->data.buckets[bucket]++;
+    this->data.count++;
+    this->data.sum_us += us;
+    taskEXIT_CRITICAL(&this->lock);
+}
+
+myapp::LatencyHistogram::snapshot_t myapp::LatencyHistogram::snapshot()
+{
+    taskENTER_CRITICAL(&this->lock);
+    snapshot_t copy = this->data;
+    taskEXIT_CRITICAL(&this->lock);
+    return copy;
+}
+
+uint32_t myapp::LatencyHistogram::percentile(const snapshot_t &snapshot, int pct)
+{
+    if (snapshot.count == 0)
+    {
+        return 0;
+    }
+    // Rank of the sample we are after, 1-based.
+    uint32_t rank = ((uint64_t)snapshot.count * pct + 99) / 100;
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    uint32_t seen = 0;
+    for (int i = 0; i <= BUCKET_COUNT; i++)
+    {
+        uint32_t in_bucket = snapshot.buckets[i];
+        if (seen + in_bucket >= rank)
+        {
+            if (i == BUCKET_COUNT)
+            {
+                // Nothing to interpolate towards past the last bound.
+                return BOUNDS_US[BUCKET_COUNT - 1];
+            }
+            uint32_t lower = i == 0 ? 0 : BOUNDS_US[i - 1];
+            uint32_t upper = BOUNDS_US[i];
+            return lower + (uint64_t)(upper - lower) * (rank - seen) / in_bucket;
+        }
+        seen += in_bucket;
+    }
+    return BOUNDS_US[BUCKET_COUNT - 1];
+}
+
+myapp::StageMetrics &myapp::StageMetrics::instance()
+{
+    static StageMetrics metrics;
+    return metrics;
+}
+
+esp_err_t myapp::StageMetrics::handle(httpd_req_t *req)
+{
+    static const int QUANTILES[] = {50, 95, 99};
+    char buf[160];
+    LatencyHistogram::snapshot_t snapshots[STAGE_COUNT];
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        snapshots[stage] = this->histograms[stage].snapshot();
+    }
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_sendstr_chunk(req, "# HELP camera_stage_latency_us Pipeline stage latency in microseconds.\n"
+                                  "# TYPE camera_stage_latency_us histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        const LatencyHistogram::snapshot_t &snapshot = snapshots[stage];
+        const char *name = STAGE_NAMES[stage];
+        uint32_t cumulative = 0;
+        for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; i++)
+        {
+            cumulative += snapshot.buckets[i];
+            snprintf(buf, sizeof(buf), "camera_stage_latency_us_bucket{stage=\"%s\",le=\"%lu\"} %lu\n", name,
+                     LatencyHistogram::BOUNDS_US[i], cumulative);
+            httpd_resp_sendstr_chunk(req, buf);
+        }
+        snprintf(buf, sizeof(buf),
+                 "camera_stage_latency_us_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+                 "camera_stage_latency_us_sum{stage=\"%s\"} %llu\n"
+                 "camera_stage_latency_us_count{stage=\"%s\"} %lu\n",
+                 name, snapshot.count, name, snapshot.sum_us, name, snapshot.count);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+
+    httpd_resp_sendstr_chunk(req, "# HELP camera_stage_latency_quantile_us Latency percentiles estimated from the histogram buckets.\n"
+                                  "# TYPE camera_stage_latency_quantile_us gauge\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        for (int pct : QUANTILES)
+        {
+            snprintf(buf, sizeof(buf), "camera_stage_latency_quantile_us{stage=\"%s\",quantile=\"0.%02d\"} %lu\n",
+                     STAGE_NAMES[stage], pct, LatencyHistogram::percentile(snapshots[stage], pct));
+            httpd_resp_sendstr_chunk(req, buf);
+        }
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
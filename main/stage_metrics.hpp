@@ -0,0 +1,87 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+namespace myapp
+{
+    typedef enum
+    {
+        STAGE_CAPTURE,      // waiting for and taking a frame from the driver
+        STAGE_DECODE,       // JPEG decode for the model
+        STAGE_PREPROCESS,   // resize/crop/quantize into the model input
+        STAGE_INVOKE,       // model execution
+        STAGE_CLASSIFY,     // cascade classifier on a detector crop
+        STAGE_POSTPROCESS,  // turning model outputs into a result
+        STAGE_HTTP_SEND,    // writing one MJPEG part to a /stream client
+        STAGE_WIFI_CONNECT, // first attempt or link loss until an IP is assigned
+        STAGE_COUNT,
+    } stage_t;
+
+    // Fixed bucket latency histogram. Bucket bounds follow a 1-2-5 series
+    // from 10 us to 10 s; record() is a few increments under a spinlock, so
+    // it can be called from any task on the hot path.
+    class LatencyHistogram
+    {
+    public:
+        static constexpr int BUCKET_COUNT = 19;
+        static constexpr uint32_t BOUNDS_US[BUCKET_COUNT] = {
+            10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000,
+            20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000};
+
+        typedef struct
+        {
+            uint32_t buckets[BUCKET_COUNT + 1]{}; // last bucket is +Inf
+            uint32_t count{0};
+            uint64_t sum_us{0};
+        } snapshot_t;
+
+        void record(uint32_t us);
+        snapshot_t snapshot();
+
+        // Estimated percentile (0-100), interpolated linearly inside the
+        // bucket it falls in.
+        static uint32_t percentile(const snapshot_t &snapshot, int pct);
+
+    private:
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        snapshot_t data{};
+    };
+
+    // Process-wide per-stage latency histograms, served in Prometheus text
+    // format from /metrics.
+    class StageMetrics
+    {
+    public:
+        static StageMetrics &instance();
+
+        void record(stage_t stage, uint32_t us) { this->histograms[stage].record(us); }
+        LatencyHistogram::snapshot_t snapshot(stage_t stage) { return this->histograms[stage].snapshot(); }
+
+        // httpd handler body for /metrics.
+        esp_err_t handle(httpd_req_t *req);
+
+    private:
+        static constexpr const char *TAG{"stage_metrics"};
+        static constexpr const char *STAGE_NAMES[STAGE_COUNT] = {
+            "capture", "decode", "preprocess", "invoke", "classify", "postprocess", "http_send", "wifi_connect"};
+
+        LatencyHistogram histograms[STAGE_COUNT];
+    };
+
+    // Records the time between construction and destruction as one sample.
+    class StageSpan
+    {
+    public:
+        explicit StageSpan(stage_t stage) : stage(stage), start(esp_timer_get_time()) {}
+        ~StageSpan() { StageMetrics::instance().record(this->stage, esp_timer_get_time() - this->start); }
+        StageSpan(const StageSpan &) = delete;
+        StageSpan &operator=(const StageSpan &) = delete;
+
+    private:
+        stage_t stage;
+        int64_t start;
+    };
+} // namespace myapp
@@ -0,0 +1,492 @@
+#include "stream_server.hpp"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "stage_metrics.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+esp_err_t myapp::StreamServer::start(const task_config_t &task)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        client_t &client = this->clients[i];
+        client.server = this;
+        client.frames = new FrameQueue(1);
+
+        char name[16];
+        snprintf(name, sizeof(name), "%s%d", task.name, i);
+        if (xTaskCreatePinnedToCore(client_task, name, task.stack, &client, task.priority, &client.task, task.core) != pdPASS)
+        {
+            ESP_LOGE(TAG, "Failed to create %s", name);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+bool myapp::StreamServer::parse_mode(const char *value, stream_send_mode_t &mode)
+{
+    if (strcmp(value, "chunked") == 0)
+    {
+        mode = STREAM_SEND_CHUNKED;
+    }
+    else if (strcmp(value, "writev") == 0)
+    {
+        mode = STREAM_SEND_WRITEV;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+esp_err_t myapp::StreamServer::handle(httpd_req_t *req, const char *wifi_profile)
+{
+    stream_send_mode_t mode = static_cast<stream_send_mode_t>(CONFIG_STREAM_SEND_MODE);
+    char query[32];
+    char value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "mode", value, sizeof(value)) == ESP_OK && !parse_mode(value, mode))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "mode must be chunked or writev");
+        return ESP_FAIL;
+    }
+
+    client_t *client = this->reserve_client(req);
+    if (!client)
+    {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    client->mode = mode;
+    client->wifi_profile = wifi_profile;
+    client->bench_frame_len = 0;
+    return this->detach(*client, req);
+}
+
+esp_err_t myapp::StreamServer::handle_bench(httpd_req_t *req, const char *wifi_profile)
+{
+    stream_send_mode_t mode = static_cast<stream_send_mode_t>(CONFIG_STREAM_SEND_MODE);
+    size_t frame_len = 32 * 1024;
+    uint32_t seconds = 10;
+    char query[64];
+    char value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "mode", value, sizeof(value)) == ESP_OK && !parse_mode(value, mode))
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "mode must be chunked or writev");
+            return ESP_FAIL;
+        }
+        if (httpd_query_key_value(query, "size", value, sizeof(value)) == ESP_OK)
+        {
+            frame_len = std::clamp<size_t>(atoi(value), 1024, BENCH_MAX_FRAME);
+        }
+        if (httpd_query_key_value(query, "seconds", value, sizeof(value)) == ESP_OK)
+        {
+            seconds = std::clamp(atoi(value), 1, 600);
+        }
+    }
+
+    client_t *client = this->reserve_client(req);
+    if (!client)
+    {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    client->mode = mode;
+    client->wifi_profile = wifi_profile;
+    client->bench_frame_len = frame_len;
+    client->bench_seconds = seconds;
+    return this->detach(*client, req);
+}
+
+myapp::StreamServer::client_t *myapp::StreamServer::reserve_client(httpd_req_t *req)
+{
+    client_t *client = nullptr;
+    taskENTER_CRITICAL(&this->clients_lock);
+    for (auto &candidate : this->clients)
+    {
+        if (!candidate.req && candidate.task)
+        {
+            client = &candidate;
+            // Reserve the slot before leaving the critical section.
+            client->req = req;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&this->clients_lock);
+
+    if (!client)
+    {
+        ESP_LOGW(TAG, "Rejecting stream client, %d already connected", MAX_CLIENTS);
+    }
+    return client;
+}
+
+esp_err_t myapp::StreamServer::detach(client_t &client, httpd_req_t *req)
+{
+    httpd_req_t *async_req = nullptr;
+    esp_err_t err = httpd_req_async_handler_begin(req, &async_req);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to detach stream request: 0x%x", err);
+        client.req = nullptr;
+        return err;
+    }
+
+    client.req = async_req;
+    xTaskNotifyGive(client.task);
+    return ESP_OK;
+}
+
+esp_err_t myapp::StreamServer::handle_stats(httpd_req_t *req, const char *wifi_profile)
+{
+    char buf[352];
+    httpd_resp_set_type(req, "application/json");
+    snprintf(buf, sizeof(buf),
+             "{\"wifi_profile\":\"%s\",\"bench_mbps\":%.2f,\"bench_wifi_profile\":\"%s\",\"clients\":[", wifi_profile,
+             this->bench_mbps, this->bench_profile);
+    httpd_resp_sendstr_chunk(req, buf);
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        stream_client_stats_t stats = this->get_client_stats(i);
+        snprintf(buf, sizeof(buf),
+                 "%s{\"slot\":%d,\"active\":%s,\"mode\":\"%s\",\"frames_sent\":%lu,\"frames_dropped\":%lu,"
+                 "\"bytes_sent\":%llu,\"fps\":%.2f,\"bytes_per_sec\":%.0f,\"send_us_avg\":%lu,\"send_cpu_us_avg\":%lu,"
+                 "\"synthetic\":%s,\"wifi_profile\":\"%s\"}",
+                 i ? "," : "", i, stats.active ? "true" : "false",
+                 stats.mode == STREAM_SEND_WRITEV ? "writev" : "chunked", stats.frames_sent,
+                 stats.frames_dropped, stats.bytes_sent, stats.fps, stats.bytes_per_sec, stats.send_us_avg,
+                 stats.send_cpu_us_avg, stats.synthetic ? "true" : "false", stats.wifi_profile);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "]}");
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+myapp::stream_client_stats_t myapp::StreamServer::get_client_stats(int slot) const
+{
+    return this->clients[slot].stats;
+}
+
+int myapp::StreamServer::active_clients() const
+{
+    int count = 0;
+    for (const auto &client : this->clients)
+    {
+        if (client.stats.active)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+int myapp::StreamServer::camera_clients() const
+{
+    int count = 0;
+    for (const auto &client : this->clients)
+    {
+        if (client.stats.active && !client.stats.synthetic)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+void myapp::StreamServer::client_task(void *pvParameters)
+{
+    auto client = static_cast<client_t *>(pvParameters);
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        client->server->serve(*client);
+    }
+}
+
+void myapp::StreamServer::serve(client_t &client)
+{
+    httpd_req_t *req = client.req;
+    client.stats = {};
+    client.stats.active = true;
+    client.stats.mode = client.mode;
+    client.stats.synthetic = client.bench_frame_len != 0;
+    client.stats.wifi_profile = client.wifi_profile;
+    client.window_frames = 0;
+    client.window_bytes = 0;
+    client.window_start = esp_timer_get_time();
+
+    if (client.bench_frame_len)
+    {
+        this->serve_bench(client);
+    }
+    else
+    {
+        this->serve_camera(client);
+    }
+
+    ESP_LOGI(TAG, "Stream client closed after %lu frames", client.stats.frames_sent);
+    httpd_handle_t handle = req->handle;
+    int sockfd = httpd_req_to_sockfd(req);
+    httpd_req_async_handler_complete(req);
+    if (client.mode == STREAM_SEND_WRITEV)
+    {
+        // httpd never saw a response on this socket, so it has to be told to close it.
+        httpd_sess_trigger_close(handle, sockfd);
+    }
+    client.stats.active = false;
+    client.stats.fps = 0;
+    client.stats.bytes_per_sec = 0;
+    client.req = nullptr;
+}
+
+void myapp::StreamServer::serve_camera(client_t &client)
+{
+    int subscription = this->hub.subscribe(FrameQueue::sink, client.frames);
+    if (subscription < 0)
+    {
+        ESP_LOGW(TAG, "No free frame subscription for stream client");
+        httpd_resp_set_status(client.req, "503 Service Unavailable");
+        httpd_resp_send(client.req, NULL, 0);
+        return;
+    }
+
+    if (this->send_headers(client) == ESP_OK)
+    {
+        while (true)
+        {
+            SharedFrame *frame = client.frames->receive(pdMS_TO_TICKS(5000));
+            if (!frame)
+            {
+                ESP_LOGE(TAG, "Camera capture timed out");
+                break;
+            }
+
+            size_t len = frame->fb()->len;
+            int64_t send_start = esp_timer_get_time();
+            uint64_t cpu_start = task_cpu_us();
+            esp_err_t res = this->send_frame(client, frame->fb());
+            uint64_t send_cpu_us = task_cpu_us() - cpu_start;
+            int64_t send_us = esp_timer_get_time() - send_start;
+            StageMetrics::instance().record(STAGE_HTTP_SEND, send_us);
+            frame->release();
+            if (res != ESP_OK)
+            {
+                break;
+            }
+            this->account(client, len, send_us, send_cpu_us);
+            client.stats.frames_dropped = client.frames->overwritten();
+        }
+    }
+
+    this->hub.unsubscribe(subscription);
+    client.frames->drain();
+}
+
+void myapp::StreamServer::serve_bench(client_t &client)
+{
+    camera_fb_t fb = {};
+    fb.len = client.bench_frame_len;
+    fb.buf = (uint8_t *)heap_caps_malloc(fb.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!fb.buf)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %u byte benchmark frame", fb.len);
+        httpd_resp_set_status(client.req, "503 Service Unavailable");
+        httpd_resp_send(client.req, NULL, 0);
+        return;
+    }
+    // JPEG markers around a pseudo random payload: viewers accept the parts
+    // and nothing on the way can compress them.
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < fb.len; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        fb.buf[i] = seed >> 24;
+    }
+    fb.buf[0] = 0xff;
+    fb.buf[1] = 0xd8;
+    fb.buf[fb.len - 2] = 0xff;
+    fb.buf[fb.len - 1] = 0xd9;
+
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)client.bench_seconds * 1000000;
+    int64_t now = start;
+    if (this->send_headers(client) == ESP_OK)
+    {
+        while (now < deadline)
+        {
+            uint64_t cpu_start = task_cpu_us();
+            esp_err_t res = this->send_frame(client, &fb);
+            uint64_t send_cpu_us = task_cpu_us() - cpu_start;
+            int64_t send_us = esp_timer_get_time() - now;
+            if (res != ESP_OK)
+            {
+                break;
+            }
+            this->account(client, fb.len, send_us, send_cpu_us);
+            now = esp_timer_get_time();
+        }
+    }
+    heap_caps_free(fb.buf);
+
+    int64_t elapsed = now - start;
+    if (elapsed > 0 && client.stats.bytes_sent)
+    {
+        // bits per microsecond is Mbit/s
+        this->bench_mbps = client.stats.bytes_sent * 8.0f / elapsed;
+        this->bench_profile = client.wifi_profile;
+        ESP_LOGI(TAG, "Benchmark: %lu frames of %u bytes in %lld ms, %.2f Mbps (%s, %s WiFi profile)",
+                 client.stats.frames_sent, fb.len, elapsed / 1000, this->bench_mbps,
+                 client.mode == STREAM_SEND_WRITEV ? "writev" : "chunked", client.wifi_profile);
+    }
+}
+
+esp_err_t myapp::StreamServer::send_headers(client_t &client)
+{
+    if (client.mode == STREAM_SEND_CHUNKED)
+    {
+        return httpd_resp_set_type(client.req, _STREAM_CONTENT_TYPE);
+    }
+
+    // The raw socket path bypasses chunked transfer encoding, so the response
+    // line and headers are written by hand and the stream ends at close.
+    static const char *headers = "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+                                 "Cache-Control: no-cache\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n";
+    int sockfd = httpd_req_to_sockfd(client.req);
+    size_t len = strlen(headers);
+    if (send(sockfd, headers, len, 0) != (ssize_t)len)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t myapp::StreamServer::send_frame(client_t &client, const camera_fb_t *fb)
+{
+    if (client.mode == STREAM_SEND_WRITEV)
+    {
+        return this->send_frame_writev(httpd_req_to_sockfd(client.req), fb);
+    }
+    return this->send_frame_chunked(client.req, fb);
+}
+
+esp_err_t myapp::StreamServer::send_frame_writev(int sockfd, const camera_fb_t *fb)
+{
+    // Boundary and part header share one small stack buffer; the JPEG is sent
+    // straight from the frame buffer, so nothing is copied out of PSRAM.
+    char part_buf[96];
+    size_t blen = strlen(_STREAM_BOUNDARY);
+    memcpy(part_buf, _STREAM_BOUNDARY, blen);
+    size_t hlen = blen + snprintf(part_buf + blen, sizeof(part_buf) - blen, _STREAM_PART, fb->len);
+
+    struct iovec iov[2] = {
+        {.iov_base = part_buf, .iov_len = hlen},
+        {.iov_base = fb->buf, .iov_len = fb->len},
+    };
+    struct iovec *pending = iov;
+    int iovcnt = 2;
+    int64_t deadline = esp_timer_get_time() + SEND_TIMEOUT_US;
+    while (iovcnt > 0)
+    {
+        if (esp_timer_get_time() > deadline)
+        {
+            ESP_LOGW(TAG, "Stream client too slow, closing");
+            return ESP_FAIL;
+        }
+        // httpd sets SO_SNDTIMEO on its sockets, so EAGAIN means the viewer
+        // stopped reading for that long: give the slot up rather than spin.
+        ssize_t written = writev(sockfd, pending, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ESP_LOGW(TAG, "Stream send failed: errno %d", errno);
+            return ESP_FAIL;
+        }
+
+        // Skip past whatever the stack accepted and retry the remainder.
+        while (iovcnt > 0 && (size_t)written >= pending->iov_len)
+        {
+            written -= pending->iov_len;
+            pending++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            pending->iov_base = (uint8_t *)pending->iov_base + written;
+            pending->iov_len -= written;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t myapp::StreamServer::send_frame_chunked(httpd_req_t *req, const camera_fb_t *fb)
+{
+    char part_buf[64];
+
+    // 1. Send the boundary
+    esp_err_t res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+
+    // 2. Send the header (JPEG length)
+    if (res == ESP_OK)
+    {
+        size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_PART, fb->len);
+        res = httpd_resp_send_chunk(req, part_buf, hlen);
+    }
+
+    // 3. Send the actual JPEG data
+    if (res == ESP_OK)
+    {
+        res = httpd_resp_send_chunk(req, (const char *)fb->buf, fb->len);
+    }
+    return res;
+}
+
+uint64_t myapp::StreamServer::task_cpu_us()
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_RUN_TIME_COUNTER_CLK_ESP_TIMER
+    return ulTaskGetRunTimeCounter(NULL);
+#else
+    return 0;
+#endif
+}
+
+void myapp::StreamServer::account(client_t &client, size_t bytes, int64_t send_us, int64_t send_cpu_us)
+{
+    // Exponential moving average over roughly the last 16 frames.
+    client.stats.send_us_avg = client.stats.frames_sent == 0
+                                   ? send_us
+                                   : client.stats.send_us_avg + (send_us - (int64_t)client.stats.send_us_avg) / 16;
+    client.stats.send_cpu_us_avg =
+        client.stats.frames_sent == 0
+            ? send_cpu_us
+            : client.stats.send_cpu_us_avg + (send_cpu_us - (int64_t)client.stats.send_cpu_us_avg) / 16;
+
+    client.stats.frames_sent++;
+    client.stats.bytes_sent += bytes;
+    client.window_frames++;
+    client.window_bytes += bytes;
+
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = now - client.window_start;
+    if (elapsed >= RATE_WINDOW_US)
+    {
+        client.stats.fps = client.window_frames * 1e6f / elapsed;
+        client.stats.bytes_per_sec = client.window_bytes * 1e6f / elapsed;
+        client.window_frames = 0;
+        client.window_bytes = 0;
+        client.window_start = now;
+    }
+}
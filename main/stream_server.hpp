@@ -0,0 +1,120 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "frame_hub.hpp"
+#include "task_config.hpp"
+
+namespace myapp
+{
+#define PART_BOUNDARY "123456789000000000000987654321"
+    static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
+    static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
+    static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+
+    typedef enum
+    {
+        STREAM_SEND_CHUNKED, // three httpd_resp_send_chunk() calls per frame
+        STREAM_SEND_WRITEV,  // one writev() of part header + JPEG on the raw socket
+    } stream_send_mode_t;
+
+    typedef struct
+    {
+        bool active{false};
+        stream_send_mode_t mode{STREAM_SEND_CHUNKED};
+        uint32_t frames_sent{0};
+        uint32_t frames_dropped{0};
+        uint64_t bytes_sent{0};
+        float fps{0};
+        float bytes_per_sec{0};
+        uint32_t send_us_avg{0}; // time spent in the send path per frame
+        // Run time of the sender task across the same send call, without
+        // what lwIP's own task does for it. Not the cost of the frame alone:
+        // a viewer that reads slowly forces partial writes and every retry
+        // adds to it. 0 unless FreeRTOS run time stats count in us.
+        uint32_t send_cpu_us_avg{0};
+        bool synthetic{false};   // /stream/bench client
+        const char *wifi_profile{""}; // WiFi profile active when the client connected
+    } stream_client_stats_t;
+
+    // Serves /stream to up to CONFIG_STREAM_MAX_CLIENTS viewers. Each request
+    // is detached from the httpd worker with httpd_req_async_handler_begin()
+    // and handed to its own sender task, which is fed from the FrameHub
+    // through a one-deep FrameQueue: a slow viewer skips frames instead of
+    // holding up capture or the other viewers.
+    //
+    // The send mode defaults to CONFIG_STREAM_SEND_MODE and can be overridden
+    // per request with /stream?mode=chunked or /stream?mode=writev, so both
+    // paths can be compared side by side in /stream/stats.
+    //
+    // /stream/bench sends a fixed synthetic frame back to back instead of
+    // camera frames, so the result measures the WiFi and TCP path alone:
+    //   curl -o /dev/null "http://<ip>/stream/bench?seconds=10&size=32768"
+    class StreamServer
+    {
+    public:
+        static constexpr int MAX_CLIENTS = CONFIG_STREAM_MAX_CLIENTS;
+
+        explicit StreamServer(FrameHub &hub) : hub(hub) {}
+        esp_err_t start(const task_config_t &task);
+
+        // httpd handler bodies. wifi_profile names the active WiFi profile;
+        // it is reported with the numbers so runs can be told apart.
+        //
+        // /stream
+        esp_err_t handle(httpd_req_t *req, const char *wifi_profile);
+        // /stream/stats, per-client fps and bytes/sec as JSON
+        esp_err_t handle_stats(httpd_req_t *req, const char *wifi_profile);
+        // /stream/bench?seconds=&size=&mode=
+        esp_err_t handle_bench(httpd_req_t *req, const char *wifi_profile);
+
+        stream_client_stats_t get_client_stats(int slot) const;
+        int active_clients() const;
+        // Active clients showing camera frames, so not /stream/bench.
+        int camera_clients() const;
+        // Sustained rate of the last completed benchmark, 0 if none ran yet.
+        float last_bench_mbps() const { return this->bench_mbps; }
+
+    private:
+        static constexpr const char *TAG{"stream_server"};
+        static constexpr int64_t RATE_WINDOW_US = 1000000;
+        static constexpr size_t BENCH_MAX_FRAME = 256 * 1024;
+        static constexpr int64_t SEND_TIMEOUT_US = 10000000; // one frame, however many writes it takes
+
+        typedef struct
+        {
+            StreamServer *server;
+            TaskHandle_t task;
+            httpd_req_t *req;
+            stream_send_mode_t mode;
+            const char *wifi_profile;
+            size_t bench_frame_len; // 0 for a camera stream
+            uint32_t bench_seconds;
+            FrameQueue *frames;
+            stream_client_stats_t stats;
+            uint32_t window_frames;
+            uint64_t window_bytes;
+            int64_t window_start;
+        } client_t;
+
+        FrameHub &hub;
+        client_t clients[MAX_CLIENTS]{};
+        portMUX_TYPE clients_lock = portMUX_INITIALIZER_UNLOCKED;
+        float bench_mbps{0};
+        const char *bench_profile{""};
+
+        static void client_task(void *pvParameters);
+        client_t *reserve_client(httpd_req_t *req);
+        esp_err_t detach(client_t &client, httpd_req_t *req);
+        void serve(client_t &client);
+        void serve_camera(client_t &client);
+        void serve_bench(client_t &client);
+        esp_err_t send_headers(client_t &client);
+        esp_err_t send_frame(client_t &client, const camera_fb_t *fb);
+        esp_err_t send_frame_chunked(httpd_req_t *req, const camera_fb_t *fb);
+        esp_err_t send_frame_writev(int sockfd, const camera_fb_t *fb);
+        static bool parse_mode(const char *value, stream_send_mode_t &mode);
+        static uint64_t task_cpu_us();
+        void account(client_t &client, size_t bytes, int64_t send_us, int64_t send_cpu_us);
+    };
+} // namespace myapp
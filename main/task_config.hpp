@@ -0,0 +1,49 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+namespace myapp
+{
+    // Where and how a long running task runs. All of them come from the
+    // "Task Configuration" menu, so the whole scheduling plan is in one place
+    // and /tasks shows how it holds up.
+    typedef struct
+    {
+        const char *name;
+        UBaseType_t priority;
+        BaseType_t core;
+        uint32_t stack; // bytes
+    } task_config_t;
+
+    static constexpr task_config_t TASK_CAPTURE{"capture_task", CONFIG_TASK_CAPTURE_PRIORITY, CONFIG_TASK_CAPTURE_CORE,
+                                                CONFIG_TASK_CAPTURE_STACK};
+    static constexpr task_config_t TASK_INFERENCE{"ai_task", CONFIG_TASK_INFERENCE_PRIORITY, CONFIG_TASK_INFERENCE_CORE,
+                                                  CONFIG_TASK_INFERENCE_STACK};
+    static constexpr task_config_t TASK_INIT{"init_task", CONFIG_TASK_INIT_PRIORITY, CONFIG_TASK_INIT_CORE,
+                                             CONFIG_TASK_INIT_STACK};
+#ifdef CONFIG_INFERENCE_PIPELINE
+    static constexpr task_config_t TASK_PREPARE{"prepare_task", CONFIG_TASK_PREPARE_PRIORITY, CONFIG_TASK_PREPARE_CORE,
+                                                CONFIG_TASK_PREPARE_STACK};
+#endif
+    // One task per stream client; the name is a prefix.
+    static constexpr task_config_t TASK_STREAM{"stream_", CONFIG_TASK_STREAM_PRIORITY, CONFIG_TASK_STREAM_CORE,
+                                               CONFIG_TASK_STREAM_STACK};
+    static constexpr task_config_t TASK_HTTPD{"httpd", CONFIG_TASK_HTTPD_PRIORITY, CONFIG_TASK_HTTPD_CORE,
+                                              CONFIG_TASK_HTTPD_STACK};
+    static constexpr task_config_t TASK_EVENTS{"events_task", CONFIG_TASK_EVENTS_PRIORITY, CONFIG_TASK_EVENTS_CORE,
+                                               CONFIG_TASK_EVENTS_STACK};
+    static constexpr task_config_t TASK_CLIP_WRITER{"clip_writer", CONFIG_TASK_STORAGE_PRIORITY,
+                                                    CONFIG_TASK_STORAGE_CORE, CONFIG_TASK_STORAGE_STACK};
+    static constexpr task_config_t TASK_DETECTION_LOG{"detection_log", CONFIG_TASK_STORAGE_PRIORITY,
+                                                      CONFIG_TASK_STORAGE_CORE, CONFIG_TASK_STORAGE_STACK};
+#ifdef CONFIG_TASK_STATS
+    static constexpr task_config_t TASK_MONITOR{"task_monitor", CONFIG_TASK_MONITOR_PRIORITY, CONFIG_TASK_MONITOR_CORE,
+                                                CONFIG_TASK_MONITOR_STACK};
+#endif
+#ifdef CONFIG_FRAME_RATE_CONTROL
+    static constexpr task_config_t TASK_FRAME_RATE{"frame_rate", CONFIG_TASK_FRAME_RATE_PRIORITY,
+                                                   CONFIG_TASK_FRAME_RATE_CORE, CONFIG_TASK_FRAME_RATE_STACK};
+#endif
+} // namespace myapp
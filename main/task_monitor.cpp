@@ -0,0 +1,127 @@
+#include "task_monitor.hpp"
+#include "esp_log.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+esp_err_t myapp::TaskMonitor::start(const task_config_t &task)
+{
+    if (xTaskCreatePinnedToCore(monitor_task, task.name, task.stack, this, task.priority, &this->task_handle, task.core) !=
+        pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create monitor task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void myapp::TaskMonitor::monitor_task(void *pvParameters)
+{
+    auto monitor = static_cast<TaskMonitor *>(pvParameters);
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1)
+    {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_TASK_STATS_INTERVAL_S * 1000));
+        monitor->sample();
+    }
+}
+
+void myapp::TaskMonitor::sample()
+{
+    configRUN_TIME_COUNTER_TYPE total;
+    int count = uxTaskGetSystemState(this->status, MAX_TASKS, &total);
+    if (count == 0)
+    {
+        ESP_LOGW(TAG, "More than %d tasks, not sampled", MAX_TASKS);
+        return;
+    }
+
+    // The total is the run time clock itself (microseconds of wall time),
+    // not a sum over cores, so a task that had a core to itself used all of
+    // the elapsed time. All cores together had portNUM_PROCESSORS times as
+    // much.
+    configRUN_TIME_COUNTER_TYPE elapsed = total - this->previous_total;
+    TaskHandle_t idle[portNUM_PROCESSORS];
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        idle[core] = xTaskGetIdleTaskHandleForCore(core);
+    }
+    uint64_t busy = 0;
+    task_sample_t samples[MAX_TASKS];
+    for (int i = 0; i < count; i++)
+    {
+        const TaskStatus_t &status = this->status[i];
+        configRUN_TIME_COUNTER_TYPE previous = 0;
+        for (int j = 0; j < this->previous_count; j++)
+        {
+            if (this->previous_handles[j] == status.xHandle)
+            {
+                previous = this->previous_counters[j];
+                break;
+            }
+        }
+        task_sample_t &sample = samples[i];
+        strlcpy(sample.name, status.pcTaskName, sizeof(sample.name));
+        sample.priority = status.uxCurrentPriority;
+        sample.core = xTaskGetCoreID(status.xHandle);
+        sample.stack_free = status.usStackHighWaterMark;
+        sample.cpu_permille = elapsed ? (uint64_t)(status.ulRunTimeCounter - previous) * 1000 / elapsed : 0;
+        if (std::find(idle, idle + portNUM_PROCESSORS, status.xHandle) == idle + portNUM_PROCESSORS)
+        {
+            busy += status.ulRunTimeCounter - previous;
+        }
+    }
+    uint16_t load_permille = elapsed ? busy * 1000 / ((uint64_t)elapsed * portNUM_PROCESSORS) : 0;
+    for (int i = 0; i < count; i++)
+    {
+        this->previous_handles[i] = this->status[i].xHandle;
+        this->previous_counters[i] = this->status[i].ulRunTimeCounter;
+    }
+    this->previous_count = count;
+    this->previous_total = total;
+
+    taskENTER_CRITICAL(&this->lock);
+    memcpy(this->samples, samples, count * sizeof(task_sample_t));
+    this->sample_count = count;
+    this->interval_ms = elapsed / 1000;
+    this->load_permille = load_permille;
+    taskEXIT_CRITICAL(&this->lock);
+
+    ESP_LOGI(TAG, "CPU load %u.%u%% of %d cores", load_permille / 10, load_permille % 10, portNUM_PROCESSORS);
+
+    for (int i = 0; i < count; i++)
+    {
+        const task_sample_t &sample = samples[i];
+        ESP_LOGI(TAG, "%-16s prio %2u core %2d stack free %5lu B cpu %3u.%u%%", sample.name, sample.priority,
+                 sample.core == tskNO_AFFINITY ? -1 : sample.core, sample.stack_free, sample.cpu_permille / 10,
+                 sample.cpu_permille % 10);
+    }
+}
+
+esp_err_t myapp::TaskMonitor::handle(httpd_req_t *req)
+{
+    task_sample_t samples[MAX_TASKS];
+    taskENTER_CRITICAL(&this->lock);
+    int count = this->sample_count;
+    uint32_t interval_ms = this->interval_ms;
+    uint16_t load_permille = this->load_permille;
+    memcpy(samples, this->samples, count * sizeof(task_sample_t));
+    taskEXIT_CRITICAL(&this->lock);
+
+    char buf[160];
+    httpd_resp_set_type(req, "application/json");
+    snprintf(buf, sizeof(buf), "{\"interval_ms\":%lu,\"cores\":%d,\"cpu_load_percent\":%u.%u,\"tasks\":[", interval_ms,
+             portNUM_PROCESSORS, load_permille / 10, load_permille % 10);
+    httpd_resp_sendstr_chunk(req, buf);
+    for (int i = 0; i < count; i++)
+    {
+        const task_sample_t &sample = samples[i];
+        snprintf(buf, sizeof(buf),
+                 "%s{\"name\":\"%s\",\"priority\":%u,\"core\":%d,\"stack_free\":%lu,\"cpu_percent\":%u.%u}",
+                 i ? "," : "", sample.name, sample.priority, sample.core == tskNO_AFFINITY ? -1 : sample.core,
+                 sample.stack_free, sample.cpu_permille / 10, sample.cpu_permille % 10);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "]}");
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "task_config.hpp"
+
+namespace myapp
+{
+    typedef struct
+    {
+        char name[configMAX_TASK_NAME_LEN];
+        UBaseType_t priority;
+        BaseType_t core;        // tskNO_AFFINITY if not pinned
+        uint32_t stack_free;    // bytes never touched since the task started
+        uint16_t cpu_permille;  // of one core, over the last interval
+    } task_sample_t;
+
+    // Samples every FreeRTOS task every CONFIG_TASK_STATS_INTERVAL_S seconds:
+    // stack high-water mark and the CPU time each one used since the
+    // previous sample, plus the load of all cores together. Each sample is
+    // logged and the latest one is served at /tasks, to tune the "Task
+    // Configuration" menu from data.
+    class TaskMonitor
+    {
+    public:
+        TaskMonitor() = default;
+        TaskMonitor(const TaskMonitor &) = delete;
+        TaskMonitor &operator=(const TaskMonitor &) = delete;
+
+        esp_err_t start(const task_config_t &task);
+
+        // httpd handler body for /tasks.
+        esp_err_t handle(httpd_req_t *req);
+
+    private:
+        static constexpr const char *TAG{"task_monitor"};
+        static constexpr int MAX_TASKS = 32;
+
+        TaskHandle_t task_handle{nullptr};
+        TaskStatus_t status[MAX_TASKS]{};
+
+        // Run time counters at the previous sample, monitor task only.
+        TaskHandle_t previous_handles[MAX_TASKS]{};
+        configRUN_TIME_COUNTER_TYPE previous_counters[MAX_TASKS]{};
+        int previous_count{0};
+        configRUN_TIME_COUNTER_TYPE previous_total{0};
+
+        mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        task_sample_t samples[MAX_TASKS]{};
+        int sample_count{0};
+        uint32_t interval_ms{0};
+        uint16_t load_permille{0}; // of all cores, idle tasks excluded
+
+        static void monitor_task(void *pvParameters);
+        void sample();
+    };
+} // namespace myapp
@@ -1,25 +1,38 @@
 #include "wifi_manager.hpp"
+#include "nvs.h"
+#include "stage_metrics.hpp"
+#include <algorithm>
+
+ESP_EVENT_DEFINE_BASE(myapp::WIFI_MANAGER_EVENT);
+
+const myapp::WifiManager::profile_settings_t myapp::WifiManager::PROFILES[WIFI_PROFILE_COUNT] = {
+    // 11b is left out so the AP never falls back to DSSS rates for us.
+    {WIFI_PS_NONE, WIFI_BW_HT40, WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N, 80, 0},
+    {WIFI_PS_MIN_MODEM, WIFI_BW_HT20, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N, 80, 0},
+    {WIFI_PS_MAX_MODEM, WIFI_BW_HT20, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N, 52, 10},
+};
 
 myapp::WifiManager::WifiManager(const char *ssid, const char *password) : ssid(ssid), password(password)
 {
     this->wifi_event_group = xEventGroupCreate();
 }
 
-void myapp::WifiManager::setup_wifi()
+void myapp::WifiManager::start(wifi_ready_cb_t on_ready, void *ctx)
 {
     ESP_LOGI(TAG, "Setting up wifi");
 
+    this->on_ready = on_ready;
+    this->on_ready_ctx = ctx;
     this->init_wifi();
+    this->load_cache();
+    this->load_profile();
     this->configure_wifi();
-    EventBits_t eventBit = xEventGroupWaitBits(this->wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
-    if (eventBit & WIFI_CONNECTED_BIT)
-    {
-        ESP_LOGI(TAG, "WiFi connected successfully");
-    }
-    else if (eventBit & WIFI_FAIL_BIT)
-    {
-        ESP_LOGE(TAG, "Failed to connect to WiFi");
-    }
+}
+
+bool myapp::WifiManager::wait_connected(TickType_t timeout)
+{
+    EventBits_t bits = xEventGroupWaitBits(this->wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, timeout);
+    return bits & WIFI_CONNECTED_BIT;
 }
 
 void myapp::WifiManager::event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -31,28 +44,66 @@ void myapp::WifiManager::handle_event(esp_event_base_t event_base, int32_t event
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
     {
+        this->cycle_start_us = esp_timer_get_time();
         this->connect_wifi();
     }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        this->apply_static_ip();
+    }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
-        ESP_LOGI(TAG, "WiFi disconnected, reconnecting...");
-        if (this->retry_num < 5)
+        wifi_event_sta_disconnected_t *event = static_cast<wifi_event_sta_disconnected_t *>(event_data);
+        xEventGroupClearBits(this->wifi_event_group, WIFI_CONNECTED_BIT);
+        this->stats.disconnects++;
+        this->stats.last_reason = event->reason;
+        if (this->connected)
+        {
+            // Link lost: the reconnect time is measured from here.
+            this->connected = false;
+            this->cycle_start_us = esp_timer_get_time();
+            ESP_LOGW(TAG, "WiFi disconnected (reason %d), reconnecting", event->reason);
+        }
+        else if (this->use_cache && ++this->fast_failures >= FAST_CONNECT_MAX_FAILURES)
         {
-            this->retry_num++;
-            ESP_LOGI(TAG, "Retrying to connect to the AP (Attempt %d)", this->retry_num);
-            this->connect_wifi();
+            ESP_LOGW(TAG, "Cached AP not reachable, falling back to a full scan");
+            this->use_cache = false;
         }
-        else
+        if (this->link_settings_pending)
         {
-            ESP_LOGW(TAG, "Maximum retry attempts reached, giving up");
-            xEventGroupSetBits(this->wifi_event_group, WIFI_FAIL_BIT);
+            this->apply_link_settings();
+            this->apply_sta_config();
         }
+        else if (this->use_cache != this->config_uses_cache)
+        {
+            this->apply_sta_config();
+        }
+        this->schedule_reconnect();
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         ip_event_got_ip_t *event = static_cast<ip_event_got_ip_t *>(event_data);
-        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        uint32_t connect_us = esp_timer_get_time() - this->cycle_start_us;
+        this->stats.connects++;
+        this->stats.fast_connects += this->use_cache ? 1 : 0;
+        this->stats.last_connect_ms = connect_us / 1000;
+        StageMetrics::instance().record(STAGE_WIFI_CONNECT, connect_us);
+        ESP_LOGI(TAG, "Got IP: " IPSTR " in %lu ms (%s, %lu attempts)", IP2STR(&event->ip_info.ip),
+                 this->stats.last_connect_ms, this->use_cache ? "cached AP" : "full scan", this->stats.attempts);
+
+        this->connected = true;
+        this->stats.attempts = 0;
+        this->fast_failures = 0;
+        this->save_cache(event->ip_info);
         xEventGroupSetBits(this->wifi_event_group, WIFI_CONNECTED_BIT);
+        if (this->on_ready)
+        {
+            this->on_ready(event->ip_info, this->on_ready_ctx);
+        }
+    }
+    else if (event_base == WIFI_MANAGER_EVENT && event_id == WIFI_MANAGER_EVENT_SET_PROFILE)
+    {
+        this->apply_profile(*static_cast<wifi_profile_t *>(event_data));
     }
 }
 
@@ -63,16 +114,89 @@ void myapp::WifiManager::init_wifi()
     ESP_ERROR_CHECK(err);
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
-    esp_netif_create_default_wifi_sta();
+    this->netif = esp_netif_create_default_wifi_sta();
     wifi_init_config_t wifi_conf = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&wifi_conf));
 
+    esp_timer_create_args_t timer_args = {
+        .callback = WifiManager::retry_timer_cb,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_retry",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &this->retry_timer));
+
     ESP_LOGI(TAG, "Registering WiFi Event handlers");
     esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, WifiManager::event_handler, this, &this->instance_any_id);
     esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, WifiManager::event_handler, this, &this->instance_got_ip);
+    esp_event_handler_instance_register(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_SET_PROFILE, WifiManager::event_handler,
+                                        this, &this->instance_set_profile);
 }
 
 void myapp::WifiManager::configure_wifi()
+{
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    this->apply_sta_config();
+    this->apply_link_settings();
+    ESP_ERROR_CHECK(esp_wifi_start());
+    this->apply_radio_settings();
+
+    ESP_LOGI(TAG, "WiFi configured and started with the %s profile", profile_name(this->get_profile()));
+}
+
+bool myapp::WifiManager::parse_profile(const char *name, wifi_profile_t &profile)
+{
+    for (int i = 0; i < WIFI_PROFILE_COUNT; i++)
+    {
+        if (strcmp(name, PROFILE_NAMES[i]) == 0)
+        {
+            profile = static_cast<wifi_profile_t>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t myapp::WifiManager::set_profile(wifi_profile_t profile)
+{
+    if (profile >= WIFI_PROFILE_COUNT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // The disconnect handler reads the profile and the pending link
+    // settings, so they are only changed on its task.
+    return esp_event_post(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_SET_PROFILE, &profile, sizeof(profile),
+                          pdMS_TO_TICKS(100));
+}
+
+void myapp::WifiManager::apply_profile(wifi_profile_t profile)
+{
+    wifi_profile_t current = this->get_profile();
+    if (profile == current)
+    {
+        return;
+    }
+    const profile_settings_t &from = PROFILES[current];
+    const profile_settings_t &to = PROFILES[profile];
+    this->profile = profile;
+    this->save_profile();
+    this->apply_radio_settings();
+    ESP_LOGI(TAG, "Switched to the %s profile", profile_name(profile));
+
+    if (from.bandwidth != to.bandwidth || from.protocol != to.protocol || from.listen_interval != to.listen_interval)
+    {
+        // Applied from the disconnect handler before reconnecting.
+        this->link_settings_pending = true;
+        esp_err_t err = esp_wifi_disconnect();
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to reassociate for the %s profile: %s", profile_name(profile), esp_err_to_name(err));
+        }
+    }
+}
+
+void myapp::WifiManager::apply_sta_config()
 {
     wifi_config_t wifi_config = {
         .sta = {
@@ -84,14 +208,231 @@ void myapp::WifiManager::configure_wifi()
     };
     strlcpy((char *)wifi_config.sta.ssid, this->ssid.c_str(), sizeof(wifi_config.sta.ssid));
     strlcpy((char *)wifi_config.sta.password, this->password.c_str(), sizeof(wifi_config.sta.password));
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    if (this->use_cache)
+    {
+        // Probe only the known channel and associate with the known AP
+        // instead of sweeping all 13 channels first.
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, this->cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = this->cache.channel;
+        ESP_LOGI(TAG, "Fast connect to %02x:%02x:%02x:%02x:%02x:%02x on channel %d",
+                 this->cache.bssid[0], this->cache.bssid[1], this->cache.bssid[2],
+                 this->cache.bssid[3], this->cache.bssid[4], this->cache.bssid[5], this->cache.channel);
+    }
+    else
+    {
+        wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+    wifi_config.sta.listen_interval = PROFILES[this->get_profile()].listen_interval;
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    this->config_uses_cache = this->use_cache;
+}
+
+void myapp::WifiManager::apply_link_settings()
+{
+    const profile_settings_t &settings = PROFILES[this->get_profile()];
+    this->link_settings_pending = false;
+    esp_err_t err = esp_wifi_set_protocol(WIFI_IF_STA, settings.protocol);
+    if (err == ESP_OK)
+    {
+        err = esp_wifi_set_bandwidth(WIFI_IF_STA, settings.bandwidth);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to apply link settings: %s", esp_err_to_name(err));
+    }
+}
 
-    ESP_LOGI(TAG, "WiFi configured and started");
+void myapp::WifiManager::apply_radio_settings()
+{
+    const profile_settings_t &settings = PROFILES[this->get_profile()];
+    esp_err_t err = esp_wifi_set_ps(settings.power_save);
+    if (err == ESP_OK)
+    {
+        err = esp_wifi_set_max_tx_power(settings.max_tx_power);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to apply radio settings: %s", esp_err_to_name(err));
+    }
 }
 
 void myapp::WifiManager::connect_wifi()
 {
-    ESP_ERROR_CHECK(esp_wifi_connect());
+    this->stats.attempts++;
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+    }
+}
+
+void myapp::WifiManager::schedule_reconnect()
+{
+    // The first retry is immediate, later ones back off exponentially up to
+    // CONFIG_WIFI_BACKOFF_MAX_MS. There is no retry limit.
+    uint32_t failures = this->stats.attempts;
+    if (failures <= 1)
+    {
+        this->connect_wifi();
+        return;
+    }
+    uint32_t shift = std::min<uint32_t>(failures - 2, 16);
+    uint32_t delay_ms = std::min<uint32_t>((uint32_t)CONFIG_WIFI_BACKOFF_MIN_MS << shift, CONFIG_WIFI_BACKOFF_MAX_MS);
+    ESP_LOGI(TAG, "Reconnect attempt %lu in %lu ms", failures + 1, delay_ms);
+    esp_timer_stop(this->retry_timer);
+    esp_timer_start_once(this->retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+void myapp::WifiManager::retry_timer_cb(void *arg)
+{
+    static_cast<myapp::WifiManager *>(arg)->connect_wifi();
+}
+
+void myapp::WifiManager::apply_static_ip()
+{
+    esp_netif_ip_info_t ip_info = {};
+    esp_ip4_addr_t dns = {};
+#ifdef CONFIG_WIFI_STATIC_IP
+    esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_IP_ADDR, &ip_info.ip);
+    esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_IP_NETMASK, &ip_info.netmask);
+    esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_IP_GATEWAY, &ip_info.gw);
+    esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_IP_DNS, &dns);
+#elif defined(CONFIG_WIFI_REUSE_LEASE)
+    if (this->use_cache)
+    {
+        ip_info = this->cache.lease;
+        dns = this->cache.dns;
+    }
+#endif
+    if (ip_info.ip.addr == 0)
+    {
+        // DHCP may have been stopped for a cached lease that turned out to
+        // be stale; make sure it runs again.
+        esp_netif_dhcpc_start(this->netif);
+        return;
+    }
+
+    // Setting the address with DHCP stopped raises IP_EVENT_STA_GOT_IP
+    // straight away, skipping the DHCP exchange.
+    esp_netif_dhcpc_stop(this->netif);
+    // Without DHCP nothing else sets a DNS server, and SNTP needs one.
+    this->apply_dns(dns);
+    esp_err_t err = esp_netif_set_ip_info(this->netif, &ip_info);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set static IP: %s", esp_err_to_name(err));
+        esp_netif_dhcpc_start(this->netif);
+    }
+}
+
+void myapp::WifiManager::apply_dns(const esp_ip4_addr_t &dns)
+{
+    if (dns.addr == 0)
+    {
+        ESP_LOGW(TAG, "No DNS server for the static address, names will not resolve");
+        return;
+    }
+    esp_netif_dns_info_t dns_info = {};
+    dns_info.ip.type = ESP_IPADDR_TYPE_V4;
+    dns_info.ip.u_addr.ip4 = dns;
+    esp_err_t err = esp_netif_set_dns_info(this->netif, ESP_NETIF_DNS_MAIN, &dns_info);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set DNS server: %s", esp_err_to_name(err));
+    }
+}
+
+void myapp::WifiManager::load_profile()
+{
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    uint8_t profile;
+    if (nvs_get_u8(handle, "profile", &profile) == ESP_OK && profile < WIFI_PROFILE_COUNT)
+    {
+        this->profile = static_cast<wifi_profile_t>(profile);
+    }
+    nvs_close(handle);
+}
+
+void myapp::WifiManager::save_profile()
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u8(handle, "profile", this->get_profile());
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store WiFi profile: %s", esp_err_to_name(err));
+    }
+}
+
+void myapp::WifiManager::load_cache()
+{
+#ifdef CONFIG_WIFI_FAST_CONNECT
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    size_t len = sizeof(this->cache);
+    esp_err_t err = nvs_get_blob(handle, "ap", &this->cache, &len);
+    nvs_close(handle);
+    this->use_cache = err == ESP_OK && len == sizeof(this->cache) && this->cache.channel != 0;
+#endif
+}
+
+void myapp::WifiManager::save_cache(const esp_netif_ip_info_t &ip_info)
+{
+#ifdef CONFIG_WIFI_FAST_CONNECT
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+    {
+        return;
+    }
+    ap_cache_t cache = {};
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+    cache.lease = ip_info;
+    esp_netif_dns_info_t dns_info;
+    if (esp_netif_get_dns_info(this->netif, ESP_NETIF_DNS_MAIN, &dns_info) == ESP_OK &&
+        dns_info.ip.type == ESP_IPADDR_TYPE_V4)
+    {
+        cache.dns = dns_info.ip.u_addr.ip4;
+    }
+    bool changed = memcmp(&cache, &this->cache, sizeof(cache)) != 0;
+    this->cache = cache;
+    this->use_cache = true;
+    if (!changed)
+    {
+        // Nothing new; don't wear the flash on every reconnect.
+        return;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(handle, "ap", &cache, sizeof(cache));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store AP cache: %s", esp_err_to_name(err));
+    }
+#endif
 }
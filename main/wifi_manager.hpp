@@ -6,12 +6,43 @@
 #include "esp_wifi_default.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include <atomic>
 #include <string>
 
 namespace myapp
 {
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+
+    // Requests to the WifiManager, handled on the default event loop task
+    // with the station events so the connection state has a single owner.
+    ESP_EVENT_DECLARE_BASE(WIFI_MANAGER_EVENT);
+    typedef enum
+    {
+        WIFI_MANAGER_EVENT_SET_PROFILE, // data: wifi_profile_t
+    } wifi_manager_event_t;
+
+    // Called from the default event loop task when the station has an IP.
+    // Keep it short: signal another task rather than doing work here.
+    typedef void (*wifi_ready_cb_t)(const esp_netif_ip_info_t &ip_info, void *ctx);
+
+    typedef enum
+    {
+        WIFI_PROFILE_MAX_THROUGHPUT, // no modem sleep, HT40, 11g/n only, full TX power
+        WIFI_PROFILE_BALANCED,       // minimum modem sleep, HT20, 11b/g/n
+        WIFI_PROFILE_LOW_POWER,      // maximum modem sleep, HT20, reduced TX power
+        WIFI_PROFILE_COUNT,
+    } wifi_profile_t;
+
+    typedef struct
+    {
+        uint32_t connects{0};        // times an IP was obtained
+        uint32_t fast_connects{0};   // of those, via the cached BSSID/channel
+        uint32_t disconnects{0};     // disconnect events, including failed attempts
+        uint32_t last_connect_ms{0}; // first attempt (or link loss) to IP
+        uint32_t attempts{0};        // attempts in the current connect cycle
+        uint8_t last_reason{0};      // wifi_err_reason_t of the last disconnect
+    } wifi_stats_t;
 
     class WifiManager
     {
@@ -21,24 +52,98 @@ namespace myapp
         {
             esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id);
             esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip);
+            esp_event_handler_instance_unregister(WIFI_MANAGER_EVENT, WIFI_MANAGER_EVENT_SET_PROFILE,
+                                                  instance_set_profile);
+            if (retry_timer)
+            {
+                esp_timer_stop(retry_timer);
+                esp_timer_delete(retry_timer);
+            }
             vEventGroupDelete(wifi_event_group);
         }
-        void setup_wifi();
+        // Starts the station and returns without waiting for association;
+        // on_ready is called every time an IP is obtained. Reconnects are
+        // retried with exponential backoff for as long as the station runs.
+        void start(wifi_ready_cb_t on_ready, void *ctx);
+        bool wait_connected(TickType_t timeout);
+        wifi_stats_t get_stats() const { return this->stats; }
+
+        // Power save and TX power change immediately. Bandwidth, protocol and
+        // listen interval only apply on association, so changing those
+        // briefly drops the link; the cached AP makes the reconnect quick.
+        // The selection is kept in NVS. The switch is posted to the event
+        // loop and happens after this returns.
+        esp_err_t set_profile(wifi_profile_t profile);
+        wifi_profile_t get_profile() const { return this->profile; }
+        static const char *profile_name(wifi_profile_t profile) { return PROFILE_NAMES[profile]; }
+        static bool parse_profile(const char *name, wifi_profile_t &profile);
         static void event_handler(void *arg, esp_event_base_t event_base,
                                   int32_t event_id, void *event_data);
         void handle_event(esp_event_base_t event_base,
                           int32_t event_id, void *event_data);
 
     private:
-        uint8_t retry_num{0};
+        // Last AP and DHCP lease, kept in NVS so the next association can
+        // skip the channel scan.
+        typedef struct
+        {
+            uint8_t bssid[6];
+            uint8_t channel;
+            uint8_t reserved;
+            esp_netif_ip_info_t lease;
+            esp_ip4_addr_t dns; // from the same lease, 0 if it had none
+        } ap_cache_t;
+
+        static constexpr const char *NVS_NAMESPACE{"wifi_manager"};
+        static constexpr uint32_t FAST_CONNECT_MAX_FAILURES{2};
+        static constexpr const char *PROFILE_NAMES[WIFI_PROFILE_COUNT] = {"max", "balanced", "low_power"};
+
+        typedef struct
+        {
+            wifi_ps_type_t power_save;
+            wifi_bandwidth_t bandwidth;
+            uint8_t protocol;
+            int8_t max_tx_power;      // 0.25 dBm units
+            uint16_t listen_interval; // beacon intervals, used with WIFI_PS_MAX_MODEM
+        } profile_settings_t;
+        static const profile_settings_t PROFILES[WIFI_PROFILE_COUNT];
+
+        // Written on the event loop task only; read from anywhere.
+        std::atomic<wifi_profile_t> profile{static_cast<wifi_profile_t>(CONFIG_WIFI_PROFILE_DEFAULT)};
+        bool link_settings_pending{false};
+
+        ap_cache_t cache{};
+        bool use_cache{false};
+        bool config_uses_cache{false};
+        bool connected{false};
+        uint32_t fast_failures{0};
+        int64_t cycle_start_us{0};
+        wifi_stats_t stats{};
+        esp_netif_t *netif{nullptr};
+        esp_timer_handle_t retry_timer{nullptr};
+        wifi_ready_cb_t on_ready{nullptr};
+        void *on_ready_ctx{nullptr};
         std::string ssid;
         std::string password;
         esp_event_handler_instance_t instance_any_id;
         esp_event_handler_instance_t instance_got_ip;
+        esp_event_handler_instance_t instance_set_profile;
         static constexpr const char *TAG{"wifi_manager"};
         EventGroupHandle_t wifi_event_group;
         void init_wifi();
         void configure_wifi();
+        void apply_sta_config();
+        void apply_link_settings();
+        void apply_radio_settings();
+        void apply_profile(wifi_profile_t profile);
+        void load_profile();
+        void save_profile();
         void connect_wifi();
+        void schedule_reconnect();
+        void apply_static_ip();
+        void apply_dns(const esp_ip4_addr_t &dns);
+        void load_cache();
+        void save_cache(const esp_netif_ip_info_t &ip_info);
+        static void retry_timer_cb(void *arg);
     };
 }; // namespace myapp
@@ -0,0 +1,78 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input_quant.hpp"
+
+static void fill_pattern(uint8_t *buf, size_t len, uint32_t seed)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = (uint8_t)(seed >> 16);
+  }
+}
+
+void test_all_byte_values(void)
+{
+  uint8_t reference[256];
+  uint8_t fast[256];
+  for (int i = 0; i < 256; i++)
+  {
+    reference[i] = fast[i] = (uint8_t)i;
+  }
+  litter_robot_detect::uint8_to_int8_bytewise(reference, sizeof(reference));
+  litter_robot_detect::uint8_to_int8(fast, sizeof(fast));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, fast, sizeof(fast));
+  TEST_ASSERT_EQUAL_INT8(-128, (int8_t)fast[0]);
+  TEST_ASSERT_EQUAL_INT8(0, (int8_t)fast[128]);
+  TEST_ASSERT_EQUAL_INT8(127, (int8_t)fast[255]);
+}
+
+void test_matches_bytewise_for_any_alignment_and_length(void)
+{
+  // Covers an input tensor sized 96x96x3 plus every head/tail combination.
+  const size_t max_len = 96 * 96 * 3 + 8;
+  uint8_t *reference = (uint8_t *)malloc(max_len + 4);
+  uint8_t *fast = (uint8_t *)malloc(max_len + 4);
+  TEST_ASSERT_NOT_NULL(reference);
+  TEST_ASSERT_NOT_NULL(fast);
+
+  const size_t lengths[] = {0, 1, 2, 3, 4, 5, 7, 8, 31, 96 * 96 * 3, max_len};
+  for (size_t offset = 0; offset < 4; offset++)
+  {
+    for (size_t len : lengths)
+    {
+      fill_pattern(reference, max_len + 4, (uint32_t)(offset * 7919 + len));
+      memcpy(fast, reference, max_len + 4);
+
+      litter_robot_detect::uint8_to_int8_bytewise(reference + offset, len);
+      litter_robot_detect::uint8_to_int8(fast + offset, len);
+
+      // Compare the whole buffer so writes outside [offset, offset + len) show up too.
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, fast, max_len + 4);
+    }
+  }
+
+  free(reference);
+  free(fast);
+}
+
+static int run_tests(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_all_byte_values);
+  RUN_TEST(test_matches_bytewise_for_any_alignment_and_length);
+  return UNITY_END();
+}
+
+#ifdef ESP_PLATFORM
+extern "C" void app_main()
+{
+  run_tests();
+}
+#else
+int main(int argc, char **argv)
+{
+  return run_tests();
+}
+#endif
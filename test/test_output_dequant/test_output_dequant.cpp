@@ -0,0 +1,164 @@
+#include <unity.h>
+#include <new>
+#include <stdlib.h>
+#include <string>
+#include "output_dequant.hpp"
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#else
+#include <malloc.h>
+#endif
+
+// Every C++ allocation in this binary goes through here, so a loop that
+// allocates and frees again still shows up.
+static size_t new_calls = 0;
+
+void *operator new(size_t size)
+{
+  new_calls++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+  {
+    abort();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+typedef struct
+{
+  size_t bytes;  // allocated from the heap right now
+  size_t blocks; // allocated blocks right now, where the heap reports them
+  size_t new_calls;
+} heap_use_t;
+
+static heap_use_t heap_use(void)
+{
+#ifdef ESP_PLATFORM
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  return {info.total_allocated_bytes, info.allocated_blocks, new_calls};
+#else
+  return {mallinfo2().uordblks, 0, new_calls};
+#endif
+}
+
+static void assert_heap_unchanged(const heap_use_t &baseline)
+{
+  heap_use_t now = heap_use();
+  TEST_ASSERT_EQUAL(baseline.bytes, now.bytes);
+  TEST_ASSERT_EQUAL(baseline.blocks, now.blocks);
+  TEST_ASSERT_EQUAL(baseline.new_calls, now.new_calls);
+}
+
+void test_int8_scores_match_float_tensor_path(void)
+{
+  // exponent -7: q / 128, so q = 64 is 0.5 -> 128.5 -> 128.
+  const int8_t q[3] = {-128, 64, 127};
+  uint8_t scores[3];
+  size_t best = litter_robot_detect::dequantize_scores(q, -7, true, scores, 3);
+  TEST_ASSERT_EQUAL_UINT8(127, scores[0]);
+  TEST_ASSERT_EQUAL_UINT8(128, scores[1]);
+  TEST_ASSERT_EQUAL_UINT8(128, scores[2]);
+  TEST_ASSERT_EQUAL(1, best);
+}
+
+void test_probability_scores_are_clamped(void)
+{
+  // exponent -14: q / 16384, so 16384 is a probability of 1.0.
+  const int16_t q[3] = {-100, 8192, 32767};
+  uint8_t scores[3];
+  size_t best = litter_robot_detect::dequantize_scores(q, -14, false, scores, 3);
+  TEST_ASSERT_EQUAL_UINT8(0, scores[0]);
+  TEST_ASSERT_EQUAL_UINT8(127, scores[1]);
+  TEST_ASSERT_EQUAL_UINT8(255, scores[2]);
+  TEST_ASSERT_EQUAL(2, best);
+}
+
+void test_unsupported_output_type_is_rejected(void)
+{
+  const float data[3] = {0.1f, 0.2f, 0.7f};
+  uint8_t scores[3];
+  litter_robot_detect::output_view_t output{litter_robot_detect::output_type_t::UNSUPPORTED, data, 0};
+  TEST_ASSERT_EQUAL(-1, litter_robot_detect::decode_output(output, scores, 3));
+}
+
+// The fields decode_result() fills in, without the ESP-IDF headers.
+typedef struct
+{
+  uint8_t empty_score;
+  uint8_t nachi_score;
+  uint8_t ngao_score;
+  std::string predicted_class;
+} fake_result_t;
+
+// decode_prediction() per frame, exactly as decode_result() calls it, with
+// the exponents the PPQ model outputs carry. Neither the heap in use nor
+// the number of allocations may move over the whole run.
+void test_decode_heap_flat_over_100k_inferences(void)
+{
+  int8_t int8_output[3] = {0, 0, 0};
+  int16_t int16_output[3] = {0, 0, 0};
+  const litter_robot_detect::output_view_t outputs[] = {
+      {litter_robot_detect::output_type_t::INT8, int8_output, -7},
+      {litter_robot_detect::output_type_t::INT16, int16_output, -14},
+  };
+  fake_result_t result{};
+  uint8_t expected[3];
+
+  // Warm up once so anything allocated lazily is already in place.
+  TEST_ASSERT_EQUAL(0, litter_robot_detect::decode_prediction(outputs[0], result));
+  heap_use_t baseline = heap_use();
+
+  for (uint32_t i = 0; i < 100000; i++)
+  {
+    int8_output[i % 3] = (int8_t)(i * 37);
+    int16_output[i % 3] = (int16_t)(i * 997);
+    const litter_robot_detect::output_view_t &output = outputs[i % 2];
+    int best = litter_robot_detect::decode_prediction(output, result);
+    TEST_ASSERT_TRUE(best >= 0 && best < 3);
+    int expected_best = i % 2 ? (int)litter_robot_detect::dequantize_scores(int16_output, -14, false, expected, 3)
+                              : (int)litter_robot_detect::dequantize_scores(int8_output, -7, true, expected, 3);
+    TEST_ASSERT_EQUAL(expected_best, best);
+    TEST_ASSERT_EQUAL_UINT8(expected[0], result.empty_score);
+    TEST_ASSERT_EQUAL_UINT8(expected[1], result.nachi_score);
+    TEST_ASSERT_EQUAL_UINT8(expected[2], result.ngao_score);
+    TEST_ASSERT_TRUE(result.predicted_class == litter_robot_detect::CLASS_NAMES[best]);
+    if (i % 10000 == 0)
+    {
+      assert_heap_unchanged(baseline);
+    }
+  }
+  assert_heap_unchanged(baseline);
+}
+
+static int run_tests(void)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_int8_scores_match_float_tensor_path);
+  RUN_TEST(test_probability_scores_are_clamped);
+  RUN_TEST(test_unsupported_output_type_is_rejected);
+  RUN_TEST(test_decode_heap_flat_over_100k_inferences);
+  return UNITY_END();
+}
+
+#ifdef ESP_PLATFORM
+extern "C" void app_main()
+{
+  run_tests();
+}
+#else
+int main(int argc, char **argv)
+{
+  return run_tests();
+}
+#endif